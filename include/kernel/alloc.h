@@ -6,6 +6,7 @@
 typedef struct kpagemap kpagemap_t;
 typedef struct suballoc suballoc_t;
 typedef struct alloc    alloc_t;
+typedef struct alloc_stat alloc_stat_t;
 
 #include <kernel/list.h>
 
@@ -31,7 +32,15 @@ struct alloc {
 	list_t alloc_list;
 };
 
+struct alloc_stat {
+	u64 kpages_allocated;
+	u64 kpages_freed;
+	u64 kmalloc_calls;
+	u64 kfree_calls;
+};
+
 void alloc_init(void);
+void alloc_stat(alloc_stat_t *stat);
 
 void *kpage_alloc(size_t npages);
 void kpage_free(void *mem);
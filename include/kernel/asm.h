@@ -40,6 +40,31 @@ static inline void w_pmpaddr0(u64 pmpaddr0)
 	asm volatile("csrw pmpaddr0, %0" : : "r" (pmpaddr0));
 }
 
+/* menvcfg is not known by older assemblers, so use csr number */
+static inline u64 r_menvcfg(void)
+{
+	u64 menvcfg;
+	asm volatile("csrr %0, 0x30a" : "=r" (menvcfg));
+	return menvcfg;
+}
+
+static inline void w_menvcfg(u64 menvcfg)
+{
+	asm volatile("csrw 0x30a, %0" : : "r" (menvcfg));
+}
+
+static inline u64 r_mcounteren(void)
+{
+	u64 mcounteren;
+	asm volatile("csrr %0, mcounteren" : "=r" (mcounteren));
+	return mcounteren;
+}
+
+static inline void w_mcounteren(u64 mcounteren)
+{
+	asm volatile("csrw mcounteren, %0" : : "r" (mcounteren));
+}
+
 static inline u64 r_mhartid(void)
 {
 	u64 mhartid;
@@ -88,6 +113,13 @@ static inline void w_sie(u64 sie)
 	asm volatile("csrw sie, %0" : : "r" (sie));
 }
 
+static inline u64 r_sip(void)
+{
+	u64 sip;
+	asm volatile("csrr %0, sip" : "=r" (sip));
+	return sip;
+}
+
 static inline void w_sip(u64 sip)
 {
 	asm volatile("csrw sip, %0" : : "r" (sip));
@@ -144,6 +176,31 @@ static inline u64 r_scause(void)
 	return scause;
 }
 
+static inline u64 r_scounteren(void)
+{
+	u64 scounteren;
+	asm volatile("csrr %0, scounteren" : "=r" (scounteren));
+	return scounteren;
+}
+
+static inline void w_scounteren(u64 scounteren)
+{
+	asm volatile("csrw scounteren, %0" : : "r" (scounteren));
+}
+
+static inline u64 r_time(void)
+{
+	u64 time;
+	asm volatile("csrr %0, time" : "=r" (time));
+	return time;
+}
+
+/* stimecmp is not known by older assemblers, so use csr number */
+static inline void w_stimecmp(u64 stimecmp)
+{
+	asm volatile("csrw 0x14d, %0" : : "r" (stimecmp));
+}
+
 static inline void w_mscratch(u64 mscratch)
 {
 	asm volatile("csrw mscratch, %0" : : "r" (mscratch));
@@ -169,5 +226,10 @@ static inline void sfence_vma(void)
 	asm volatile("sfence.vma x0, x0");
 }
 
+static inline void sfence_vma_addr(u64 vaddr)
+{
+	asm volatile("sfence.vma %0, x0" : : "r" (vaddr));
+}
+
 #endif
 
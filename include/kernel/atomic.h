@@ -28,6 +28,58 @@ static inline u64 atomic_test(volatile u64 *var)
 	return val;
 }
 
+static inline u32 atomic_fetch_add32(volatile u32 *var, u32 val)
+{
+	u32 old;
+	asm volatile("amoadd.w %0, %1, (%2)"
+			: "=r" (old)
+			: "r" (val), "r" (var));
+	return old;
+}
+
+static inline u64 atomic_fetch_add64(volatile u64 *var, u64 val)
+{
+	u64 old;
+	asm volatile("amoadd.d %0, %1, (%2)"
+			: "=r" (old)
+			: "r" (val), "r" (var));
+	return old;
+}
+
+static inline u64 atomic_fetch_or64(volatile u64 *var, u64 val)
+{
+	u64 old;
+	asm volatile("amoor.d %0, %1, (%2)"
+			: "=r" (old)
+			: "r" (val), "r" (var));
+	return old;
+}
+
+static inline u64 atomic_fetch_and64(volatile u64 *var, u64 val)
+{
+	u64 old;
+	asm volatile("amoand.d %0, %1, (%2)"
+			: "=r" (old)
+			: "r" (val), "r" (var));
+	return old;
+}
+
+/* returns true if var was equal to old and new was stored */
+static inline bool atomic_compare_and_swap(volatile u64 *var, u64 old, u64 new)
+{
+	u64 val, fail;
+	asm volatile("1:\n"
+			"lr.d %0, (%2)\n"
+			"bne %0, %3, 2f\n"
+			"sc.d %1, %4, (%2)\n"
+			"bnez %1, 1b\n"
+			"2:\n"
+			: "=&r" (val), "=&r" (fail)
+			: "r" (var), "r" (old), "r" (new)
+			: "memory");
+	return val == old;
+}
+
 static inline void atomic_acquire_membar(void)
 {
 	asm volatile("fence ir, iorw");
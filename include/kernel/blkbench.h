@@ -0,0 +1,22 @@
+#ifndef KERNEL_BLKBENCH_H
+#define KERNEL_BLKBENCH_H
+
+#include <kernel/types.h>
+
+/* number of virtio-blk device plus one to read sequentially
+ * from its start on boot, zero disables benchmark
+ */
+#ifndef BLKBENCH
+#define BLKBENCH 0
+#endif
+
+/* bytes read at each queue depth */
+#define BLKBENCH_SIZE     (8 * 1024 * 1024)
+#define BLKBENCH_BIO_SIZE 4096
+#define BLKBENCH_QD       32
+/* queue depth 1 reads timed one by one for latency percentiles */
+#define BLKBENCH_LAT_NR   1024
+
+void blkbench(void);
+
+#endif
@@ -16,6 +16,10 @@ extern struct device_driver cdev_mem;
 #define CDEV_MEM_RANDOM  6
 #define CDEV_MEM_URANDOM 7
 #define CDEV_MEM_KMSG    8
+/* lockstat_class_t table, only if LOCKSTAT is enabled */
+#define CDEV_MEM_LOCKSTAT 9
+/* irqstat_t summed over harts */
+#define CDEV_MEM_IRQSTAT  10
 
 #endif
 
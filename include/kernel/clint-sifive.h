@@ -6,8 +6,15 @@
 #define CLINT_MTIME ((volatile u64 *) (VIRT_CLINT + 0xbff8))
 #define CLINT_MTIMECMP(hartid) ((volatile u64 *) \
 		(VIRT_CLINT + 0x4000 + 8 * (hartid)))
+#define CLINT_MSIP(hartid) ((volatile u32 *) \
+		(VIRT_CLINT + 4 * (hartid)))
+
+extern volatile bool clint_sstc;
 
 void clint_init(void);
+void clint_hart_init(void);
+bool clint_timer_rearm(void);
+void clint_timer_program(u64 deadline);
+void clint_send_ipi(u64 hartid);
 
 #endif
-
@@ -6,14 +6,21 @@
 typedef struct cond cond_t;
 
 #include <kernel/mutex.h>
+#include <kernel/waitq.h>
 
 struct cond {
-	spinlock_t lock;
-	u64 wait;
+	waitq_t waitq;
 };
 
+#if LOCKSTAT
+/* waitq lock class is named after init expression */
+#define cond_init(cond) __cond_init((cond), #cond)
+void __cond_init(cond_t *cond, const char *name);
+#else
 void cond_init(cond_t *cond);
+#endif
 void cond_wait(cond_t *cond, mutex_t *mutex);
+int cond_timedwait(cond_t *cond, mutex_t *mutex, u64 expires);
 void cond_signal(cond_t *cond);
 void cond_broadcast(cond_t *cond);
 
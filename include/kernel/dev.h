@@ -7,14 +7,15 @@
 typedef struct device_driver device_driver_t;
 
 #include <kernel/proc.h>
-#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 
 #define makedev(major, minor) ((((major) & 0xff) << 8) | ((minor) & 0xff))
 #define major(dev) (((dev) & 0xff00) >> 8)
 #define minor(dev) ((dev) & 0xff)
 
 struct device_driver_table_entry {
-	mutex_t lock;
+	/* serializes register and unregister, lookup is lockless */
+	spinlock_t lock;
 	device_driver_t *device_driver;
 };
 
@@ -29,6 +30,11 @@ struct device_driver {
 	off_t (*device_driver_lseek)(fd_t *fd, off_t offset, int whence);
 	int (*device_driver_fsync)(fd_t *fd);
 	int (*device_driver_fdatasync)(fd_t *fd);
+	int (*device_driver_ioctl)(fd_t *fd, unsigned long request, void *arg);
+
+	/* callers currently inside driver */
+	u32 refcnt;
+	bool unregistering;
 };
 
 void dev_init(void);
@@ -42,6 +48,7 @@ ssize_t character_device_driver_write(fd_t *fd, const void *buf, size_t n);
 off_t character_device_driver_lseek(fd_t *fd, off_t offset, int whence);
 int character_device_driver_fsync(fd_t *fd);
 int character_device_driver_fdatasync(fd_t *fd);
+int character_device_driver_ioctl(fd_t *fd, unsigned long request, void *arg);
 
 int block_device_driver_register(int major, device_driver_t *device_driver);
 int block_device_driver_unregister(int major);
@@ -52,6 +59,7 @@ ssize_t block_device_driver_write(fd_t *fd, const void *buf, size_t n);
 off_t block_device_driver_lseek(fd_t *fd, off_t offset, int whence);
 int block_device_driver_fsync(fd_t *fd);
 int block_device_driver_fdatasync(fd_t *fd);
+int block_device_driver_ioctl(fd_t *fd, unsigned long request, void *arg);
 
 #endif
 
@@ -12,6 +12,13 @@ typedef struct ext2_directory_entry ext2_directory_entry_t;
 #include <kernel/fs.h>
 #include <kernel/mutex.h>
 #include <kernel/list.h>
+#include <kernel/virtio-blk.h>
+
+/* file blocks adjacent on disk read with one request */
+#define EXT2_MULTIBLOCK_MAX 32
+
+/* freed extents gathered before they are discarded */
+#define EXT2_DISCARD_MAX 32
 
 #define EXT2_INODE_SET_I_SIZE(devptr, inode, size) \
 	({ \
@@ -206,8 +213,8 @@ struct ext2_superblock {
 
 	u8 unused2[248];
 
-	/* we will not read sector 1 */
-	/* u8 unused3[512]; */
+	/* second sector, so whole superblock is read and written back */
+	u8 unused3[512];
 } __attribute__((packed));
 
 struct ext2_blockgroup_descriptor {
@@ -267,6 +274,10 @@ struct ext2_blkdev {
 
 	u16 inode_size;
 
+	/* freed blocks not discarded yet, adjacent ones merged */
+	virtio_blk_range_t discard[EXT2_DISCARD_MAX];
+	size_t ndiscard;
+
 	list_t devlist;
 };
 
@@ -297,6 +308,7 @@ ssize_t ext2_regular_read(ext2_blkdev_t *dev, ino_t inum, void *buf,
 		size_t len, off_t offset);
 ssize_t ext2_regular_write(ext2_blkdev_t *dev, ino_t inum, void *buf,
 		size_t len, off_t offset);
+int ext2_fsync(ext2_blkdev_t *dev, ino_t inum, bool datasync);
 int ext2_chdir(ext2_blkdev_t *dev, ino_t inum, ino_t *cwd);
 int ext2_getcwd(ext2_blkdev_t *dev, ino_t inum, char *buf, size_t size, uid_t uid, gid_t gid);
 int ext2_chmod(ext2_blkdev_t *dev, ino_t inum, mode_t mode);
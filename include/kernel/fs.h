@@ -12,9 +12,9 @@ typedef struct fifodesc     fifodesc_t;
 #include <kernel/list.h>
 #include <kernel/spinlock.h>
 
-extern spinlock_t opened_inodes_lock;
+extern rwlock_t opened_inodes_lock;
 extern opened_inode_t opened_inodes;
-extern spinlock_t fifodescs_lock;
+extern rwlock_t fifodescs_lock;
 extern fifodesc_t fifodescs;
 
 struct opened_inode {
@@ -0,0 +1,43 @@
+#ifndef KERNEL_IPI_H
+#define KERNEL_IPI_H
+
+#include <kernel/types.h>
+
+typedef struct ipi_call  ipi_call_t;
+typedef struct tlb_batch tlb_batch_t;
+
+#include <kernel/list.h>
+
+/* bits in per-cpu ipi_pending */
+#define IPI_RESCHED 0
+#define IPI_CALL    1
+
+/* more pages than this are flushed with one sfence.vma */
+#define TLB_BATCH_SIZE 16
+
+struct ipi_call {
+	void (*func)(void *arg);
+	void *arg;
+	/* set by target hart after func returned */
+	volatile u64 done;
+	list_t calls;
+};
+
+/* virtual addresses collected for one shootdown */
+struct tlb_batch {
+	size_t n;
+	bool flush_all;
+	u64 vaddrs[TLB_BATCH_SIZE];
+};
+
+void ipi_init(void);
+void ipi_hart_init(void);
+void ipi_irq_handler(void);
+void ipi_resched(u64 cpu);
+void ipi_call_mask(u64 cpumask, void (*func)(void *arg), void *arg);
+
+void tlb_batch_init(tlb_batch_t *batch);
+void tlb_batch_add(tlb_batch_t *batch, u64 vaddr);
+void tlb_batch_flush(tlb_batch_t *batch, u64 cpumask);
+
+#endif
@@ -1,9 +1,36 @@
 #ifndef KERNEL_IRQ_H
 #define KERNEL_IRQ_H
 
-void irq_hart_init(void);
+#include <kernel/types.h>
+
+typedef struct irqstat irqstat_t;
 
 #include <kernel/proc.h>
+#include <kernel/percpu.h>
+
+/* ioctl on CDEV_MEM_IRQSTAT clearing all counters */
+#define IRQSTAT_IOCTL_RESET 0x4901
+
+/* Times are in mtime cycles. Hardirq time is spent in external
+ * interrupt top halves with interrupts disabled, softirq time in
+ * bottom halves with interrupts enabled. Reading CDEV_MEM_IRQSTAT
+ * returns this struct summed over all harts.
+ */
+struct irqstat {
+	u64 hardirqs;
+	u64 hardirq_total;
+	u64 hardirq_max;
+	u64 softirqs;
+	u64 softirq_total;
+	u64 softirq_max;
+};
+
+DECLARE_PER_CPU(irqstat_t, irqstat);
+
+void irq_hart_init(void);
+
+void irq_stat(irqstat_t *stat);
+void irq_stat_reset(void);
 
 static inline void irq_on(void)
 {
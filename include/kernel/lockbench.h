@@ -0,0 +1,18 @@
+#ifndef KERNEL_LOCKBENCH_H
+#define KERNEL_LOCKBENCH_H
+
+#include <kernel/types.h>
+
+/* number of harts taking part in lock contention benchmark,
+ * zero disables it. qemu must be started with at least that many
+ */
+#ifndef LOCKBENCH
+#define LOCKBENCH 0
+#endif
+
+#define LOCKBENCH_ITERS 100000
+
+void lockbench(void);
+
+#endif
+
@@ -0,0 +1,54 @@
+#ifndef KERNEL_LOCKSTAT_H
+#define KERNEL_LOCKSTAT_H
+
+#include <kernel/types.h>
+
+typedef struct lockstat_class lockstat_class_t;
+
+/* lock statistics, zero compiles all instrumentation out */
+#ifndef LOCKSTAT
+#define LOCKSTAT 0
+#endif
+
+#define LOCKSTAT_NCLASS   128
+#define LOCKSTAT_NAME_MAX 32
+
+#define LOCKSTAT_SPINLOCK 0
+#define LOCKSTAT_MUTEX    1
+/* read side of rwlock, write side is accounted by its spinlock */
+#define LOCKSTAT_RWLOCK   2
+
+/* ioctl on CDEV_MEM_LOCKSTAT clearing all counters */
+#define LOCKSTAT_IOCTL_RESET 0x4c01
+
+/* Locks initialized with the same expression, for example
+ * &proctable[i].lock, share one class. Times are in mtime cycles,
+ * waits are counted only for contended acquisitions. Reading
+ * CDEV_MEM_LOCKSTAT returns array of these structs.
+ */
+struct lockstat_class {
+	char name[LOCKSTAT_NAME_MAX];
+	u64 type;
+	/* summed from per-cpu counters on read */
+	u64 acquisitions;
+	u64 contended;
+	u64 wait_total;
+	u64 wait_max;
+	u64 hold_max;
+	/* callers of acquire which waited or held the longest */
+	u64 wait_max_site;
+	u64 hold_max_site;
+};
+
+#if LOCKSTAT
+
+lockstat_class_t *lockstat_class_get(const char *name, int type);
+void lockstat_acquired(lockstat_class_t *class, u64 start,
+		bool contended, void *site);
+void lockstat_released(lockstat_class_t *class, u64 acquired_at, void *site);
+void lockstat_reset(void);
+ssize_t lockstat_read(void *buf, size_t n, off_t offset);
+
+#endif
+
+#endif
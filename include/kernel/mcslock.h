@@ -0,0 +1,46 @@
+#ifndef KERNEL_MCSLOCK_H
+#define KERNEL_MCSLOCK_H
+
+#include <kernel/types.h>
+
+typedef volatile struct mcslock mcslock_t;
+typedef volatile struct mcsnode mcsnode_t;
+
+/* Every waiter spins on its own node, so release touches only
+ * cache line of the next waiter. Node is owned by the caller
+ * and must live until mcslock_release.
+ */
+struct mcsnode {
+	mcsnode_t *next;
+	u64 locked;
+};
+
+struct mcslock {
+	mcsnode_t *tail;
+};
+
+#include <kernel/irq.h>
+
+void mcslock_init(mcslock_t *ml);
+void mcslock_acquire(mcslock_t *ml, mcsnode_t *node);
+void mcslock_release(mcslock_t *ml, mcsnode_t *node);
+void mcslock_acquire_irqsave(mcslock_t *ml, mcsnode_t *node, int *flags);
+void mcslock_release_irqrestore(mcslock_t *ml, mcsnode_t *node, int flags);
+
+#define mcslock_acquire_irqsave(ml, node, flags) \
+	({ \
+		(flags) = irq_enabled(); \
+		irq_off(); \
+		mcslock_acquire(ml, node); \
+	})
+
+#define mcslock_release_irqrestore(ml, node, flags) \
+	({ \
+		mcslock_release(ml, node); \
+		if (flags) { \
+			irq_on(); \
+		} \
+	})
+
+#endif
+
@@ -6,13 +6,29 @@
 typedef struct mutex mutex_t;
 
 #include <kernel/spinlock.h>
+#include <kernel/waitq.h>
+#include <kernel/proc.h>
+#include <kernel/lockstat.h>
 
 struct mutex {
-	spinlock_t sl;
 	u64 lock;
+	proc_t *owner;
+	/* sleeping waiters, waitq lock protects all fields */
+	waitq_t waitq;
+#if LOCKSTAT
+	lockstat_class_t *class;
+	u64 acquired_at;
+	void *acquired_site;
+#endif
 };
 
+#if LOCKSTAT
+/* lock class is named after init expression */
+#define mutex_init(mutex) __mutex_init((mutex), #mutex)
+void __mutex_init(mutex_t *mutex, const char *name);
+#else
 void mutex_init(mutex_t *mutex);
+#endif
 void mutex_lock(mutex_t *mutex);
 void mutex_unlock(mutex_t *mutex);
 
@@ -0,0 +1,56 @@
+#ifndef KERNEL_PERCPU_H
+#define KERNEL_PERCPU_H
+
+#include <kernel/types.h>
+#include <kernel/asm.h>
+#include <kernel/atomic.h>
+
+/* must match assert in kernel.ld */
+#define PERCPU_SIZE (16 * 1024)
+
+#define CACHE_LINE_SIZE 64
+
+/* keep hot shared data away from its neighbours */
+#define __cacheline_aligned __attribute__((aligned(CACHE_LINE_SIZE)))
+
+/* Per-cpu variables are linked into .percpu section which only
+ * gives their offsets, every hart gets its own cache line
+ * aligned copy in percpu_areas. tp holds address of current copy.
+ * Copies are zeroed on boot, initializers are not applied.
+ */
+#define DEFINE_PER_CPU(type, name) \
+	__attribute__((section(".percpu"))) __typeof__(type) name
+
+#define DECLARE_PER_CPU(type, name) \
+	extern __attribute__((section(".percpu"))) __typeof__(type) name
+
+extern char percpu_start[];
+extern u8 percpu_areas[NCPU][PERCPU_SIZE];
+
+#define per_cpu_ptr(ptr, cpu) ((__typeof__(ptr)) \
+		((u64) (ptr) - (u64) percpu_start + (u64) percpu_areas[cpu]))
+
+/* we must not be migrated while pointer is used */
+#define this_cpu_ptr(ptr) ((__typeof__(ptr)) \
+		((u64) (ptr) - (u64) percpu_start + r_tp()))
+
+/* Counters are u64 per-cpu variables. amoadd makes increment
+ * safe against interrupts, and against migration too, we just
+ * add to another hart copy then. Reader sums all copies.
+ */
+#define this_cpu_add(var, val) \
+	atomic_fetch_add64(this_cpu_ptr(&(var)), (val))
+
+#define this_cpu_inc(var) this_cpu_add(var, 1)
+
+#define per_cpu_sum(var) ({ \
+	u64 __sum = 0; \
+	for (size_t __cpu = 0; __cpu < NCPU; __cpu++) { \
+		__sum += *(volatile u64 *) per_cpu_ptr(&(var), __cpu); \
+	} \
+	__sum; \
+})
+
+u64 percpu_hart_init(u64 hartid);
+
+#endif
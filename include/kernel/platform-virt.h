@@ -31,6 +31,9 @@
 
 #define VIRT_DRAM 0x80000000ull
 
+/* mtime frequency */
+#define VIRT_TIMEBASE_FREQ 10000000ull
+
 /* irq lines */
 #define VIRT_PLIC_UART0 0xa
 
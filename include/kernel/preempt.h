@@ -0,0 +1,33 @@
+#ifndef KERNEL_PREEMPT_H
+#define KERNEL_PREEMPT_H
+
+#include <kernel/types.h>
+#include <kernel/irq.h>
+#include <kernel/proc.h>
+
+/* Counter is per-cpu, so we increment it with interrupts
+ * disabled. Otherwise we can be preempted and migrated between
+ * cpuid and store, and write counter of another cpu.
+ */
+static inline void preempt_disable(void)
+{
+	bool irqflags = irq_enabled();
+	irq_off();
+	curcpu()->preempt_count++;
+	if (irqflags) {
+		irq_on();
+	}
+}
+
+static inline void preempt_enable(void)
+{
+	bool irqflags = irq_enabled();
+	irq_off();
+	curcpu()->preempt_count--;
+	if (irqflags) {
+		irq_on();
+	}
+}
+
+#endif
+
@@ -15,6 +15,10 @@ typedef struct proc      proc_t;
 #include <kernel/riscv64.h>
 #include <kernel/spinlock.h>
 #include <kernel/fs.h>
+#include <kernel/timer.h>
+#include <kernel/waitq.h>
+#include <kernel/percpu.h>
+#include <kernel/workqueue.h>
 
 #define PROC_STATE_KILLED    0
 #define PROC_STATE_PREPARING 1
@@ -22,6 +26,8 @@ typedef struct proc      proc_t;
 #define PROC_STATE_RUNNING   3
 #define PROC_STATE_STOPPED   4
 #define PROC_STATE_ZOMBIE    5
+/* zombie whose exit status was taken, it waits for teardown */
+#define PROC_STATE_REAPED    6
 
 struct trapframe {
 	u64 ra;
@@ -57,7 +63,8 @@ struct trapframe {
 	u64 t6;
 	u64 epc;
 
-	u64 cpuid;
+	/* kernel tp, per-cpu area of hart */
+	u64 percpu;
 	u64 kstack;
 	u64 kerneltrap;
 	u64 kpagetable;
@@ -66,23 +73,12 @@ struct trapframe {
 	u64 upagetable;
 } __attribute__((packed));
 
+/* only callee-saved registers, context_switch is a call */
 struct context {
 	u64 ra;
 	u64 sp;
-	u64 gp;
-	u64 t0;
-	u64 t1;
-	u64 t2;
 	u64 fp;
 	u64 s1;
-	u64 a0;
-	u64 a1;
-	u64 a2;
-	u64 a3;
-	u64 a4;
-	u64 a5;
-	u64 a6;
-	u64 a7;
 	u64 s2;
 	u64 s3;
 	u64 s4;
@@ -93,16 +89,21 @@ struct context {
 	u64 s9;
 	u64 s10;
 	u64 s11;
-	u64 t3;
-	u64 t4;
-	u64 t5;
-	u64 t6;
 	u64 kpagetable;
 } __attribute__((packed));
 
 struct cpu {
 	context_t *context;
 	proc_t *proc;
+	/* process we switched from, its lock is still held */
+	proc_t *prev;
+
+	/* preemption is allowed only if zero */
+	u64 preempt_count;
+	/* set by timer tick and wakeups, checked on irq return */
+	bool need_resched;
+	/* incremented on each quiescent state, see rcu.h */
+	u64 rcu_qs;
 };
 
 struct segment {
@@ -134,6 +135,16 @@ struct proc {
 	int state;
 	void *wchan;
 
+	/* sleeping on waitq or queued to run */
+	waitq_t *waitq;
+	list_t waitq_list;
+	list_t runq_list;
+
+	ktimer_t timer;
+	bool timedout;
+
+	/* ids are read far more often than written */
+	seqlock_t idlock;
 	pid_t pid;
 	pid_t sid;
 	pid_t pgid;
@@ -165,6 +176,13 @@ struct proc {
 	mode_t umask;
 
 	dev_t ctty;
+
+	/* kernel threads have no trapframe and user memory */
+	void (*kthread_func)(void *arg);
+	void *kthread_arg;
+
+	/* teardown is done by worker, see proc_destroy_deferred */
+	work_t destroy_work;
 };
 
 void proc_init(void);
@@ -172,21 +190,35 @@ void proc_hart_init(void);
 
 int proc_create(void *elf, size_t elfsz);
 void proc_destroy(proc_t *proc);
+void proc_destroy_deferred(proc_t *proc);
+
+proc_t *kthread_create(void (*func)(void *arg), void *arg);
+void kthread_exit(void);
+
+DECLARE_PER_CPU(u64, cpu_id);
+DECLARE_PER_CPU(cpu_t, cpus);
 
 static inline u64 cpuid(void)
 {
-	return r_tp();
+	return *this_cpu_ptr(&cpu_id);
 }
 
 static inline cpu_t *curcpu(void)
 {
-	extern cpu_t cpus[NCPU];
-	return &cpus[cpuid()];
+	return this_cpu_ptr(&cpus);
 }
 
 static inline proc_t *curproc(void)
 {
-	return curcpu()->proc;
+	proc_t *proc;
+	u64 sstatus = r_sstatus();
+
+	/* we must not be preempted and migrated between cpuid and load */
+	w_sstatus(sstatus & ~SSTATUS_SIE);
+	proc = curcpu()->proc;
+	w_sstatus(sstatus);
+
+	return proc;
 }
 
 #endif
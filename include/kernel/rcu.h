@@ -0,0 +1,44 @@
+#ifndef KERNEL_RCU_H
+#define KERNEL_RCU_H
+
+#include <kernel/types.h>
+#include <kernel/atomic.h>
+#include <kernel/preempt.h>
+#include <kernel/proc.h>
+
+/* Read side critical sections run with preemption disabled and
+ * must not sleep, so a hart which switches context, idles or
+ * returns to user mode holds no rcu protected pointer.
+ */
+static inline void rcu_read_lock(void)
+{
+	preempt_disable();
+}
+
+static inline void rcu_read_unlock(void)
+{
+	preempt_enable();
+}
+
+#define rcu_dereference(p) ({ \
+	typeof(p) __p = *(volatile typeof(p) *) &(p); \
+	atomic_acquire_membar(); \
+	__p; \
+})
+
+/* readers must see initialized object before pointer to it */
+#define rcu_assign_pointer(p, v) do { \
+	atomic_release_membar(); \
+	*(volatile typeof(p) *) &(p) = (v); \
+} while (0)
+
+/* report quiescent state of this hart, interrupts should be disabled */
+static inline void rcu_quiescent(void)
+{
+	curcpu()->rcu_qs++;
+}
+
+void rcu_hart_init(void);
+void synchronize_rcu(void);
+
+#endif
@@ -26,17 +26,27 @@
 #define STVEC_MODE_DIRECT 0
 #define STVEC_MODE_VECTORED 1
 
+#define MIE_MSIE (1 << 3)
 #define MIE_MTIE (1 << 7)
 #define SIE_SSIE (1 << 1)
 #define SIE_STIE (1 << 5)
 #define SIE_SEIE (1 << 9)
 
+#define MIP_SSIP (1 << 1)
 #define MIP_STIP (1 << 5)
 #define SIP_SSIP (1 << 1)
 
+#define MENVCFG_STCE (1ull << 63)
+
+#define MCOUNTEREN_TM (1 << 1)
+#define SCOUNTEREN_TM (1 << 1)
+
 #define SCAUSE_INTERRUPT_MASK (1ul << 63)
 #define SCAUSE_EXCEPTION_CODE_MASK (~(1ul << 63))
 
+/* machine software interrupt, written without suffix for assembler */
+#define MCAUSE_MSOFTWARE_IRQ 0x8000000000000003
+
 #define SCAUSE_SOFTWARE_IRQ 1
 #define SCAUSE_TIMER_IRQ 5
 #define SCAUSE_EXTERNAL_IRQ 9
@@ -3,8 +3,13 @@
 
 #include <kernel/proc.h>
 
+void sched_init(void);
+void sched_wakeup(proc_t *proc);
 void scheduler(void);
 void sched(void);
+void sched_switch(void);
+void sched_finish(void);
+void sched_preempt(void);
 void sched_zombie(void);
 
 void context_switch(context_t *old, context_t *new);
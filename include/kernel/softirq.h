@@ -0,0 +1,18 @@
+#ifndef KERNEL_SOFTIRQ_H
+#define KERNEL_SOFTIRQ_H
+
+#include <kernel/types.h>
+
+/* softirq vectors, lower number runs first */
+#define SOFTIRQ_BLK  0
+#define SOFTIRQ_UART 1
+#define SOFTIRQ_MAX  2
+
+/* rounds on one irq exit, rest waits for next interrupt */
+#define SOFTIRQ_RESTART_MAX 8
+
+void softirq_register(u32 nr, void (*handler)(void));
+void softirq_raise(u32 nr);
+void softirq_run(void);
+
+#endif
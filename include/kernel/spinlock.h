@@ -4,14 +4,56 @@
 #include <kernel/types.h>
 
 typedef volatile struct spinlock spinlock_t;
+typedef volatile struct rwlock   rwlock_t;
+typedef volatile struct seqlock  seqlock_t;
 
+#include <kernel/lockstat.h>
+
+/* ticket lock, holders are served in fifo order */
 struct spinlock {
-	u64 lock;
+	u32 next;
+	u32 owner;
+#if LOCKSTAT
+	lockstat_class_t *class;
+	u64 acquired_at;
+	void *acquired_site;
+#endif
+};
+
+/* writer bit in rwlock cnt */
+#define RWLOCK_WRITER (1u << 31)
+
+/* Many readers or one writer. Writer sets RWLOCK_WRITER and
+ * waits for readers to drain, new readers back off meanwhile.
+ */
+struct rwlock {
+	/* serializes writers */
+	spinlock_t wlock;
+	/* number of readers and writer bit */
+	u32 cnt;
+#if LOCKSTAT
+	/* readers only, they spin while writer holds or waits */
+	lockstat_class_t *class;
+#endif
+};
+
+/* Readers do not write anything, they retry if seq changed
+ * or was odd, so data must be safe to read while it changes.
+ */
+struct seqlock {
+	spinlock_t lock;
+	u32 seq;
 };
 
 #include <kernel/irq.h>
 
+#if LOCKSTAT
+/* lock class is named after init expression */
+#define spinlock_init(sl) __spinlock_init((sl), #sl)
+void __spinlock_init(spinlock_t *sl, const char *name);
+#else
 void spinlock_init(spinlock_t *sl);
+#endif
 void spinlock_acquire(spinlock_t *sl);
 void spinlock_release(spinlock_t *sl);
 void spinlock_acquire_irq(spinlock_t *sl);
@@ -47,5 +89,78 @@ void spinlock_release_irqrestore(spinlock_t *sl, int flags);
 		} \
 	})
 
+#if LOCKSTAT
+#define rwlock_init(rw) __rwlock_init((rw), #rw)
+void __rwlock_init(rwlock_t *rw, const char *name);
+#else
+void rwlock_init(rwlock_t *rw);
+#endif
+void rwlock_acquire_read(rwlock_t *rw);
+void rwlock_release_read(rwlock_t *rw);
+void rwlock_acquire_write(rwlock_t *rw);
+void rwlock_release_write(rwlock_t *rw);
+void rwlock_acquire_read_irqsave(rwlock_t *rw, int *flags);
+void rwlock_release_read_irqrestore(rwlock_t *rw, int flags);
+void rwlock_acquire_write_irqsave(rwlock_t *rw, int *flags);
+void rwlock_release_write_irqrestore(rwlock_t *rw, int flags);
+
+#define rwlock_acquire_read_irqsave(rw, flags) \
+	({ \
+		(flags) = irq_enabled(); \
+		irq_off(); \
+		rwlock_acquire_read(rw); \
+	})
+
+#define rwlock_release_read_irqrestore(rw, flags) \
+	({ \
+		rwlock_release_read(rw); \
+		if (flags) { \
+			irq_on(); \
+		} \
+	})
+
+#define rwlock_acquire_write_irqsave(rw, flags) \
+	({ \
+		(flags) = irq_enabled(); \
+		irq_off(); \
+		rwlock_acquire_write(rw); \
+	})
+
+#define rwlock_release_write_irqrestore(rw, flags) \
+	({ \
+		rwlock_release_write(rw); \
+		if (flags) { \
+			irq_on(); \
+		} \
+	})
+
+#if LOCKSTAT
+#define seqlock_init(sq) __seqlock_init((sq), #sq)
+void __seqlock_init(seqlock_t *sq, const char *name);
+#else
+void seqlock_init(seqlock_t *sq);
+#endif
+void seqlock_write_begin(seqlock_t *sq);
+void seqlock_write_end(seqlock_t *sq);
+u32 seqlock_read_begin(seqlock_t *sq);
+bool seqlock_read_retry(seqlock_t *sq, u32 seq);
+void seqlock_write_begin_irqsave(seqlock_t *sq, int *flags);
+void seqlock_write_end_irqrestore(seqlock_t *sq, int flags);
+
+#define seqlock_write_begin_irqsave(sq, flags) \
+	({ \
+		(flags) = irq_enabled(); \
+		irq_off(); \
+		seqlock_write_begin(sq); \
+	})
+
+#define seqlock_write_end_irqrestore(sq, flags) \
+	({ \
+		seqlock_write_end(sq); \
+		if (flags) { \
+			irq_on(); \
+		} \
+	})
+
 #endif
 
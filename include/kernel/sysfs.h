@@ -32,6 +32,7 @@ int sys_fchownat(int dirfd, const char *pathname,
 int sys_isatty(int fd);
 int sys_fsync(int fd);
 int sys_fdatasync(int fd);
+int sys_ioctl(int fd, unsigned long request, void *arg);
 
 #endif
 
@@ -5,10 +5,25 @@
 #include <abi-bits/utsname.h>
 #include <abi-bits/resource.h>
 
+#ifndef CLOCK_REALTIME
+#define CLOCK_REALTIME 0
+#endif
+
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC 1
+#endif
+
+#ifndef TIMER_ABSTIME
+#define TIMER_ABSTIME 1
+#endif
+
 void sys_exit(int status);
 pid_t sys_getpid(void);
 pid_t sys_getppid(void);
 int sys_sleep(const struct timespec *req, struct timespec *rem);
+int sys_clock_gettime(int clock_id, struct timespec *tp);
+int sys_clock_nanosleep(int clock_id, int flags,
+		const struct timespec *req, struct timespec *rem);
 pid_t sys_fork(void);
 int sys_execve(const char *pathname, char *const argv[], char *const envp[]);
 int sys_uname(struct utsname *buf);
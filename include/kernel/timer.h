@@ -0,0 +1,54 @@
+#ifndef KERNEL_TIMER_H
+#define KERNEL_TIMER_H
+
+#include <kernel/types.h>
+
+typedef struct ktimer ktimer_t;
+
+#include <kernel/riscv64.h>
+
+#define NSEC_PER_SEC 1000000000ull
+#define NSEC_PER_TICK (NSEC_PER_SEC / VIRT_TIMEBASE_FREQ)
+
+/* rounds up, so sleep is never shorter than asked, and can not overflow */
+#define KTIMER_NS_TO_TICKS(ns) \
+	((u64) (ns) / NSEC_PER_TICK + ((u64) (ns) % NSEC_PER_TICK != 0))
+#define KTIMER_TICKS_TO_NS(ticks) ((u64) (ticks) * NSEC_PER_TICK)
+
+/* heapidx value of not armed timer */
+#define KTIMER_IDLE ((size_t) -1)
+
+struct ktimer {
+	/* mtime value when timer expires */
+	u64 expires;
+	void (*func)(void *arg);
+	void *arg;
+
+	/* hart queue and position in its heap */
+	size_t cpu;
+	size_t heapidx;
+};
+
+void ktimer_init(void);
+
+void ktimer_setup(ktimer_t *timer, void (*func)(void *arg), void *arg);
+int ktimer_add(ktimer_t *timer, u64 expires);
+bool ktimer_cancel(ktimer_t *timer);
+
+int ktimer_sleep_until(u64 expires);
+
+void ktimer_irq_handler(void);
+
+static inline u64 ktimer_now(void)
+{
+	return r_time();
+}
+
+/* expiry ticks from now, saturates at maximum instead of wrapping */
+static inline u64 ktimer_expires_in(u64 ticks)
+{
+	u64 now = ktimer_now();
+	return ticks > (u64) -1 - now ? (u64) -1 : now + ticks;
+}
+
+#endif
@@ -7,7 +7,12 @@
 
 typedef volatile struct virtio_blk_mmio virtio_blk_mmio_t;
 typedef struct virtio_blk               virtio_blk_t;
+typedef struct virtio_blk_queue         virtio_blk_queue_t;
 typedef struct virtio_blk_req           virtio_blk_req_t;
+typedef struct virtio_blk_seg           virtio_blk_seg_t;
+typedef struct virtio_blk_bio           virtio_blk_bio_t;
+typedef struct virtio_blk_stat          virtio_blk_stat_t;
+typedef struct virtio_blk_range         virtio_blk_range_t;
 
 struct virtio_blk_mmio {
 	virtio_mmio_t virtio_mmio;
@@ -32,7 +37,8 @@ struct virtio_blk_mmio {
 		u32 opt_io_size;
 	} topology;
 	u8 writeback;
-	u8 unused0[3];
+	u8 unused0;
+	u16 num_queues;
 	u32 max_discard_sectors;
 	u32 max_discard_seg;
 	u32 discard_sector_alignment;
@@ -42,14 +48,59 @@ struct virtio_blk_mmio {
 	u8 unused1[3];
 } /*__attribute__((packed))*/;
 
+struct virtio_blk_stat {
+	u64 notifies;
+	u64 interrupts;
+	/* bytes of data in submitted requests */
+	u64 bytes;
+};
+
+/* one virtqueue, harts submit to their own */
+struct virtio_blk_queue {
+	virtio_blk_t *dev;
+	virtq_t virtq;
+	u16 queue_sel;
+	/* waiters polling used ring, interrupts are off while nonzero */
+	u32 npolling;
+	/* bios in flight and their headers indexed by buffer id */
+	virtio_blk_bio_t **inflight;
+	virtio_blk_req_t *reqs;
+	u32 ninflight;
+	u64 notifies;
+	u64 bytes;
+	spinlock_t lock;
+};
+
 struct virtio_blk {
-	u32 features;
+	/* negotiated features */
+	u64 features;
 	u64 capacity;
-	virtq_t requestq;
+	/* data descriptors per request and bytes per descriptor */
+	u32 seg_max;
+	u32 size_max;
+	virtio_blk_queue_t *queues;
+	u32 nqueues;
+	/* completions per interrupt asked with event index */
+	u32 coalesce;
+	/* poll all requests on wait, not just ones asking for it */
+	bool poll;
+	/* device has volatile write cache, writes need flush to be durable */
+	bool writeback;
+	/* callers arriving before flush starts share it */
+	spinlock_t flush_lock;
+	u64 flush_started;
+	u64 flush_done;
+	bool flushing;
+	int flush_err;
+	u64 interrupts;
+	/* discard limits, zero if device can not discard */
+	u32 max_discard_sectors;
+	u32 max_discard_seg;
+	u32 discard_alignment;
+	/* sectors per write zeroes range, zero if device can not */
+	u32 max_write_zeroes_sectors;
 	virtio_blk_mmio_t *base;
-	spinlock_t lock;
 	bool isvalid;
-	bool waitop;
 };
 
 struct virtio_blk_req {
@@ -65,8 +116,54 @@ struct virtio_blk_req {
 	u8 status;
 } /*__attribute__((packed))*/;
 
+/* Part of request data, length is multiple of sector size.
+ * Discard and write zeroes carry ranges instead.
+ */
+struct virtio_blk_seg {
+	void *addr;
+	u32 len;
+};
+
+/* data of discard and write zeroes requests, one per range */
+struct virtio_blk_range {
+	u64 sector;
+	u32 num_sectors;
+	/* write zeroes may deallocate range if unmap is set */
+	u32 flags;
+};
+
+#define VIRTIO_BLK_WRITE_ZEROES_F_UNMAP 1
+
 #include <kernel/list.h>
 
+/* One request, its segments must fit into seg_max descriptors
+ * after size_max split. Bio and segments must stay valid until
+ * it completes.
+ */
+struct virtio_blk_bio {
+	u32 type;
+	u64 sector;
+	const virtio_blk_seg_t *segs;
+	size_t nsegs;
+
+	/* Called if set from softirq, or from waiter polling the queue
+	 * with preemption disabled. Must not sleep.
+	 */
+	void (*end_io)(virtio_blk_bio_t *bio);
+	void *private;
+
+	/* virtio_blk_wait polls used ring before it sleeps */
+	bool poll;
+
+	/* 0 or -EIO, valid when done is set */
+	int status;
+	bool done;
+
+	/* driver private */
+	virtio_blk_queue_t *queue;
+	list_t completed;
+};
+
 /* features */
 #define VIRTIO_BLK_F_SIZE_MAX     1
 #define VIRTIO_BLK_F_SEG_MAX      2
@@ -76,10 +173,47 @@ struct virtio_blk_req {
 #define VIRTIO_BLK_F_FLUSH        9
 #define VIRTIO_BLK_F_TOPOLOGY     10
 #define VIRTIO_BLK_F_CONFIG_WCE   11
+#define VIRTIO_BLK_F_MQ           12
 #define VIRTIO_BLK_F_DISCARD      13
 #define VIRTIO_BLK_F_WRITE_ZEROES 14
 
-/* blk queues */
+/* features driver can use */
+#define VIRTIO_BLK_DRIVER_FEATURES \
+	((1ull << VIRTIO_BLK_F_SIZE_MAX) | (1ull << VIRTIO_BLK_F_SEG_MAX) | \
+	 (1ull << VIRTIO_F_RING_INDIRECT_DESC) | \
+	 (1ull << VIRTIO_F_RING_EVENT_IDX) | (1ull << VIRTIO_F_VERSION_1) | \
+	 (1ull << VIRTIO_F_RING_PACKED) | (1ull << VIRTIO_BLK_F_MQ) | \
+	 (1ull << VIRTIO_BLK_F_FLUSH) | (1ull << VIRTIO_BLK_F_CONFIG_WCE) | \
+	 (1ull << VIRTIO_BLK_F_DISCARD) | (1ull << VIRTIO_BLK_F_WRITE_ZEROES))
+
+/* upper bounds if device does not limit requests itself */
+#define VIRTIO_BLK_SEG_MAX  64
+#define VIRTIO_BLK_SIZE_MAX (1 << 20)
+
+/* upper bound of indirect tables, requests above it use direct chains */
+#define VIRTIO_BLK_INDIRECT_MAX 128
+
+/* Default number of completions device gathers before interrupt,
+ * never more than requests in flight. Needs event index feature.
+ */
+#ifndef VIRTIO_BLK_COALESCE
+#define VIRTIO_BLK_COALESCE 8
+#endif
+
+/* Polling on wait is default for all requests if nonzero, waiter
+ * spins that long before it sleeps for interrupt.
+ */
+#ifndef VIRTIO_BLK_POLL
+#define VIRTIO_BLK_POLL 0
+#endif
+#ifndef VIRTIO_BLK_POLL_NS
+#define VIRTIO_BLK_POLL_NS 50000
+#endif
+
+/* zeroes buffer, one segment of write if device has no write zeroes */
+#define VIRTIO_BLK_ZEROES_SIZE 4096
+
+/* first request queue, with mq there is one per hart after it */
 #define VIRTIO_BLK_REQUESTQ 0
 
 #define VIRTIO_BLK_SECTOR_SIZE 512
@@ -94,9 +228,6 @@ struct virtio_blk_req {
 /* type, unused0, sector fields */
 #define VIRTIO_BLK_REQ_HEAD_SIZE 16
 
-/* data field */
-#define VIRTIO_BLK_REQ_DATA_SIZE VIRTIO_BLK_SECTOR_SIZE
-
 /* status field */
 #define VIRTIO_BLK_REQ_TAIL_SIZE 1
 
@@ -107,13 +238,33 @@ struct virtio_blk_req {
 
 void virtio_blk_init(void);
 void virtio_blk_dev_init(size_t devnum);
-int virtio_blk_read(size_t devnum, u64 sector, void *data);
-int virtio_blk_write(size_t devnum, u64 sector, void *data);
+int virtio_blk_read(size_t devnum, u64 sector, void *data, size_t nsectors);
+int virtio_blk_write(size_t devnum, u64 sector, void *data, size_t nsectors);
+int virtio_blk_readv(size_t devnum, u64 sector, const virtio_blk_seg_t *segs,
+		size_t nsegs);
+int virtio_blk_writev(size_t devnum, u64 sector, const virtio_blk_seg_t *segs,
+		size_t nsegs);
+int virtio_blk_flush(size_t devnum);
+int virtio_blk_discard(size_t devnum, const virtio_blk_range_t *ranges,
+		size_t nranges);
+int virtio_blk_write_zeroes(size_t devnum, u64 sector, u64 nsectors);
+
+void virtio_blk_bio_init(virtio_blk_bio_t *bio, u32 type, u64 sector,
+		const virtio_blk_seg_t *segs, size_t nsegs);
+int virtio_blk_submit(size_t devnum, virtio_blk_bio_t *bio);
+int virtio_blk_wait(virtio_blk_bio_t *bio);
+
+int virtio_blk_set_coalesce(size_t devnum, u32 coalesce);
+int virtio_blk_set_poll(size_t devnum, bool poll);
+void virtio_blk_stat(size_t devnum, virtio_blk_stat_t *stat);
+void virtio_blk_stat_reset(size_t devnum);
 
 void virtio_blk_irq_handler(size_t devnum);
 
-int virtio_blk_read_nosleep(size_t devnum, u64 sector, void *data);
-int virtio_blk_write_nosleep(size_t devnum, u64 sector, void *data);
+int virtio_blk_read_nosleep(size_t devnum, u64 sector, void *data,
+		size_t nsectors);
+int virtio_blk_write_nosleep(size_t devnum, u64 sector, void *data,
+		size_t nsectors);
 
 #endif
 
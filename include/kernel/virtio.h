@@ -8,6 +8,10 @@ typedef struct virtq_desc               virtq_desc_t;
 typedef struct virtq_avail              virtq_avail_t;
 typedef struct virtq_used_elem          virtq_used_elem_t;
 typedef struct virtq_used               virtq_used_t;
+typedef struct pvirtq_desc              pvirtq_desc_t;
+typedef struct pvirtq_event             pvirtq_event_t;
+typedef struct virtq_buf                virtq_buf_t;
+typedef struct virtq_chain              virtq_chain_t;
 typedef struct virtq                    virtq_t;
 
 #include <kernel/spinlock.h>
@@ -86,20 +90,93 @@ struct virtq_used {
 	u16 avail_event; /* Only if VIRTIO_F_EVENT_IDX */
 } /*__attribute__((packed))*/;
 
+/* packed ring descriptor, used in place by device */
+struct pvirtq_desc {
+	u64 addr;
+	u32 len;
+	/* buffer id, device writes it back when buffer is used */
+	u16 id;
+	u16 flags;
+} /* __attribute__((packed)) */;
+
+/* packed ring driver and device event suppression areas */
+struct pvirtq_event {
+	/* ring offset in bits 0-14, wrap counter in bit 15 */
+	u16 off_wrap;
+	u16 flags;
+} /* __attribute__((packed)) */;
+
+/* per buffer id state */
+struct virtq_buf {
+	/* indirect table or NULL */
+	void *table;
+	/* ring slots taken, packed ring only */
+	u16 nslots;
+	/* next free buffer id, packed ring only */
+	u16 next;
+};
+
+/* descriptors of one buffer while they are added */
+struct virtq_chain {
+	/* head descriptor for split ring, buffer id for packed */
+	u16 id;
+	u16 ndescs;
+	u16 nadded;
+	/* descriptor to fill next, index into table if there is one */
+	u16 desc;
+	void *table;
+	/* packed ring, head flags are written last to publish chain */
+	u16 head;
+	u16 headflags;
+	bool wrap;
+};
+
+/* Split or packed ring, format is chosen at negotiation and only
+ * virtio.c looks at it. Drivers add chains, kick and pop used
+ * buffer ids through the same functions for both.
+ */
 struct virtq {
 	u32 virtqsz;
+	bool packed;
+	bool event_idx;
 
-	u8 *descmap;
+	/* number of free descriptors, ring slots for packed ring */
+	u32 nfree;
+	/* ring entries made available since last kick check */
+	u16 added;
 
+	/* split ring, free descriptors are chained through next field */
+	u16 freehead;
 	u16 lastusedidx;
-
 	virtq_desc_t *desc;
 	virtq_avail_t *avail;
 	virtq_used_t *used;
 
+	/* packed ring, wrap counters flip on each pass over ring */
+	pvirtq_desc_t *pdesc;
+	pvirtq_event_t *driver_event;
+	pvirtq_event_t *device_event;
+	u16 nextavail;
+	u16 lastused;
+	bool availwrap;
+	bool usedwrap;
+	/* free buffer ids are chained through bufs */
+	u16 freeid;
+
+	/* indexed by buffer id */
+	virtq_buf_t *bufs;
+
 	void *desc_unaligned;
 	void *avail_unaligned;
 	void *used_unaligned;
+
+	/* slab of indirect tables, free ones are chained through
+	 * addr field of their first descriptor
+	 */
+	void *indirect_slab;
+	virtq_desc_t *indirect_free;
+	/* descriptors per indirect table */
+	u32 indirectsz;
 };
 
 #include <kernel/platform-virt.h>
@@ -141,6 +218,8 @@ struct virtq {
 #define VIRTIO_QUEUE_DESC_AREA_ALIGN   16
 #define VIRTIO_QUEUE_DRIVER_AREA_ALIGN 2
 #define VIRTIO_QUEUE_DEVICE_AREA_ALIGN 4
+/* packed ring driver and device areas */
+#define VIRTIO_QUEUE_EVENT_AREA_ALIGN  4
 
 /* This marks a buffer as continuing via the next field. */
 #define VIRTQ_DESC_F_NEXT 1
@@ -148,20 +227,37 @@ struct virtq {
 #define VIRTQ_DESC_F_WRITE 2
 /* This means the buffer contains a list of buffer descriptors. */
 #define VIRTQ_DESC_F_INDIRECT 4
+/* packed ring, available and used flags are compared to wrap counters */
+#define VIRTQ_DESC_F_AVAIL (1 << 7)
+#define VIRTQ_DESC_F_USED  (1 << 15)
 
 #define VIRTQ_AVAIL_F_NO_INTERRUPT 1
 
 #define VIRTQ_USED_F_NO_NOTIFY 1
 
+/* packed ring event suppression flags */
+#define VIRTQ_EVENT_F_ENABLE  0
+#define VIRTQ_EVENT_F_DISABLE 1
+#define VIRTQ_EVENT_F_DESC    2
+
+#define VIRTQ_EVENT_WRAP (1 << 15)
+
 #define VIRTQ_ERROR ((u16) -1)
 
 void virtio_init(void);
-int virtq_init(virtio_mmio_t *base, virtq_t *virtq, u32 queue_sel);
+int virtq_init(virtio_mmio_t *base, virtq_t *virtq, u32 queue_sel,
+		u64 features);
 void virtq_destroy(virtq_t *virtq);
-u16 virtq_desc_alloc(virtq_t *virtq);
-void virtq_desc_free(virtq_t *virtq, u16 desc);
-u16 virtq_desc_alloc_nofail(virtq_t *virtq, spinlock_t *lock);
-void virtq_desc_free_nofail(virtq_t *virtq, u16 desc);
+int virtq_indirect_init(virtq_t *virtq, size_t ntables, size_t tablesz);
+int virtq_chain_begin(virtq_t *virtq, virtq_chain_t *chain, size_t ndescs);
+void virtq_chain_add(virtq_t *virtq, virtq_chain_t *chain, void *addr,
+		u32 len, u16 flags);
+void virtq_chain_end(virtq_t *virtq, virtq_chain_t *chain);
+bool virtq_need_kick(virtq_t *virtq);
+u16 virtq_used_pop(virtq_t *virtq);
+bool virtq_interrupt_after(virtq_t *virtq, u32 n);
+void virtq_interrupt_disable(virtq_t *virtq);
+void virtq_interrupt_enable(virtq_t *virtq);
 
 void virtio_irq_handler(size_t devnum);
 
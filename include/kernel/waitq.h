@@ -0,0 +1,34 @@
+#ifndef KERNEL_WAITQ_H
+#define KERNEL_WAITQ_H
+
+#include <kernel/types.h>
+
+typedef struct waitq waitq_t;
+
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+
+/* expires value of sleep without timeout */
+#define WAITQ_FOREVER ((u64) -1)
+
+struct waitq {
+	spinlock_t lock;
+	/* sleeping processes linked by proc->waitq_list */
+	list_t waiters;
+};
+
+#if LOCKSTAT
+/* lock class is named after init expression */
+#define waitq_init(waitq) __waitq_init((waitq), #waitq)
+void __waitq_init(waitq_t *waitq, const char *name);
+#else
+void waitq_init(waitq_t *waitq);
+#endif
+int waitq_sleep(waitq_t *waitq, void *wchan, spinlock_t *sl, u64 expires);
+struct proc *__waitq_wake_one(waitq_t *waitq, void *wchan);
+size_t __waitq_wake_all(waitq_t *waitq, void *wchan);
+bool waitq_wake_one(waitq_t *waitq, void *wchan);
+size_t waitq_wake_all(waitq_t *waitq, void *wchan);
+
+#endif
+
@@ -5,7 +5,9 @@
 #include <kernel/spinlock.h>
 #include <kernel/proc.h>
 
+void wchan_init(void);
 void wchan_sleep(void *wchan, spinlock_t *sl);
+int wchan_sleep_timeout(void *wchan, spinlock_t *sl, u64 expires);
 void wchan_signal(void *wchan);
 void wchan_broadcast(void *wchan);
 
@@ -0,0 +1,32 @@
+#ifndef KERNEL_WORKQUEUE_H
+#define KERNEL_WORKQUEUE_H
+
+#include <kernel/types.h>
+
+typedef struct work work_t;
+
+#include <kernel/list.h>
+
+/* number of kernel threads serving each per-cpu pool */
+#define WORKQUEUE_NWORKERS 1
+
+/* Deferred function call. func runs in a kernel thread and may
+ * sleep, get containing object with list_entry(work, type, field).
+ */
+struct work {
+	void (*func)(work_t *work);
+	/* queued and not started yet */
+	bool pending;
+	/* pool of hart which queued work last time */
+	void *pool;
+	list_t works;
+};
+
+void workqueue_init(void);
+
+void work_init(work_t *work, void (*func)(work_t *work));
+bool queue_work(work_t *work);
+bool queue_work_on(u64 cpu, work_t *work);
+void flush_work(work_t *work);
+
+#endif
@@ -3,6 +3,13 @@
 #include <kernel/vm.h>
 #include <kernel/spinlock.h>
 #include <kernel/klib.h>
+#include <kernel/percpu.h>
+
+/* statistics, summed on read */
+static DEFINE_PER_CPU(u64, kpages_allocated);
+static DEFINE_PER_CPU(u64, kpages_freed);
+static DEFINE_PER_CPU(u64, kmalloc_calls);
+static DEFINE_PER_CPU(u64, kfree_calls);
 
 static spinlock_t kpagemap_lock;
 static kpagemap_t *kpagemap;
@@ -62,6 +69,7 @@ void *kpage_alloc(size_t npages)
 			kpagemap[i + npages - 1].last_alloc = true;
 
 			spinlock_release_irqrestore(&kpagemap_lock, irqflags);
+			this_cpu_add(kpages_allocated, npages);
 
 			paddr = (void *) (ram_start() + i * PAGESZ);
 
@@ -86,6 +94,7 @@ void kpage_free(void *mem)
 	size_t kpagei = (((u64) mem) - ram_start()) / PAGESZ;
 	spinlock_acquire_irqsave(&kpagemap_lock, irqflags);
 	while (1) {
+		this_cpu_inc(kpages_freed);
 		kpagemap[kpagei].alloc = false;
 		if (kpagemap[kpagei].last_alloc) {
 			kpagemap[kpagei].last_alloc = false;
@@ -189,6 +198,7 @@ void *kmalloc(size_t memsz)
 	if (!memsz) {
 		return NULL;
 	}
+	this_cpu_inc(kmalloc_calls);
 
 	spinlock_acquire_irqsave(&kmalloc_lock, irqflags);
 
@@ -251,6 +261,7 @@ void kfree(void *mem)
 	if (!mem) {
 		return;
 	}
+	this_cpu_inc(kfree_calls);
 
 	spinlock_acquire_irqsave(&kmalloc_lock, irqflags);
 	suballoc->alloc = false;
@@ -259,3 +270,10 @@ void kfree(void *mem)
 	spinlock_release_irqrestore(&kmalloc_lock, irqflags);
 }
 
+void alloc_stat(alloc_stat_t *stat)
+{
+	stat->kpages_allocated = per_cpu_sum(kpages_allocated);
+	stat->kpages_freed = per_cpu_sum(kpages_freed);
+	stat->kmalloc_calls = per_cpu_sum(kmalloc_calls);
+	stat->kfree_calls = per_cpu_sum(kfree_calls);
+}
@@ -0,0 +1,225 @@
+#include <kernel/blkbench.h>
+#include <kernel/virtio-blk.h>
+#include <kernel/proc.h>
+#include <kernel/alloc.h>
+#include <kernel/kprintf.h>
+#include <kernel/timer.h>
+#include <kernel/klib.h>
+#include <kernel/wchan.h>
+
+#if BLKBENCH
+
+extern virtio_blk_t virtio_blk_list[VIRTIO_MAX];
+
+/* read nbios from first one, keeping qd of them in flight */
+static void blkbench_stream(size_t devnum, size_t qd, u8 *buf,
+		size_t first, size_t nbios)
+{
+	virtio_blk_bio_t bios[BLKBENCH_QD];
+	virtio_blk_seg_t segs[BLKBENCH_QD];
+	size_t slot;
+
+	/* slots are reused in submission order */
+	for (size_t i = 0; i < nbios + qd; i++) {
+		slot = i % qd;
+		if (i >= qd && virtio_blk_wait(&bios[slot])) {
+			panic("blkbench: read failed");
+		}
+		if (i >= nbios) {
+			continue;
+		}
+
+		segs[slot].addr = buf + slot * BLKBENCH_BIO_SIZE;
+		segs[slot].len = BLKBENCH_BIO_SIZE;
+		virtio_blk_bio_init(&bios[slot], VIRTIO_BLK_T_IN,
+				(first + i) * BLKBENCH_BIO_SIZE / VIRTIO_BLK_SECTOR_SIZE,
+				&segs[slot], 1);
+		if (virtio_blk_submit(devnum, &bios[slot])) {
+			panic("blkbench: submit failed");
+		}
+	}
+}
+
+static void blkbench_run(size_t devnum, size_t qd, u8 *buf, size_t nbytes)
+{
+	virtio_blk_stat_t stat;
+	u64 start, elapsed, mib;
+
+	virtio_blk_stat_reset(devnum);
+	start = ktimer_now();
+
+	blkbench_stream(devnum, qd, buf, 0, nbytes / BLKBENCH_BIO_SIZE);
+
+	elapsed = KTIMER_TICKS_TO_NS(ktimer_now() - start) / 1000;
+	virtio_blk_stat(devnum, &stat);
+	mib = max(stat.bytes / (1024 * 1024), 1);
+
+	kprintf_s("blkbench: qd %u, coalesce %u, %u KiB in %u us, %u KiB/s, "
+			"%u notifies/MiB, %u interrupts/MiB\n",
+			(u64) qd, (u64) virtio_blk_list[devnum].coalesce,
+			(u64) nbytes / 1024, elapsed,
+			(u64) nbytes / 1024 * 1000000 / max(elapsed, 1),
+			stat.notifies / mib, stat.interrupts / mib);
+}
+
+static u64 blkbench_lat[BLKBENCH_LAT_NR];
+
+/* single reads with interrupt completion or polling */
+static void blkbench_latency(size_t devnum, bool poll, u8 *buf, size_t nbytes)
+{
+	virtio_blk_bio_t bio;
+	virtio_blk_seg_t seg = {buf, BLKBENCH_BIO_SIZE};
+	size_t nbios = nbytes / BLKBENCH_BIO_SIZE, j;
+	u64 start, lat;
+
+	for (size_t i = 0; i < BLKBENCH_LAT_NR; i++) {
+		virtio_blk_bio_init(&bio, VIRTIO_BLK_T_IN,
+				i % nbios * BLKBENCH_BIO_SIZE / VIRTIO_BLK_SECTOR_SIZE,
+				&seg, 1);
+		bio.poll = poll;
+
+		start = ktimer_now();
+		if (virtio_blk_submit(devnum, &bio) || virtio_blk_wait(&bio)) {
+			panic("blkbench: read failed");
+		}
+		lat = ktimer_now() - start;
+
+		/* insertion sort, percentiles are read by index */
+		for (j = i; j > 0 && blkbench_lat[j - 1] > lat; j--) {
+			blkbench_lat[j] = blkbench_lat[j - 1];
+		}
+		blkbench_lat[j] = lat;
+	}
+
+	kprintf_s("blkbench: qd 1, %s, p50 %u ns, p99 %u ns\n",
+			poll ? "polling" : "interrupt",
+			KTIMER_TICKS_TO_NS(blkbench_lat[BLKBENCH_LAT_NR / 2]),
+			KTIMER_TICKS_TO_NS(blkbench_lat[BLKBENCH_LAT_NR * 99 / 100]));
+}
+
+/* bios per submitter of multiqueue run, finished ones counted */
+static size_t blkbench_nbios;
+static size_t blkbench_ndone;
+static spinlock_t blkbench_lock;
+
+/* reads its own part of device on queue of hart it runs on */
+static void blkbench_submitter(void *arg)
+{
+	int irqflags;
+	size_t devnum = BLKBENCH - 1, idx = (size_t) arg;
+	u8 *buf;
+
+	buf = kpage_alloc(BLKBENCH_QD * BLKBENCH_BIO_SIZE / PAGESZ);
+	if (!buf) {
+		panic("blkbench: no memory");
+	}
+
+	blkbench_stream(devnum, BLKBENCH_QD, buf, idx * blkbench_nbios,
+			blkbench_nbios);
+
+	kpage_free(buf);
+
+	spinlock_acquire_irqsave(&blkbench_lock, irqflags);
+	blkbench_ndone++;
+	wchan_broadcast(&blkbench_ndone);
+	spinlock_release_irqrestore(&blkbench_lock, irqflags);
+}
+
+/* Run one submitter kthread per hart and return IOPS of all of
+ * them. Submitters use queue of their hart, with nqueues cut to 1
+ * they all share first queue like device without mq.
+ */
+static u64 blkbench_mq(size_t devnum, u32 nqueues, size_t nbytes)
+{
+	int irqflags;
+	virtio_blk_t *dev = &virtio_blk_list[devnum];
+	u32 saved = dev->nqueues;
+	u64 start, elapsed, iops;
+
+	/* nothing is in flight, so completion may skip other queues */
+	dev->nqueues = min(nqueues, saved);
+	blkbench_nbios = nbytes / BLKBENCH_BIO_SIZE / NCPU;
+	blkbench_ndone = 0;
+
+	start = ktimer_now();
+	for (size_t i = 0; i < NCPU; i++) {
+		if (!kthread_create(blkbench_submitter, (void *) i)) {
+			panic("blkbench: can not create thread");
+		}
+	}
+
+	spinlock_acquire_irqsave(&blkbench_lock, irqflags);
+	while (blkbench_ndone < NCPU) {
+		wchan_sleep(&blkbench_ndone, &blkbench_lock);
+	}
+	spinlock_release_irqrestore(&blkbench_lock, irqflags);
+
+	elapsed = KTIMER_TICKS_TO_NS(ktimer_now() - start) / 1000;
+	iops = (u64) blkbench_nbios * NCPU * 1000000 / max(elapsed, 1);
+
+	kprintf_s("blkbench: %u submitters, %u queues, qd %u each, "
+			"%u IOPS\n", (u64) NCPU, (u64) dev->nqueues,
+			(u64) BLKBENCH_QD, iops);
+
+	dev->nqueues = saved;
+
+	return iops;
+}
+
+static void blkbench_thread(void *arg)
+{
+	size_t devnum = BLKBENCH - 1, nbytes = BLKBENCH_SIZE;
+	u8 *buf;
+	u64 sq, mq;
+
+	if (!virtio_blk_list[devnum].isvalid) {
+		kprintf_s("blkbench: no virtio-blk device %u\n", (u64) devnum);
+		return;
+	}
+	nbytes = min(nbytes, virtio_blk_list[devnum].capacity *
+			VIRTIO_BLK_SECTOR_SIZE);
+
+	buf = kpage_alloc(BLKBENCH_QD * BLKBENCH_BIO_SIZE / PAGESZ);
+	if (!buf) {
+		panic("blkbench: no memory");
+	}
+
+	blkbench_run(devnum, 1, buf, nbytes);
+
+	/* interrupt per completion against coalesced ones */
+	virtio_blk_set_coalesce(devnum, 1);
+	blkbench_run(devnum, BLKBENCH_QD, buf, nbytes);
+	virtio_blk_set_coalesce(devnum, VIRTIO_BLK_COALESCE);
+	blkbench_run(devnum, BLKBENCH_QD, buf, nbytes);
+
+	/* per request polling against none, whatever device default is */
+	virtio_blk_set_poll(devnum, false);
+	blkbench_latency(devnum, false, buf, nbytes);
+	blkbench_latency(devnum, true, buf, nbytes);
+	virtio_blk_set_poll(devnum, VIRTIO_BLK_POLL);
+
+	kpage_free(buf);
+
+	/* per-hart queues against all harts sharing one */
+	spinlock_init(&blkbench_lock);
+	sq = blkbench_mq(devnum, 1, nbytes);
+	mq = blkbench_mq(devnum, virtio_blk_list[devnum].nqueues, nbytes);
+	kprintf_s("blkbench: per-hart queues give %u%% of single queue IOPS\n",
+			mq * 100 / max(sq, 1));
+}
+
+/* runs in kernel thread, bios are waited for by sleeping */
+void blkbench(void)
+{
+	if (!kthread_create(blkbench_thread, NULL)) {
+		panic("blkbench: can not create thread");
+	}
+}
+
+#else
+
+void blkbench(void)
+{
+}
+
+#endif
@@ -1,12 +1,15 @@
 #include <kernel/cdev-mem.h>
 #include <kernel/alloc.h>
 #include <kernel/klib.h>
+#include <kernel/lockstat.h>
+#include <kernel/irq.h>
 
 static int cdev_mem_open(fd_t *fd, int flags, mode_t mode);
 static int cdev_mem_close(fd_t *fd);
 static ssize_t cdev_mem_read(fd_t *fd, void *buf, size_t n);
 static ssize_t cdev_mem_write(fd_t *fd, const void *buf, size_t n);
 static ssize_t cdev_mem_lseek(fd_t *fd, off_t offset, int whence);
+static int cdev_mem_ioctl(fd_t *fd, unsigned long request, void *arg);
 
 struct device_driver cdev_mem = {
 	.device_driver_name = "mem",
@@ -14,7 +17,8 @@ struct device_driver cdev_mem = {
 	.device_driver_close = cdev_mem_close,
 	.device_driver_read = cdev_mem_read,
 	.device_driver_write = cdev_mem_write,
-	.device_driver_lseek = cdev_mem_lseek
+	.device_driver_lseek = cdev_mem_lseek,
+	.device_driver_ioctl = cdev_mem_ioctl
 };
 
 static int cdev_mem_open(fd_t *fd, int flags, mode_t mode)
@@ -25,6 +29,10 @@ static int cdev_mem_open(fd_t *fd, int flags, mode_t mode)
 	case CDEV_MEM_MEM:
 	case CDEV_MEM_KMEM:
 	case CDEV_MEM_KMSG:
+#if LOCKSTAT
+	case CDEV_MEM_LOCKSTAT:
+#endif
+	case CDEV_MEM_IRQSTAT:
 		fd->roffset = fd->woffset = kmalloc(sizeof(off_t));
 		if (!fd->roffset) {
 			return -ENOMEM;
@@ -51,6 +59,10 @@ static int cdev_mem_close(fd_t *fd)
 	case CDEV_MEM_MEM:
 	case CDEV_MEM_KMEM:
 	case CDEV_MEM_KMSG:
+#if LOCKSTAT
+	case CDEV_MEM_LOCKSTAT:
+#endif
+	case CDEV_MEM_IRQSTAT:
 		kfree(fd->roffset);
 		break;
 	case CDEV_MEM_NULL:
@@ -101,6 +113,35 @@ static ssize_t kmsg_read(fd_t *fd, void *buf, size_t n)
 	return 0;
 }
 
+#if LOCKSTAT
+static ssize_t lockstat_dev_read(fd_t *fd, void *buf, size_t n)
+{
+	ssize_t ret = lockstat_read(buf, n, *fd->roffset);
+	if (ret > 0) {
+		*fd->roffset += ret;
+	}
+	return ret;
+}
+#endif
+
+static ssize_t irqstat_dev_read(fd_t *fd, void *buf, size_t n)
+{
+	irqstat_t stat;
+	off_t offset = *fd->roffset;
+
+	if (offset < 0 || offset >= sizeof(stat)) {
+		return 0;
+	}
+	irq_stat(&stat);
+
+	n = min(n, sizeof(stat) - offset);
+	if (copy_to_user(buf, (void *) &stat + offset, n)) {
+		return -EFAULT;
+	}
+	*fd->roffset += n;
+	return n;
+}
+
 static ssize_t cdev_mem_read(fd_t *fd, void *buf, size_t n)
 {
 	ssize_t ret = 0;
@@ -125,6 +166,14 @@ static ssize_t cdev_mem_read(fd_t *fd, void *buf, size_t n)
 	case CDEV_MEM_KMSG:
 		ret = kmsg_read(fd, buf, n);
 		break;
+#if LOCKSTAT
+	case CDEV_MEM_LOCKSTAT:
+		ret = lockstat_dev_read(fd, buf, n);
+		break;
+#endif
+	case CDEV_MEM_IRQSTAT:
+		ret = irqstat_dev_read(fd, buf, n);
+		break;
 	default:
 		ret = -ENODEV;
 	}
@@ -228,9 +277,40 @@ static ssize_t cdev_mem_lseek(fd_t *fd, off_t offset, int whence)
 	case CDEV_MEM_KMSG:
 		ret = kmsg_lseek(fd, offset, whence);
 		break;
+#if LOCKSTAT
+	case CDEV_MEM_LOCKSTAT:
+		ret = kmem_lseek(fd, offset, whence);
+		break;
+#endif
+	case CDEV_MEM_IRQSTAT:
+		ret = kmem_lseek(fd, offset, whence);
+		break;
 	default:
 		ret = -ENODEV;
 	}
 	return ret;
 }
 
+static int cdev_mem_ioctl(fd_t *fd, unsigned long request, void *arg)
+{
+	int ret = -ENOTTY;
+	switch (minor(fd->rdev)) {
+#if LOCKSTAT
+	case CDEV_MEM_LOCKSTAT:
+		if (request == LOCKSTAT_IOCTL_RESET) {
+			lockstat_reset();
+			ret = 0;
+		}
+		break;
+#endif
+	case CDEV_MEM_IRQSTAT:
+		if (request == IRQSTAT_IOCTL_RESET) {
+			irq_stat_reset();
+			ret = 0;
+		}
+		break;
+	default:
+		break;
+	}
+	return ret;
+}
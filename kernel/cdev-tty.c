@@ -36,12 +36,13 @@ static int tty_open(dev_t rdev, int flags)
 {
 	if (!(flags & O_NOCTTY)) {
 		bool is_session_leader;
-		int irqflags;
 		pid_t sid;
-		spinlock_acquire_irqsave(&curproc()->lock, irqflags);
-		sid = curproc()->sid;
-		is_session_leader = (curproc()->pid == curproc()->sid);
-		spinlock_release_irqrestore(&curproc()->lock, irqflags);
+		u32 seq;
+		do {
+			seq = seqlock_read_begin(&curproc()->idlock);
+			sid = curproc()->sid;
+			is_session_leader = (curproc()->pid == curproc()->sid);
+		} while (seqlock_read_retry(&curproc()->idlock, seq));
 
 		if (is_session_leader) {
 			curproc()->ctty = rdev;
@@ -1,36 +1,150 @@
 #include <kernel/clint-sifive.h>
 #include <kernel/proc.h>
 #include <kernel/riscv64.h>
+#include <kernel/klib.h>
+#include <kernel/percpu.h>
 
-volatile u64 tscratch[NCPU][7];
+static DEFINE_PER_CPU(volatile u64 [8], tscratch);
+volatile u64 csrprobefault[NCPU];
 
-void timertrap(void);
+/* true if s-mode can program its own timer through stimecmp */
+volatile bool clint_sstc = false;
 
-void clint_init(void)
+/* next scheduler tick for sstc mode */
+static DEFINE_PER_CPU(u64, clint_next_tick);
+
+void mtrap(void);
+void csrtrap(void);
+
+/* Check for sstc extension. We can not read isa string
+ * from devicetree, so try to set menvcfg.stce bit.
+ * Bit is hardwired to zero if sstc is not supported and
+ * menvcfg itself does not exist before priv spec 1.12
+ */
+static bool clint_sstc_probe(void)
 {
 	u64 mhartid = r_mhartid();
+	u64 mstatus = r_mstatus();
+	u64 menvcfg = 0;
+
+	/* csrtrap will set fault flag and skip the instruction */
+	csrprobefault[mhartid] = 0;
+	w_mtvec(((u64) csrtrap) | MTVEC_MODE_DIRECT);
+
+	w_menvcfg(r_menvcfg() | MENVCFG_STCE);
+	if (!csrprobefault[mhartid]) {
+		menvcfg = r_menvcfg();
+	}
+
+	/* m-mode trap overwrites mpp and mpie, so restore them */
+	w_mstatus(mstatus);
+
+	return !csrprobefault[mhartid] && (menvcfg & MENVCFG_STCE);
+}
+
+void clint_init(void)
+{
+	volatile u64 *tscratchp = this_cpu_ptr(&tscratch[0]);
 	volatile u64 *mtime = CLINT_MTIME;
 	volatile u64 *mtimecmp = CLINT_MTIMECMP(r_mhartid());
 
-	/* schedule next timer interrupt */
-	*mtimecmp = *mtime + NCYCLE;
+	/* allow s-mode to read time csr and access stimecmp */
+	w_mcounteren(r_mcounteren() | MCOUNTEREN_TM);
+
+	/* probe uses its own mtvec, so it goes first */
+	clint_sstc = clint_sstc_probe();
 
 	/* We will use timer scratch in ram because
 	 * only mscratch register is not enough
 	 */
-	tscratch[mhartid][0] = (u64) mtime;
-	tscratch[mhartid][1] = (u64) mtimecmp;
-	tscratch[mhartid][2] = NCYCLE;
-	w_mscratch((u64) &tscratch[mhartid]);
+	tscratchp[0] = (u64) mtime;
+	tscratchp[1] = (u64) mtimecmp;
+	tscratchp[2] = NCYCLE;
+	tscratchp[7] = (u64) CLINT_MSIP(r_mhartid());
+	w_mscratch((u64) tscratchp);
 
-	/* set timertrap */
-	w_mtvec(((u64) timertrap) | MTVEC_MODE_DIRECT);
+	/* set mtrap */
+	w_mtvec(((u64) mtrap) | MTVEC_MODE_DIRECT);
 
-	/* enable timer interrupt */
-	w_mip(MIP_STIP);
-	w_mie(MIE_MTIE);
+	if (clint_sstc) {
+		/* s-mode will schedule timer interrupts itself
+		 * in clint_hart_init, m-mode only forwards ipis
+		 */
+		*mtimecmp = -1;
+		w_mie(MIE_MSIE);
+	} else {
+		/* schedule next timer interrupt */
+		*mtimecmp = *mtime + NCYCLE;
+
+		/* enable timer and software interrupts */
+		w_mip(MIP_STIP);
+		w_mie(MIE_MTIE | MIE_MSIE);
+	}
 
 	/* set mpie to enable m-mode interrupts after mret */
 	w_mstatus(r_mstatus() | MSTATUS_MPIE);
 }
 
+void clint_hart_init(void)
+{
+	/* allow u-mode to read time csr */
+	w_scounteren(r_scounteren() | SCOUNTEREN_TM);
+
+	if (!clint_sstc) {
+		/* timertrap will enable stie bit */
+		return;
+	}
+
+	/* schedule first timer interrupt */
+	*this_cpu_ptr(&clint_next_tick) = r_time() + NCYCLE;
+	w_stimecmp(*this_cpu_ptr(&clint_next_tick));
+	w_sie(r_sie() | SIE_STIE);
+}
+
+/* Should be called from s-mode timer interrupt handler.
+ * Returns true if scheduler tick is expired.
+ */
+bool clint_timer_rearm(void)
+{
+	u64 now;
+
+	if (clint_sstc) {
+		now = r_time();
+		if (now < *this_cpu_ptr(&clint_next_tick)) {
+			/* interrupt was raised by ktimer deadline */
+			return false;
+		}
+
+		/* stip bit is cleared by new stimecmp value */
+		*this_cpu_ptr(&clint_next_tick) = now + NCYCLE;
+		w_stimecmp(*this_cpu_ptr(&clint_next_tick));
+		return true;
+	}
+
+	/* We need to disable stie bit or timer interrupt
+	 * will be triggered again immediately after return
+	 * because stip bit is always enabled
+	 */
+	w_sie(r_sie() & ~SIE_STIE);
+	return true;
+}
+
+/* Raise timer interrupt at deadline or at next tick if it is earlier.
+ * Without sstc deadlines are checked on every tick only.
+ * Interrupts should be off.
+ */
+void clint_timer_program(u64 deadline)
+{
+	if (!clint_sstc) {
+		return;
+	}
+	w_stimecmp(min(deadline, *this_cpu_ptr(&clint_next_tick)));
+}
+
+/* Raise m-mode software interrupt on hart,
+ * mtrap forwards it to s-mode as ssip.
+ */
+void clint_send_ipi(u64 hartid)
+{
+	*CLINT_MSIP(hartid) = 1;
+}
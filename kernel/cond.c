@@ -1,54 +1,50 @@
 #include <kernel/cond.h>
-#include <kernel/sched.h>
+#include <kernel/irq.h>
 
+#if LOCKSTAT
+void __cond_init(cond_t *cond, const char *name)
+{
+	__waitq_init(&cond->waitq, name);
+}
+#else
 void cond_init(cond_t *cond)
 {
-	spinlock_init(&cond->lock);
-	cond->wait = 0;
+	waitq_init(&cond->waitq);
 }
+#endif
 
 void cond_wait(cond_t *cond, mutex_t *mutex)
 {
-	int irqflags;
-	u64 wait;
-
-	spinlock_acquire_irqsave(&cond->lock, irqflags);
-	mutex_unlock(mutex);
-
-	wait = cond->wait;
-	cond->wait++;
-
-	while (cond->wait > wait) {
-		spinlock_release_irqrestore(&cond->lock, irqflags);
+	cond_timedwait(cond, mutex, WAITQ_FOREVER);
+}
 
-		sched();
+/* returns -ETIMEDOUT if mtime reached expires before signal */
+int cond_timedwait(cond_t *cond, mutex_t *mutex, u64 expires)
+{
+	int irqflags, err;
 
-		spinlock_acquire_irqsave(&cond->lock, irqflags);
-	}
+	/* signal takes waitq lock, so it can not slip
+	 * between mutex unlock and sleep
+	 */
+	spinlock_acquire_irqsave(&cond->waitq.lock, irqflags);
+	mutex_unlock(mutex);
 
-	if (cond->wait) {
-		cond->wait--;
-	}
+	err = waitq_sleep(&cond->waitq, cond, &cond->waitq.lock, expires);
 
+	/* mutex_lock may sleep, so do not hold spinlock */
+	spinlock_release_irqrestore(&cond->waitq.lock, irqflags);
 	mutex_lock(mutex);
-	spinlock_release_irqrestore(&cond->lock, irqflags);
+
+	return err;
 }
 
 void cond_signal(cond_t *cond)
 {
-	int irqflags;
-	spinlock_acquire_irqsave(&cond->lock, irqflags);
-	if (cond->wait) {
-		cond->wait--;
-	}
-	spinlock_release_irqrestore(&cond->lock, irqflags);
+	waitq_wake_one(&cond->waitq, NULL);
 }
 
 void cond_broadcast(cond_t *cond)
 {
-	int irqflags;
-	spinlock_acquire_irqsave(&cond->lock, irqflags);
-	cond->wait = 0;
-	spinlock_release_irqrestore(&cond->lock, irqflags);
+	waitq_wake_all(&cond->waitq, NULL);
 }
 
@@ -2,17 +2,74 @@
 #include <kernel/kprintf.h>
 #include <kernel/cdev-mem.h>
 #include <kernel/cdev-tty.h>
+#include <kernel/rcu.h>
+#include <kernel/wchan.h>
 
 static struct device_driver_table_entry
 	character_device_driver_table[DEVICE_DRIVER_TABLE_SIZE],
 	block_device_driver_table[DEVICE_DRIVER_TABLE_SIZE];
 
+/* orders drivers refcnt dropping to zero against unregister sleep */
+static spinlock_t device_driver_drain_lock;
+
+/* Lookup is lockless, table entry lock only serializes register and
+ * unregister. Reference keeps driver alive while we call into it
+ * with no lock held.
+ */
+static device_driver_t *device_driver_get(
+		struct device_driver_table_entry *table, int major)
+{
+	device_driver_t *device_driver;
+	rcu_read_lock();
+	device_driver = rcu_dereference(table[major].device_driver);
+	if (device_driver) {
+		atomic_fetch_add32(&device_driver->refcnt, 1);
+	}
+	rcu_read_unlock();
+	return device_driver;
+}
+
+static void device_driver_put(device_driver_t *device_driver)
+{
+	int irqflags;
+	if (atomic_fetch_add32(&device_driver->refcnt, -1) != 1) {
+		return;
+	}
+	/* pairs with barrier in device_driver_drain */
+	atomic_membar();
+	if (device_driver->unregistering) {
+		spinlock_acquire_irqsave(&device_driver_drain_lock, irqflags);
+		wchan_broadcast(device_driver);
+		spinlock_release_irqrestore(&device_driver_drain_lock, irqflags);
+	}
+}
+
+/* wait for callers which got driver before it was unpublished */
+static void device_driver_drain(device_driver_t *device_driver)
+{
+	int irqflags;
+
+	/* after grace period nobody can take new reference */
+	synchronize_rcu();
+
+	spinlock_acquire_irqsave(&device_driver_drain_lock, irqflags);
+	device_driver->unregistering = true;
+	atomic_membar();
+	while (*(volatile u32 *) &device_driver->refcnt) {
+		/* woken up by last device_driver_put */
+		wchan_sleep(device_driver, &device_driver_drain_lock);
+	}
+	device_driver->unregistering = false;
+	spinlock_release_irqrestore(&device_driver_drain_lock, irqflags);
+}
+
 void dev_init(void)
 {
 	int err;
+	spinlock_init(&device_driver_drain_lock);
 	for (size_t i = 0; i < DEVICE_DRIVER_TABLE_SIZE; i++) {
-		mutex_init(&character_device_driver_table[i].lock);
-		mutex_init(&block_device_driver_table[i].lock);
+		spinlock_init(&character_device_driver_table[i].lock);
+		spinlock_init(&block_device_driver_table[i].lock);
 	}
 	err = character_device_driver_register(CDEV_MEM_MAJOR, &cdev_mem);
 	if (err) {
@@ -26,36 +83,57 @@ void dev_init(void)
 
 int character_device_driver_register(int major, device_driver_t *device_driver)
 {
-	int ret = 0;
+	int irqflags, ret = 0;
 	if (major < 0 || major >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&character_device_driver_table[major].lock);
 	if (character_device_driver_table[major].device_driver) {
-		mutex_unlock(&character_device_driver_table[major].lock);
 		return -EINVAL;
 	}
-	character_device_driver_table[major].device_driver = device_driver;
+
+	/* readers must never see not initialized driver */
 	if (device_driver->device_driver_init) {
 		ret = device_driver->device_driver_init();
+		if (ret) {
+			return ret;
+		}
 	}
-	mutex_unlock(&character_device_driver_table[major].lock);
-	return ret;
+
+	spinlock_acquire_irqsave(&character_device_driver_table[major].lock, irqflags);
+	if (character_device_driver_table[major].device_driver) {
+		spinlock_release_irqrestore(&character_device_driver_table[major].lock, irqflags);
+		if (device_driver->device_driver_cleanup) {
+			device_driver->device_driver_cleanup();
+		}
+		return -EINVAL;
+	}
+	device_driver->refcnt = 0;
+	device_driver->unregistering = false;
+	rcu_assign_pointer(character_device_driver_table[major].device_driver, device_driver);
+	spinlock_release_irqrestore(&character_device_driver_table[major].lock, irqflags);
+
+	return 0;
 }
 
 int character_device_driver_unregister(int major)
 {
+	int irqflags;
 	device_driver_t *device_driver;
 	if (major < 0 || major >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&character_device_driver_table[major].lock);
+	spinlock_acquire_irqsave(&character_device_driver_table[major].lock, irqflags);
 	device_driver = character_device_driver_table[major].device_driver;
+	rcu_assign_pointer(character_device_driver_table[major].device_driver, NULL);
+	spinlock_release_irqrestore(&character_device_driver_table[major].lock, irqflags);
+
+	if (!device_driver) {
+		return -EINVAL;
+	}
+	device_driver_drain(device_driver);
 	if (device_driver->device_driver_cleanup) {
 		device_driver->device_driver_cleanup();
 	}
-	character_device_driver_table[major].device_driver = NULL;
-	mutex_unlock(&character_device_driver_table[major].lock);
 	return 0;
 }
 	
@@ -66,12 +144,14 @@ int character_device_driver_open(fd_t *fd, int flags, mode_t mode)
 	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&character_device_driver_table[major(fd->rdev)].lock);
-	device_driver = character_device_driver_table[major(fd->rdev)].device_driver;
+	device_driver = device_driver_get(character_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
 	if (device_driver->device_driver_open) {
 		ret = device_driver->device_driver_open(fd, flags, mode);
 	}
-	mutex_unlock(&character_device_driver_table[major(fd->rdev)].lock);
+	device_driver_put(device_driver);
 	return ret;
 }
 
@@ -82,12 +162,14 @@ int character_device_driver_close(fd_t *fd)
 	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&character_device_driver_table[major(fd->rdev)].lock);
-	device_driver = character_device_driver_table[major(fd->rdev)].device_driver;
+	device_driver = device_driver_get(character_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
 	if (device_driver->device_driver_close) {
 		ret = device_driver->device_driver_close(fd);
 	}
-	mutex_unlock(&character_device_driver_table[major(fd->rdev)].lock);
+	device_driver_put(device_driver);
 	return ret;
 }
 
@@ -98,12 +180,14 @@ ssize_t character_device_driver_read(fd_t *fd, void *buf, size_t n)
 	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&character_device_driver_table[major(fd->rdev)].lock);
-	device_driver = character_device_driver_table[major(fd->rdev)].device_driver;
+	device_driver = device_driver_get(character_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
 	if (device_driver->device_driver_read) {
 		ret = device_driver->device_driver_read(fd, buf, n);
 	}
-	mutex_unlock(&character_device_driver_table[major(fd->rdev)].lock);
+	device_driver_put(device_driver);
 	return ret;
 }
 
@@ -114,12 +198,14 @@ ssize_t character_device_driver_write(fd_t *fd, const void *buf, size_t n)
 	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&character_device_driver_table[major(fd->rdev)].lock);
-	device_driver = character_device_driver_table[major(fd->rdev)].device_driver;
+	device_driver = device_driver_get(character_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
 	if (device_driver->device_driver_write) {
 		ret = device_driver->device_driver_write(fd, buf, n);
 	}
-	mutex_unlock(&character_device_driver_table[major(fd->rdev)].lock);
+	device_driver_put(device_driver);
 	return ret;
 }
 
@@ -130,12 +216,14 @@ off_t character_device_driver_lseek(fd_t *fd, off_t offset, int whence)
 	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&character_device_driver_table[major(fd->rdev)].lock);
-	device_driver = character_device_driver_table[major(fd->rdev)].device_driver;
+	device_driver = device_driver_get(character_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
 	if (device_driver->device_driver_lseek) {
 		ret = device_driver->device_driver_lseek(fd, offset, whence);
 	}
-	mutex_unlock(&character_device_driver_table[major(fd->rdev)].lock);
+	device_driver_put(device_driver);
 	return ret;
 }
 
@@ -146,12 +234,14 @@ int character_device_driver_fsync(fd_t *fd)
 	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&character_device_driver_table[major(fd->rdev)].lock);
-	device_driver = character_device_driver_table[major(fd->rdev)].device_driver;
+	device_driver = device_driver_get(character_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
 	if (device_driver->device_driver_fsync) {
 		ret = device_driver->device_driver_fsync(fd);
 	}
-	mutex_unlock(&character_device_driver_table[major(fd->rdev)].lock);
+	device_driver_put(device_driver);
 	return ret;
 }
 
@@ -162,47 +252,88 @@ int character_device_driver_fdatasync(fd_t *fd)
 	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&character_device_driver_table[major(fd->rdev)].lock);
-	device_driver = character_device_driver_table[major(fd->rdev)].device_driver;
+	device_driver = device_driver_get(character_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
 	if (device_driver->device_driver_fdatasync) {
 		ret = device_driver->device_driver_fdatasync(fd);
 	}
-	mutex_unlock(&character_device_driver_table[major(fd->rdev)].lock);
+	device_driver_put(device_driver);
+	return ret;
+}
+
+int character_device_driver_ioctl(fd_t *fd, unsigned long request, void *arg)
+{
+	int ret = -ENOTTY;
+	device_driver_t *device_driver;
+	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
+		return -EINVAL;
+	}
+	device_driver = device_driver_get(character_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
+	if (device_driver->device_driver_ioctl) {
+		ret = device_driver->device_driver_ioctl(fd, request, arg);
+	}
+	device_driver_put(device_driver);
 	return ret;
 }
 
 int block_device_driver_register(int major, device_driver_t *device_driver)
 {
-	int ret = 0;
+	int irqflags, ret = 0;
 	if (major < 0 || major >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&block_device_driver_table[major].lock);
 	if (block_device_driver_table[major].device_driver) {
-		mutex_unlock(&block_device_driver_table[major].lock);
 		return -EINVAL;
 	}
-	block_device_driver_table[major].device_driver = device_driver;
+
+	/* readers must never see not initialized driver */
 	if (device_driver->device_driver_init) {
 		ret = device_driver->device_driver_init();
+		if (ret) {
+			return ret;
+		}
 	}
-	mutex_unlock(&block_device_driver_table[major].lock);
-	return ret;
+
+	spinlock_acquire_irqsave(&block_device_driver_table[major].lock, irqflags);
+	if (block_device_driver_table[major].device_driver) {
+		spinlock_release_irqrestore(&block_device_driver_table[major].lock, irqflags);
+		if (device_driver->device_driver_cleanup) {
+			device_driver->device_driver_cleanup();
+		}
+		return -EINVAL;
+	}
+	device_driver->refcnt = 0;
+	device_driver->unregistering = false;
+	rcu_assign_pointer(block_device_driver_table[major].device_driver, device_driver);
+	spinlock_release_irqrestore(&block_device_driver_table[major].lock, irqflags);
+
+	return 0;
 }
 
 int block_device_driver_unregister(int major)
 {
+	int irqflags;
 	device_driver_t *device_driver;
 	if (major < 0 || major >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&block_device_driver_table[major].lock);
+	spinlock_acquire_irqsave(&block_device_driver_table[major].lock, irqflags);
 	device_driver = block_device_driver_table[major].device_driver;
+	rcu_assign_pointer(block_device_driver_table[major].device_driver, NULL);
+	spinlock_release_irqrestore(&block_device_driver_table[major].lock, irqflags);
+
+	if (!device_driver) {
+		return -EINVAL;
+	}
+	device_driver_drain(device_driver);
 	if (device_driver->device_driver_cleanup) {
 		device_driver->device_driver_cleanup();
 	}
-	block_device_driver_table[major].device_driver = NULL;
-	mutex_unlock(&block_device_driver_table[major].lock);
 	return 0;
 }
 
@@ -213,12 +344,14 @@ int block_device_driver_open(fd_t *fd, int flags, mode_t mode)
 	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&block_device_driver_table[major(fd->rdev)].lock);
-	device_driver = block_device_driver_table[major(fd->rdev)].device_driver;
+	device_driver = device_driver_get(block_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
 	if (device_driver->device_driver_open) {
 		ret = device_driver->device_driver_open(fd, flags, mode);
 	}
-	mutex_unlock(&block_device_driver_table[major(fd->rdev)].lock);
+	device_driver_put(device_driver);
 	return ret;
 }
 
@@ -229,12 +362,14 @@ int block_device_driver_close(fd_t *fd)
 	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&block_device_driver_table[major(fd->rdev)].lock);
-	device_driver = block_device_driver_table[major(fd->rdev)].device_driver;
+	device_driver = device_driver_get(block_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
 	if (device_driver->device_driver_close) {
 		ret = device_driver->device_driver_close(fd);
 	}
-	mutex_unlock(&block_device_driver_table[major(fd->rdev)].lock);
+	device_driver_put(device_driver);
 	return ret;
 }
 
@@ -245,12 +380,14 @@ ssize_t block_device_driver_read(fd_t *fd, void *buf, size_t n)
 	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&block_device_driver_table[major(fd->rdev)].lock);
-	device_driver = block_device_driver_table[major(fd->rdev)].device_driver;
+	device_driver = device_driver_get(block_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
 	if (device_driver->device_driver_read) {
 		ret = device_driver->device_driver_read(fd, buf, n);
 	}
-	mutex_unlock(&block_device_driver_table[major(fd->rdev)].lock);
+	device_driver_put(device_driver);
 	return ret;
 }
 
@@ -261,12 +398,14 @@ ssize_t block_device_driver_write(fd_t *fd, const void *buf, size_t n)
 	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&block_device_driver_table[major(fd->rdev)].lock);
-	device_driver = block_device_driver_table[major(fd->rdev)].device_driver;
+	device_driver = device_driver_get(block_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
 	if (device_driver->device_driver_write) {
 		ret = device_driver->device_driver_write(fd, buf, n);
 	}
-	mutex_unlock(&block_device_driver_table[major(fd->rdev)].lock);
+	device_driver_put(device_driver);
 	return ret;
 }
 
@@ -277,12 +416,14 @@ off_t block_device_driver_lseek(fd_t *fd, off_t offset, int whence)
 	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&block_device_driver_table[major(fd->rdev)].lock);
-	device_driver = block_device_driver_table[major(fd->rdev)].device_driver;
+	device_driver = device_driver_get(block_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
 	if (device_driver->device_driver_lseek) {
 		ret = device_driver->device_driver_lseek(fd, offset, whence);
 	}
-	mutex_unlock(&block_device_driver_table[major(fd->rdev)].lock);
+	device_driver_put(device_driver);
 	return ret;
 }
 
@@ -293,12 +434,14 @@ int block_device_driver_fsync(fd_t *fd)
 	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&block_device_driver_table[major(fd->rdev)].lock);
-	device_driver = block_device_driver_table[major(fd->rdev)].device_driver;
+	device_driver = device_driver_get(block_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
 	if (device_driver->device_driver_fsync) {
 		ret = device_driver->device_driver_fsync(fd);
 	}
-	mutex_unlock(&block_device_driver_table[major(fd->rdev)].lock);
+	device_driver_put(device_driver);
 	return ret;
 }
 
@@ -309,12 +452,32 @@ int block_device_driver_fdatasync(fd_t *fd)
 	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
 		return -EINVAL;
 	}
-	mutex_lock(&block_device_driver_table[major(fd->rdev)].lock);
-	device_driver = block_device_driver_table[major(fd->rdev)].device_driver;
+	device_driver = device_driver_get(block_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
 	if (device_driver->device_driver_fdatasync) {
 		ret = device_driver->device_driver_fdatasync(fd);
 	}
-	mutex_unlock(&block_device_driver_table[major(fd->rdev)].lock);
+	device_driver_put(device_driver);
+	return ret;
+}
+
+int block_device_driver_ioctl(fd_t *fd, unsigned long request, void *arg)
+{
+	int ret = -ENOTTY;
+	device_driver_t *device_driver;
+	if (major(fd->rdev) < 0 || major(fd->rdev) >= DEVICE_DRIVER_TABLE_SIZE) {
+		return -EINVAL;
+	}
+	device_driver = device_driver_get(block_device_driver_table, major(fd->rdev));
+	if (!device_driver) {
+		return -ENODEV;
+	}
+	if (device_driver->device_driver_ioctl) {
+		ret = device_driver->device_driver_ioctl(fd, request, arg);
+	}
+	device_driver_put(device_driver);
 	return ret;
 }
 
@@ -14,7 +14,7 @@ static int ext2_init_superblock_read(ext2_superblock_t *superblock,
 	int err = 0;
 	err = virtio_blk_read_nosleep(virtio_devnum,
 			EXT2_SUPERBLOCK_START / VIRTIO_BLK_SECTOR_SIZE,
-			superblock);
+			superblock, sizeof(*superblock) / VIRTIO_BLK_SECTOR_SIZE);
 	return err;
 }
 
@@ -24,7 +24,7 @@ static int ext2_init_superblock_write(ext2_superblock_t *superblock,
 	int err = 0;
 	err = virtio_blk_write_nosleep(virtio_devnum,
 			EXT2_SUPERBLOCK_START / VIRTIO_BLK_SECTOR_SIZE,
-			superblock);
+			superblock, sizeof(*superblock) / VIRTIO_BLK_SECTOR_SIZE);
 	return err;
 }
 
@@ -105,6 +105,8 @@ void ext2_init(void)
 				blkdev->inode_size = superblock.s_inode_size;
 			}
 
+			blkdev->ndiscard = 0;
+
 			mutex_init(&blkdev->lock);
 
 			list_add(&blkdev->devlist, &ext2_dev_list.devlist);
@@ -112,118 +114,200 @@ void ext2_init(void)
 	}
 }
 
+/* adjacent blocks are transferred as one request */
+static int ext2_blocks_read(ext2_blkdev_t *dev, blkcnt_t blknum,
+		size_t nblocks, void *buf)
+{
+	return virtio_blk_read(dev->virtio_devnum,
+			blknum * dev->block_size / VIRTIO_BLK_SECTOR_SIZE, buf,
+			nblocks * dev->block_size / VIRTIO_BLK_SECTOR_SIZE);
+}
+
 static int ext2_block_read(ext2_blkdev_t *dev, blkcnt_t blknum, void *buf)
 {
-	int err;
-	for (size_t i = 0; i < dev->block_size / VIRTIO_BLK_SECTOR_SIZE; i++) {
-		err = virtio_blk_read(dev->virtio_devnum,
-				blknum * dev->block_size / VIRTIO_BLK_SECTOR_SIZE + i,
-				buf + i * VIRTIO_BLK_SECTOR_SIZE);
-		if (err) {
-			return err;
-		}
-	}
-	return 0;
+	return ext2_blocks_read(dev, blknum, 1, buf);
 }
 
 static int ext2_block_write(ext2_blkdev_t *dev, blkcnt_t blknum, void *buf)
 {
-	int err;
-	for (size_t i = 0; i < dev->block_size / VIRTIO_BLK_SECTOR_SIZE; i++) {
-		err = virtio_blk_write(dev->virtio_devnum,
-				blknum * dev->block_size / VIRTIO_BLK_SECTOR_SIZE + i,
-				buf + i * VIRTIO_BLK_SECTOR_SIZE);
-		if (err) {
-			return err;
+	return virtio_blk_write(dev->virtio_devnum,
+			blknum * dev->block_size / VIRTIO_BLK_SECTOR_SIZE, buf,
+			dev->block_size / VIRTIO_BLK_SECTOR_SIZE);
+}
+
+/* without data transfer if device can write zeroes */
+static int ext2_block_zero(ext2_blkdev_t *dev, blkcnt_t blknum)
+{
+	return virtio_blk_write_zeroes(dev->virtio_devnum,
+			blknum * dev->block_size / VIRTIO_BLK_SECTOR_SIZE,
+			dev->block_size / VIRTIO_BLK_SECTOR_SIZE);
+}
+
+/* Discard gathered freed extents with as few requests as device
+ * allows. Discard is a hint, so its errors are not reported.
+ */
+static void ext2_discard_flush(ext2_blkdev_t *dev)
+{
+	if (dev->ndiscard) {
+		virtio_blk_discard(dev->virtio_devnum, dev->discard,
+				dev->ndiscard);
+		dev->ndiscard = 0;
+	}
+}
+
+/* freed block extends last extent if it follows it on disk */
+static void ext2_discard_add(ext2_blkdev_t *dev, blkcnt_t blknum)
+{
+	u64 sector = blknum * dev->block_size / VIRTIO_BLK_SECTOR_SIZE;
+	u32 nsectors = dev->block_size / VIRTIO_BLK_SECTOR_SIZE;
+	virtio_blk_range_t *last;
+
+	if (dev->ndiscard) {
+		last = &dev->discard[dev->ndiscard - 1];
+		if (last->sector + last->num_sectors == sector &&
+				last->num_sectors <= (u32) -1 - nsectors) {
+			last->num_sectors += nsectors;
+			return;
 		}
 	}
-	return 0;
+
+	if (dev->ndiscard == EXT2_DISCARD_MAX) {
+		ext2_discard_flush(dev);
+	}
+	dev->discard[dev->ndiscard].sector = sector;
+	dev->discard[dev->ndiscard].num_sectors = nsectors;
+	dev->discard[dev->ndiscard].flags = 0;
+	dev->ndiscard++;
 }
 
-int ext2_nbytes_read(ext2_blkdev_t *dev, void *buf, size_t len, off_t offset)
+/* Block handed out again must not be discarded later, so it is cut
+ * out of pending extent holding it. Other extents stay pending.
+ */
+static void ext2_discard_remove(ext2_blkdev_t *dev, blkcnt_t blknum)
 {
-	int err;
-	u8 blockbuf[dev->block_size];
-	blkcnt_t firstblock = offset / dev->block_size,
-		lastblock = (offset + len) / dev->block_size;
-	size_t ncopied = 0, inblock_len;
-	off_t inblock_off;
+	u64 sector = blknum * dev->block_size / VIRTIO_BLK_SECTOR_SIZE;
+	u32 nsectors = dev->block_size / VIRTIO_BLK_SECTOR_SIZE;
+	virtio_blk_range_t *range;
+	u64 tail;
+	u32 ntail;
+
+	for (size_t i = 0; i < dev->ndiscard; i++) {
+		range = &dev->discard[i];
+		if (sector < range->sector ||
+				sector >= range->sector + range->num_sectors) {
+			continue;
+		}
 
-	for (blkcnt_t curblock = firstblock; curblock <= lastblock; curblock++) {
-		if (curblock == firstblock) {
-			inblock_off = offset - curblock * dev->block_size;
-			if (dev->block_size - inblock_off > len) {
-				inblock_len = len;
-			} else {
-				inblock_len = dev->block_size - inblock_off;
-			}
-		} else if (curblock == lastblock) {
-			inblock_off = 0;
-			inblock_len = len - ncopied;
-		} else {
-			inblock_off = 0;
-			inblock_len = dev->block_size;
+		tail = sector + nsectors;
+		ntail = range->sector + range->num_sectors - tail;
+		range->num_sectors = sector - range->sector;
+		if (!range->num_sectors) {
+			*range = dev->discard[--dev->ndiscard];
+		}
+		if (!ntail) {
+			return;
 		}
 
-		err = ext2_block_read(dev, curblock, blockbuf);
-		if (err) {
-			return err;
+		/* head stays in place, tail takes new slot */
+		if (dev->ndiscard == EXT2_DISCARD_MAX) {
+			ext2_discard_flush(dev);
 		}
+		dev->discard[dev->ndiscard].sector = tail;
+		dev->discard[dev->ndiscard].num_sectors = ntail;
+		dev->discard[dev->ndiscard].flags = 0;
+		dev->ndiscard++;
+		return;
+	}
+}
 
-		memcpy((u8 *) buf + ncopied, blockbuf + inblock_off, inblock_len);
+/* Read len bytes at disk offset with one request. Partial sectors
+ * at both ends go through bounce buffers, the rest is read in place.
+ */
+int ext2_nbytes_read(ext2_blkdev_t *dev, void *buf, size_t len, off_t offset)
+{
+	int err;
+	u8 headbuf[VIRTIO_BLK_SECTOR_SIZE], tailbuf[VIRTIO_BLK_SECTOR_SIZE];
+	virtio_blk_seg_t segs[3];
+	size_t nsegs = 0, headlen = 0, midlen, taillen;
+	size_t headoff = offset % VIRTIO_BLK_SECTOR_SIZE;
 
-		ncopied += inblock_len;
+	if (!len) {
+		return 0;
+	}
+
+	if (headoff) {
+		headlen = min(len, VIRTIO_BLK_SECTOR_SIZE - headoff);
+		segs[nsegs].addr = headbuf;
+		segs[nsegs++].len = VIRTIO_BLK_SECTOR_SIZE;
+	}
+	midlen = (len - headlen) / VIRTIO_BLK_SECTOR_SIZE * VIRTIO_BLK_SECTOR_SIZE;
+	if (midlen) {
+		segs[nsegs].addr = (u8 *) buf + headlen;
+		segs[nsegs++].len = midlen;
+	}
+	taillen = len - headlen - midlen;
+	if (taillen) {
+		segs[nsegs].addr = tailbuf;
+		segs[nsegs++].len = VIRTIO_BLK_SECTOR_SIZE;
 	}
 
+	err = virtio_blk_readv(dev->virtio_devnum,
+			offset / VIRTIO_BLK_SECTOR_SIZE, segs, nsegs);
+	if (err) {
+		return err;
+	}
+
+	memcpy(buf, headbuf + headoff, headlen);
+	memcpy((u8 *) buf + headlen + midlen, tailbuf, taillen);
+
 	return 0;
 }
 
+/* Write len bytes at disk offset with one request, partial sectors
+ * at both ends are read and merged first.
+ */
 int ext2_nbytes_write(ext2_blkdev_t *dev, void *buf, size_t len, off_t offset)
 {
 	int err;
-	u8 blockbuf[dev->block_size];
-	blkcnt_t firstblock = offset / dev->block_size,
-		lastblock = (offset + len) / dev->block_size;
-	size_t ncopied = 0, inblock_len;
-	off_t inblock_off;
+	u8 headbuf[VIRTIO_BLK_SECTOR_SIZE], tailbuf[VIRTIO_BLK_SECTOR_SIZE];
+	virtio_blk_seg_t segs[3];
+	size_t nsegs = 0, headlen = 0, midlen, taillen;
+	size_t headoff = offset % VIRTIO_BLK_SECTOR_SIZE;
+	u64 sector = offset / VIRTIO_BLK_SECTOR_SIZE;
 
-	for (blkcnt_t curblock = firstblock; curblock <= lastblock; curblock++) {
-		if (curblock == firstblock) {
-			inblock_off = offset - curblock * dev->block_size;
-			if (dev->block_size - inblock_off > len) {
-				inblock_len = len;
-			} else {
-				inblock_len = dev->block_size - inblock_off;
-			}
-
-			err = ext2_block_read(dev, curblock, blockbuf);
-			if (err) {
-				return err;
-			}
-		} else if (curblock == lastblock) {
-			inblock_off = 0;
-			inblock_len = len - ncopied;
-		} else {
-			inblock_off = 0;
-			inblock_len = dev->block_size;
+	if (!len) {
+		return 0;
+	}
 
-			err = ext2_block_read(dev, curblock, blockbuf);
-			if (err) {
-				return err;
-			}
+	if (headoff) {
+		headlen = min(len, VIRTIO_BLK_SECTOR_SIZE - headoff);
+		err = virtio_blk_read(dev->virtio_devnum, sector, headbuf, 1);
+		if (err) {
+			return err;
 		}
-
-		memcpy(blockbuf + inblock_off, (u8 *) buf + ncopied, inblock_len);
-
-		err = ext2_block_write(dev, curblock, blockbuf);
+		memcpy(headbuf + headoff, buf, headlen);
+		segs[nsegs].addr = headbuf;
+		segs[nsegs++].len = VIRTIO_BLK_SECTOR_SIZE;
+	}
+	midlen = (len - headlen) / VIRTIO_BLK_SECTOR_SIZE * VIRTIO_BLK_SECTOR_SIZE;
+	if (midlen) {
+		segs[nsegs].addr = (u8 *) buf + headlen;
+		segs[nsegs++].len = midlen;
+	}
+	taillen = len - headlen - midlen;
+	if (taillen) {
+		err = virtio_blk_read(dev->virtio_devnum,
+				(offset + headlen + midlen) / VIRTIO_BLK_SECTOR_SIZE,
+				tailbuf, 1);
 		if (err) {
 			return err;
 		}
-
-		ncopied += inblock_len;
+		memcpy(tailbuf, (u8 *) buf + headlen + midlen, taillen);
+		segs[nsegs].addr = tailbuf;
+		segs[nsegs++].len = VIRTIO_BLK_SECTOR_SIZE;
 	}
 
-	return 0;
+	return virtio_blk_writev(dev->virtio_devnum, sector, segs, nsegs);
 }
 
 static int ext2_superblock_read(ext2_blkdev_t *dev, ext2_superblock_t *superblock)
@@ -563,6 +647,7 @@ static int ext2_block_allocate(ext2_blkdev_t *dev, u32 *blknum, ino_t inode_hint
 			}
 
 			*blknum = bgnum_hint * dev->blocks_per_group + i;
+			ext2_discard_remove(dev, *blknum);
 
 			err = ext2_block_counter_decrement(dev, *blknum);
 			if (err) {
@@ -602,6 +687,7 @@ static int ext2_block_allocate(ext2_blkdev_t *dev, u32 *blknum, ino_t inode_hint
 				}
 
 				*blknum = bgnum * dev->blocks_per_group + i;
+				ext2_discard_remove(dev, *blknum);
 				
 				err = ext2_block_counter_decrement(dev, *blknum);
 				if (err) {
@@ -647,6 +733,8 @@ static int ext2_block_free(ext2_blkdev_t *dev, blkcnt_t blknum)
 		return err;
 	}
 
+	ext2_discard_add(dev, blknum);
+
 	return 0;
 }
 
@@ -657,14 +745,11 @@ static int ext2_file_block_allocate(ext2_blkdev_t *dev, ino_t inum, blkcnt_t blk
 	u32 blockbuf0[dev->block_size / sizeof(u32)],
 		blockbuf1[dev->block_size / sizeof(u32)],
 		blockbuf2[dev->block_size / sizeof(u32)];
-	u8 zeroblockbuf[dev->block_size];
 	blkcnt_t blknum0, blknum1, blknum2,
 		singly_indirect = dev->block_size / sizeof(*inode.i_block),
 		doubly_indirect = singly_indirect * singly_indirect,
 		triply_indirect = doubly_indirect * singly_indirect;
 
-	bzero(zeroblockbuf, dev->block_size);
-
 	err = ext2_inode_read(dev, inum, &inode);
 	if (err) {
 		return err;
@@ -685,7 +770,7 @@ static int ext2_file_block_allocate(ext2_blkdev_t *dev, ino_t inum, blkcnt_t blk
 			if (err) {
 				return err;
 			}
-			err = ext2_block_write(dev, inode.i_block[12], zeroblockbuf);
+			err = ext2_block_zero(dev, inode.i_block[12]);
 			if (err) {
 				return err;
 			}
@@ -716,7 +801,7 @@ static int ext2_file_block_allocate(ext2_blkdev_t *dev, ino_t inum, blkcnt_t blk
 			if (err) {
 				return err;
 			}
-			err = ext2_block_write(dev, inode.i_block[13], zeroblockbuf);
+			err = ext2_block_zero(dev, inode.i_block[13]);
 			if (err) {
 				return err;
 			}
@@ -732,7 +817,7 @@ static int ext2_file_block_allocate(ext2_blkdev_t *dev, ino_t inum, blkcnt_t blk
 			if (err) {
 				return err;
 			}
-			err = ext2_block_write(dev, blockbuf0[blknum0], zeroblockbuf);
+			err = ext2_block_zero(dev, blockbuf0[blknum0]);
 			if (err) {
 				return err;
 			}
@@ -773,7 +858,7 @@ static int ext2_file_block_allocate(ext2_blkdev_t *dev, ino_t inum, blkcnt_t blk
 			if (err) {
 				return err;
 			}
-			err = ext2_block_write(dev, inode.i_block[14], zeroblockbuf);
+			err = ext2_block_zero(dev, inode.i_block[14]);
 			if (err) {
 				return err;
 			}
@@ -789,7 +874,7 @@ static int ext2_file_block_allocate(ext2_blkdev_t *dev, ino_t inum, blkcnt_t blk
 			if (err) {
 				return err;
 			}
-			err = ext2_block_write(dev, blockbuf0[blknum0], zeroblockbuf);
+			err = ext2_block_zero(dev, blockbuf0[blknum0]);
 			if (err) {
 				return err;
 			}
@@ -809,7 +894,7 @@ static int ext2_file_block_allocate(ext2_blkdev_t *dev, ino_t inum, blkcnt_t blk
 			if (err) {
 				return err;
 			}
-			err = ext2_block_write(dev, blockbuf1[blknum1], zeroblockbuf);
+			err = ext2_block_zero(dev, blockbuf1[blknum1]);
 			if (err) {
 				return err;
 			}
@@ -1053,80 +1138,81 @@ static int ext2_file_block_free(ext2_blkdev_t *dev, ino_t inum, blkcnt_t blknum)
 	return 0;
 }
 
-static int ext2_file_block_read(ext2_blkdev_t *dev, ino_t inum, blkcnt_t blknum,
-		void *blockbuf)
+/* Find disk block holding file block blknum, zero is a hole. */
+/* read indirect block at level of path unless it is there already */
+static int ext2_indirect_read(ext2_blkdev_t *dev, blkcnt_t blknum,
+		u32 *blockbuf, blkcnt_t *cached)
 {
 	int err;
-	ext2_inode_t inode;
-	u32 blockbuf0[dev->block_size / sizeof(u32)],
-		blockbuf1[dev->block_size / sizeof(u32)],
-		blockbuf2[dev->block_size / sizeof(u32)];
-	blkcnt_t blknum0, blknum1, blknum2,
-		singly_indirect = dev->block_size / sizeof(*inode.i_block),
-		doubly_indirect = singly_indirect * singly_indirect,
-		triply_indirect = doubly_indirect * singly_indirect;
 
-	err = ext2_inode_read(dev, inum, &inode);
+	if (*cached == blknum) {
+		return 0;
+	}
+
+	err = ext2_block_read(dev, blknum, blockbuf);
 	if (err) {
+		*cached = 0;
 		return err;
 	}
+	*cached = blknum;
+
+	return 0;
+}
+
+/* Map file block of inode read by caller. Indirect blocks of path
+ * are kept in indirect, one block per level, and cached[level] tells
+ * which disk block each holds. Caller zeroes cached before first
+ * call, so mapping successive file blocks reads indirect blocks once.
+ */
+static int ext2_inode_block_map(ext2_blkdev_t *dev, ext2_inode_t *inode,
+		blkcnt_t blknum, u32 *indirect, blkcnt_t *cached, blkcnt_t *diskblk)
+{
+	int err;
+	blkcnt_t blknum0, blknum1, blknum2,
+		singly_indirect = dev->block_size / sizeof(*inode->i_block),
+		doubly_indirect = singly_indirect * singly_indirect,
+		triply_indirect = doubly_indirect * singly_indirect;
+	u32 *blockbuf0 = indirect,
+		*blockbuf1 = indirect + singly_indirect,
+		*blockbuf2 = indirect + 2 * singly_indirect;
+
+	*diskblk = 0;
 
 	if (blknum < 12) {
-		if (!inode.i_block[blknum]) {
-			bzero(blockbuf, dev->block_size);
-			return 0;
-		}
-		err = ext2_block_read(dev, inode.i_block[blknum], blockbuf);
-		if (err) {
-			return err;
-		}
+		*diskblk = inode->i_block[blknum];
 	} else if (blknum < 12 + singly_indirect) {
-		if (!inode.i_block[12]) {
-			bzero(blockbuf, dev->block_size);
+		if (!inode->i_block[12]) {
 			return 0;
 		}
 
-		err = ext2_block_read(dev, inode.i_block[12], blockbuf0);
-		if (err) {
-			return err;
-		}
-		if (!blockbuf0[blknum - 12]) {
-			bzero(blockbuf, dev->block_size);
-			return 0;
-		}
-		err = ext2_block_read(dev, blockbuf0[blknum - 12], blockbuf);
+		err = ext2_indirect_read(dev, inode->i_block[12], blockbuf0,
+				&cached[0]);
 		if (err) {
 			return err;
 		}
+		*diskblk = blockbuf0[blknum - 12];
 	} else if (blknum < 12 + singly_indirect + doubly_indirect) {
 		blknum0 = (blknum - 12 - singly_indirect) / singly_indirect;
 		blknum1 = (blknum - 12 - singly_indirect) - blknum0 * singly_indirect;
-		if (!inode.i_block[13]) {
-			bzero(blockbuf, dev->block_size);
+		if (!inode->i_block[13]) {
 			return 0;
 		}
 
-		err = ext2_block_read(dev, inode.i_block[13], blockbuf0);
+		err = ext2_indirect_read(dev, inode->i_block[13], blockbuf0,
+				&cached[0]);
 		if (err) {
 			return err;
 		}
 		if (!blockbuf0[blknum0]) {
-			bzero(blockbuf, dev->block_size);
 			return 0;
 		}
 
-		err = ext2_block_read(dev, blockbuf0[blknum0], blockbuf1);
-		if (err) {
-			return err;
-		}
-		if (!blockbuf1[blknum1]) {
-			bzero(blockbuf, dev->block_size);
-			return 0;
-		}
-		err = ext2_block_read(dev, blockbuf1[blknum1], blockbuf);
+		err = ext2_indirect_read(dev, blockbuf0[blknum0], blockbuf1,
+				&cached[1]);
 		if (err) {
 			return err;
 		}
+		*diskblk = blockbuf1[blknum1];
 	} else if (blknum < 12 + singly_indirect + doubly_indirect +
 			triply_indirect) {
 		blknum0 = (blknum - 12 - singly_indirect - doubly_indirect) /
@@ -1136,43 +1222,138 @@ static int ext2_file_block_read(ext2_blkdev_t *dev, ino_t inum, blkcnt_t blknum,
 		blknum2 = (blknum - 12 - singly_indirect - doubly_indirect) -
 			((blknum - 12 - singly_indirect - doubly_indirect) /
 			 singly_indirect) * singly_indirect;
-		if (!inode.i_block[14]) {
-			bzero(blockbuf, dev->block_size);
+		if (!inode->i_block[14]) {
 			return 0;
 		}
 
-		err = ext2_block_read(dev, inode.i_block[14], blockbuf0);
+		err = ext2_indirect_read(dev, inode->i_block[14], blockbuf0,
+				&cached[0]);
 		if (err) {
 			return err;
 		}
 		if (!blockbuf0[blknum0]) {
-			bzero(blockbuf, dev->block_size);
 			return 0;
 		}
 
-		err = ext2_block_read(dev, blockbuf0[blknum0], blockbuf1);
+		err = ext2_indirect_read(dev, blockbuf0[blknum0], blockbuf1,
+				&cached[1]);
 		if (err) {
 			return err;
 		}
 		if (!blockbuf1[blknum1]) {
-			bzero(blockbuf, dev->block_size);
 			return 0;
 		}
 
-		err = ext2_block_read(dev, blockbuf1[blknum1], blockbuf2);
+		err = ext2_indirect_read(dev, blockbuf1[blknum1], blockbuf2,
+				&cached[2]);
 		if (err) {
 			return err;
 		}
-		if (!blockbuf2[blknum2]) {
-			bzero(blockbuf, dev->block_size);
-			return 0;
+		*diskblk = blockbuf2[blknum2];
+	} else {
+		return -EFBIG;
+	}
+
+	return 0;
+}
+
+static int ext2_file_block_map(ext2_blkdev_t *dev, ino_t inum, blkcnt_t blknum,
+		blkcnt_t *diskblk)
+{
+	int err;
+	ext2_inode_t inode;
+	u32 indirect[3 * dev->block_size / sizeof(u32)];
+	blkcnt_t cached[3] = {0, 0, 0};
+
+	*diskblk = 0;
+
+	err = ext2_inode_read(dev, inum, &inode);
+	if (err) {
+		return err;
+	}
+
+	return ext2_inode_block_map(dev, &inode, blknum, indirect, cached,
+			diskblk);
+}
+
+static int ext2_file_block_read(ext2_blkdev_t *dev, ino_t inum, blkcnt_t blknum,
+		void *blockbuf)
+{
+	int err;
+	blkcnt_t diskblk;
+
+	err = ext2_file_block_map(dev, inum, blknum, &diskblk);
+	if (err) {
+		return err;
+	}
+
+	if (!diskblk) {
+		bzero(blockbuf, dev->block_size);
+		return 0;
+	}
+
+	return ext2_block_read(dev, diskblk, blockbuf);
+}
+
+/* Read whole file blocks from first up to last into buf, blocks
+ * adjacent on disk are read with one request. Inode is read once
+ * and indirect blocks are kept while we walk, block that ends a
+ * run is not mapped again as start of next one.
+ */
+static int ext2_file_blocks_read(ext2_blkdev_t *dev, ino_t inum,
+		blkcnt_t first, blkcnt_t last, void *buf)
+{
+	int err;
+	ext2_inode_t inode;
+	u32 indirect[3 * dev->block_size / sizeof(u32)];
+	blkcnt_t cached[3] = {0, 0, 0};
+	blkcnt_t diskblk, nextblk;
+	size_t nblocks;
+	bool havenext = false;
+
+	err = ext2_inode_read(dev, inum, &inode);
+	if (err) {
+		return err;
+	}
+
+	while (first <= last) {
+		if (havenext) {
+			diskblk = nextblk;
+			havenext = false;
+		} else {
+			err = ext2_inode_block_map(dev, &inode, first, indirect,
+					cached, &diskblk);
+			if (err) {
+				return err;
+			}
 		}
-		err = ext2_block_read(dev, blockbuf2[blknum2], blockbuf);
+
+		if (!diskblk) {
+			bzero(buf, dev->block_size);
+			buf = (u8 *) buf + dev->block_size;
+			first++;
+			continue;
+		}
+
+		for (nblocks = 1; first + nblocks <= last &&
+				nblocks < EXT2_MULTIBLOCK_MAX; nblocks++) {
+			err = ext2_inode_block_map(dev, &inode, first + nblocks,
+					indirect, cached, &nextblk);
+			if (err) {
+				return err;
+			}
+			if (nextblk != diskblk + nblocks) {
+				havenext = true;
+				break;
+			}
+		}
+
+		err = ext2_blocks_read(dev, diskblk, nblocks, buf);
 		if (err) {
 			return err;
 		}
-	} else {
-		return -EFBIG;
+		buf = (u8 *) buf + nblocks * dev->block_size;
+		first += nblocks;
 	}
 
 	return 0;
@@ -1401,8 +1582,15 @@ static ssize_t ext2_file_read(ext2_blkdev_t *dev, ino_t inum, void *buf, size_t
 			inblock_off = 0;
 			inblock_len = len - ncopied;
 		} else {
-			inblock_off = 0;
-			inblock_len = dev->block_size;
+			/* whole blocks up to last one go directly into buf */
+			err = ext2_file_blocks_read(dev, inum, curblock,
+					lastblock - 1, (u8 *) buf + ncopied);
+			if (err) {
+				return err;
+			}
+			ncopied += (lastblock - curblock) * dev->block_size;
+			curblock = lastblock - 1;
+			continue;
 		}
 
 		err = ext2_file_block_read(dev, inum, curblock, blockbuf);
@@ -2105,6 +2293,7 @@ int ext2_unlink_file(ext2_blkdev_t *dev, ino_t inum)
 		if (err) {
 			return err;
 		}
+		ext2_discard_flush(dev);
 	} else {
 		inode.i_links_count--;
 		err = ext2_inode_write(dev, inum, &inode);
@@ -2598,6 +2787,22 @@ ssize_t ext2_regular_write(ext2_blkdev_t *dev, ino_t inum, void *buf,
 	return len;
 }
 
+/* Data and metadata are written to device before write returns,
+ * nothing is dirty in memory. What is left is device write cache
+ * and freed blocks not discarded yet, so fsync and fdatasync are
+ * the same flush. Call without dev->lock held, so concurrent
+ * callers can share one cache flush.
+ */
+int ext2_fsync(ext2_blkdev_t *dev, ino_t inum, bool datasync)
+{
+	/* writes in progress finish before flush */
+	mutex_lock(&dev->lock);
+	ext2_discard_flush(dev);
+	mutex_unlock(&dev->lock);
+
+	return virtio_blk_flush(dev->virtio_devnum);
+}
+
 int ext2_chdir(ext2_blkdev_t *dev, ino_t inum, ino_t *cwd)
 {
 	int err;
@@ -2878,6 +3083,7 @@ int ext2_truncate(ext2_blkdev_t *dev, ino_t inum, size_t sz)
 		if (err) {
 			return err;
 		}
+		ext2_discard_flush(dev);
 	} else if (sz > oldsz) {
 		EXT2_INODE_SET_I_SIZE(dev, inode, sz);
 		err = ext2_inode_write(dev, inum, &inode);
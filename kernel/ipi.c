@@ -0,0 +1,192 @@
+#include <kernel/ipi.h>
+#include <kernel/clint-sifive.h>
+#include <kernel/percpu.h>
+#include <kernel/preempt.h>
+#include <kernel/spinlock.h>
+#include <kernel/riscv64.h>
+
+/* harts which can receive ipis */
+static volatile u64 ipi_online_harts = 0;
+
+static DEFINE_PER_CPU(u64, ipi_pending);
+
+/* remote calls queued to hart, linked by ipi_call->calls */
+static DEFINE_PER_CPU(spinlock_t, ipi_calls_lock);
+static DEFINE_PER_CPU(list_t, ipi_calls);
+
+void ipi_init(void)
+{
+	for (size_t i = 0; i < NCPU; i++) {
+		spinlock_init(per_cpu_ptr(&ipi_calls_lock, i));
+		list_init(per_cpu_ptr(&ipi_calls, i));
+	}
+}
+
+/* m-mode already enabled msip in clint_init */
+void ipi_hart_init(void)
+{
+	u64 old;
+	do {
+		old = ipi_online_harts;
+	} while (!atomic_compare_and_swap(&ipi_online_harts, old,
+				old | (1ull << cpuid())));
+}
+
+static void ipi_send(u64 cpu, int type)
+{
+	atomic_fetch_or64(per_cpu_ptr(&ipi_pending, cpu), 1ull << type);
+	/* target must see pending bit when it takes interrupt */
+	atomic_membar();
+	clint_send_ipi(cpu);
+}
+
+/* run calls queued to this hart, interrupts should be disabled */
+static void ipi_run_calls(void)
+{
+	int irqflags;
+	ipi_call_t *call;
+	spinlock_t *lock = this_cpu_ptr(&ipi_calls_lock);
+	list_t *calls = this_cpu_ptr(&ipi_calls);
+
+	while (1) {
+		spinlock_acquire_irqsave(lock, irqflags);
+		if (list_empty(calls)) {
+			spinlock_release_irqrestore(lock, irqflags);
+			break;
+		}
+		call = list_entry(calls->next, ipi_call_t, calls);
+		list_del(&call->calls);
+		spinlock_release_irqrestore(lock, irqflags);
+
+		call->func(call->arg);
+
+		/* caller may reuse call right after done */
+		atomic_release_membar();
+		call->done = 1;
+	}
+}
+
+void ipi_irq_handler(void)
+{
+	u64 pending;
+
+	/* clear ssip first, so ipi sent after swap raises it again */
+	w_sip(r_sip() & ~SIP_SSIP);
+	pending = atomic_test_and_set(this_cpu_ptr(&ipi_pending), 0);
+	atomic_acquire_membar();
+
+	if (pending & (1ull << IPI_RESCHED)) {
+		/* preempt on irq return, or leave idle loop */
+		curcpu()->need_resched = true;
+	}
+	if (pending & (1ull << IPI_CALL)) {
+		ipi_run_calls();
+	}
+}
+
+void ipi_resched(u64 cpu)
+{
+	if (ipi_online_harts & (1ull << cpu)) {
+		ipi_send(cpu, IPI_RESCHED);
+	}
+}
+
+/* Run func on every online hart in cpumask and wait until all
+ * of them returned. func runs in interrupt context on remote
+ * harts. We serve calls queued to us while waiting, so two harts
+ * calling each other with interrupts disabled do not deadlock.
+ */
+void ipi_call_mask(u64 cpumask, void (*func)(void *arg), void *arg)
+{
+	int irqflags;
+	ipi_call_t calls[NCPU];
+	u64 self;
+
+	preempt_disable();
+	self = cpuid();
+	cpumask &= ipi_online_harts;
+
+	for (size_t i = 0; i < NCPU; i++) {
+		if (!(cpumask & (1ull << i)) || i == self) {
+			continue;
+		}
+		calls[i].func = func;
+		calls[i].arg = arg;
+		calls[i].done = 0;
+		spinlock_acquire_irqsave(per_cpu_ptr(&ipi_calls_lock, i), irqflags);
+		list_add_tail(&calls[i].calls, per_cpu_ptr(&ipi_calls, i));
+		spinlock_release_irqrestore(per_cpu_ptr(&ipi_calls_lock, i), irqflags);
+		ipi_send(i, IPI_CALL);
+	}
+
+	if (cpumask & (1ull << self)) {
+		irqflags = irq_enabled();
+		irq_off();
+		func(arg);
+		if (irqflags) {
+			irq_on();
+		}
+	}
+
+	for (size_t i = 0; i < NCPU; i++) {
+		if (!(cpumask & (1ull << i)) || i == self) {
+			continue;
+		}
+		while (!calls[i].done) {
+			irqflags = irq_enabled();
+			irq_off();
+			ipi_run_calls();
+			if (irqflags) {
+				irq_on();
+			}
+		}
+	}
+	atomic_acquire_membar();
+
+	preempt_enable();
+}
+
+void tlb_batch_init(tlb_batch_t *batch)
+{
+	batch->n = 0;
+	batch->flush_all = false;
+}
+
+void tlb_batch_add(tlb_batch_t *batch, u64 vaddr)
+{
+	if (batch->flush_all) {
+		return;
+	}
+	if (batch->n == TLB_BATCH_SIZE) {
+		/* cheaper to flush everything */
+		batch->flush_all = true;
+		return;
+	}
+	batch->vaddrs[batch->n++] = vaddr;
+}
+
+static void tlb_batch_local_flush(void *arg)
+{
+	tlb_batch_t *batch = arg;
+	if (batch->flush_all) {
+		sfence_vma();
+		return;
+	}
+	for (size_t i = 0; i < batch->n; i++) {
+		sfence_vma_addr(batch->vaddrs[i]);
+	}
+}
+
+/* Flush collected addresses on harts in cpumask with one ipi
+ * per hart. Page table changes must be done before the call.
+ */
+void tlb_batch_flush(tlb_batch_t *batch, u64 cpumask)
+{
+	if (!batch->n && !batch->flush_all) {
+		return;
+	}
+	/* sfence orders page table stores, membar makes them visible */
+	atomic_membar();
+	ipi_call_mask(cpumask, tlb_batch_local_flush, batch);
+	tlb_batch_init(batch);
+}
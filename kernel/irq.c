@@ -7,9 +7,21 @@
 #include <kernel/proc.h>
 #include <kernel/syscall.h>
 #include <kernel/virtio.h>
+#include <kernel/clint-sifive.h>
+#include <kernel/timer.h>
+#include <kernel/rcu.h>
+#include <kernel/ipi.h>
+#include <kernel/softirq.h>
+#include <kernel/klib.h>
 
+DEFINE_PER_CPU(irqstat_t, irqstat);
+
+/* only top half runs here, bottom half is left to softirq */
 static void external_irq_handler(void)
 {
+	u64 start = ktimer_now();
+	u64 time;
+	irqstat_t *stat;
 	u32 irq = plic_irq_claim();
 	switch (irq) {
 	case VIRT_PLIC_UART0:
@@ -32,6 +44,14 @@ static void external_irq_handler(void)
 		panic("unknow external irq");
 	}
 	plic_irq_complete(irq);
+
+	time = ktimer_now() - start;
+	stat = this_cpu_ptr(&irqstat);
+	stat->hardirqs++;
+	stat->hardirq_total += time;
+	if (time > stat->hardirq_max) {
+		stat->hardirq_max = time;
+	}
 }
 
 static void kernel_timer_irq_handler(void)
@@ -39,11 +59,13 @@ static void kernel_timer_irq_handler(void)
 	/* check for panic and spin if true */
 	while (paniced);
 
-	/* We need to disable stie bit or timer interrupt
-	 * will be triggered again immediately after return
-	 * because stip bit is always enabled
-	 */
-	w_sie(r_sie() & ~SIE_STIE);
+	/* schedule next timer interrupt */
+	if (clint_timer_rearm()) {
+		curcpu()->need_resched = true;
+	}
+
+	/* run expired timers */
+	ktimer_irq_handler();
 }
 
 void kernel_irq_handler(void)
@@ -51,6 +73,8 @@ void kernel_irq_handler(void)
 	u64 scause = r_scause();
 	u64 intr = scause & SCAUSE_INTERRUPT_MASK;
 	u64 excode = scause & SCAUSE_EXCEPTION_CODE_MASK;
+	/* interrupts were enabled in trapped code */
+	bool preemptible = r_sstatus() & SSTATUS_SPIE;
 
 	if (intr) {
 		switch (excode) {
@@ -58,11 +82,15 @@ void kernel_irq_handler(void)
 			kernel_timer_irq_handler();
 			break;
 		case SCAUSE_SOFTWARE_IRQ:
-			panic("SCAUSE_SOFTWARE_IRQ");
+			ipi_irq_handler();
+			break;
 		case SCAUSE_EXTERNAL_IRQ:
 			external_irq_handler();
 			break;
 		}
+
+		/* bottom halves raised by this or nested interrupts */
+		softirq_run();
 	} else {
 		switch (excode) {
 		case SCAUSE_EXCEPTION_INSTURCTION_ADDRESS_MISALIGNED:
@@ -93,6 +121,10 @@ void kernel_irq_handler(void)
 			panic("SCAUSE_EXCEPTION_STORE_PAGE_FAULT");
 		}
 	}
+
+	if (preemptible) {
+		sched_preempt();
+	}
 }
 
 static void user_timer_irq_handler(void)
@@ -100,14 +132,13 @@ static void user_timer_irq_handler(void)
 	/* check for panic and spin if true */
 	while (paniced);
 
-	/* We need to disable stie bit or timer interrupt
-	 * will be triggered again immediately after return
-	 * because stip bit is always enabled
-	 */
-	w_sie(r_sie() & ~SIE_STIE);
+	/* schedule next timer interrupt */
+	if (clint_timer_rearm()) {
+		curcpu()->need_resched = true;
+	}
 
-	/* switch to the next task */
-	sched();
+	/* run expired timers */
+	ktimer_irq_handler();
 }
 
 void user_irq_handler(void)
@@ -116,17 +147,24 @@ void user_irq_handler(void)
 	u64 intr = scause & SCAUSE_INTERRUPT_MASK;
 	u64 excode = scause & SCAUSE_EXCEPTION_CODE_MASK;
 
+	/* hart was in user mode, so it holds no rcu protected pointer */
+	rcu_quiescent();
+
 	if (intr) {
 		switch (excode) {
 		case SCAUSE_TIMER_IRQ:
 			user_timer_irq_handler();
 			break;
 		case SCAUSE_SOFTWARE_IRQ:
-			panic("SCAUSE_SOFTWARE_IRQ");
+			ipi_irq_handler();
+			break;
 		case SCAUSE_EXTERNAL_IRQ:
 			external_irq_handler();
 			break;
 		}
+
+		/* bottom halves raised by this or nested interrupts */
+		softirq_run();
 	} else {
 		switch (excode) {
 		case SCAUSE_EXCEPTION_INSTURCTION_ADDRESS_MISALIGNED:
@@ -146,7 +184,10 @@ void user_irq_handler(void)
 		case SCAUSE_EXCEPTION_STORE_ACCESS_FAULT:
 			panic("SCAUSE_EXCEPTION_STORE_ACCESS_FAULT");
 		case SCAUSE_EXCEPTION_ENVIRONMENT_CALL_FROM_UMODE:
+			/* syscalls are preemptible */
+			irq_on();
 			syscall();
+			irq_off();
 			break;
 		case SCAUSE_EXCEPTION_ENVIRONMENT_CALL_FROM_SMODE:
 			panic("SCAUSE_EXCEPTION_ENVIRONMENT_CALL_FROM_SMODE");
@@ -158,6 +199,9 @@ void user_irq_handler(void)
 			panic("SCAUSE_EXCEPTION_STORE_PAGE_FAULT");
 		}
 	}
+
+	/* user mode is always preemptible */
+	sched_preempt();
 }
 
 void irq_hart_init(void)
@@ -168,3 +212,26 @@ void irq_hart_init(void)
 	w_stvec(((u64) kerneltrap) | STVEC_MODE_DIRECT);
 }
 
+void irq_stat(irqstat_t *stat)
+{
+	irqstat_t *cpustat;
+	bzero(stat, sizeof(*stat));
+	for (size_t cpu = 0; cpu < NCPU; cpu++) {
+		cpustat = per_cpu_ptr(&irqstat, cpu);
+		stat->hardirqs += cpustat->hardirqs;
+		stat->hardirq_total += cpustat->hardirq_total;
+		stat->hardirq_max = max(stat->hardirq_max, cpustat->hardirq_max);
+		stat->softirqs += cpustat->softirqs;
+		stat->softirq_total += cpustat->softirq_total;
+		stat->softirq_max = max(stat->softirq_max, cpustat->softirq_max);
+	}
+}
+
+/* counters of other harts may be updated meanwhile */
+void irq_stat_reset(void)
+{
+	for (size_t cpu = 0; cpu < NCPU; cpu++) {
+		bzero(per_cpu_ptr(&irqstat, cpu), sizeof(irqstat_t));
+	}
+}
+
@@ -10,6 +10,14 @@
 #include <kernel/virtio.h>
 #include <kernel/fs.h>
 #include <kernel/dev.h>
+#include <kernel/clint-sifive.h>
+#include <kernel/timer.h>
+#include <kernel/wchan.h>
+#include <kernel/lockbench.h>
+#include <kernel/blkbench.h>
+#include <kernel/rcu.h>
+#include <kernel/ipi.h>
+#include <kernel/workqueue.h>
 
 static u64 cpu0_init = 0;
 
@@ -25,6 +33,9 @@ void __proc_test__(void)
 	size_t elf2sz = (u64) &elfbin_end - (u64) elfbin_test2;
 
 	proc_create(elf1, elf1sz);
+
+	/* benchmarks, two instances ping-pong in yield bench */
+	//proc_create(elf2, elf2sz);
 	//proc_create(elf2, elf2sz);
 }
 
@@ -35,16 +46,27 @@ void kmain(void)
 		kprintf_init();
 		ram_init();
 		alloc_init();
+		ktimer_init();
 		irq_hart_init();
+		clint_hart_init();
 		plic_init();
 		plic_hart_init();
 		vm_init();
 		vm_hart_init();
+		sched_init();
+		ipi_init();
+		ipi_hart_init();
+		wchan_init();
 		proc_init();
 		proc_hart_init();
+		rcu_hart_init();
 		virtio_init();
 		fs_init();
 		dev_init();
+		workqueue_init();
+
+		/* does nothing unless enabled in config */
+		blkbench();
 
 		/* process testing function */
 		__proc_test__();
@@ -56,11 +78,17 @@ void kmain(void)
 		atomic_acquire_membar();
 
 		irq_hart_init();
+		clint_hart_init();
 		plic_hart_init();
 		vm_hart_init();
+		ipi_hart_init();
 		proc_hart_init();
+		rcu_hart_init();
 	}
 
+	/* does nothing unless enabled in config */
+	lockbench();
+
 	scheduler();
 }
 
@@ -1,6 +1,7 @@
 #include <kernel/riscv64.h>
 #include <kernel/proc.h>
 #include <kernel/clint-sifive.h>
+#include <kernel/percpu.h>
 
 void kmain(void);
 __attribute__((aligned(RISCV64_STACK_ALIGN))) char kstack[KSTACKSIZE * NCPU];
@@ -21,8 +22,8 @@ void kstart(void)
 	w_pmpaddr0(0x3fffffffffffff);
 	w_pmpcfg0(PMPXCFG(0, PMPXCFG_R | PMPXCFG_W | PMPXCFG_X | PMPXCFG_A_TOR));
 
-	/* save hart id in tp register. we can not access mhartid in s-mode */
-	w_tp(r_mhartid());
+	/* tp points to per-cpu area of this hart */
+	w_tp(percpu_hart_init(r_mhartid()));
 
 	/* disable paging for s-mode */
 	w_satp(0);
@@ -0,0 +1,119 @@
+#include <kernel/lockbench.h>
+#include <kernel/spinlock.h>
+#include <kernel/mcslock.h>
+#include <kernel/kprintf.h>
+#include <kernel/riscv64.h>
+#include <kernel/timer.h>
+
+#if LOCKBENCH
+
+#define LOCKBENCH_TAS    0
+#define LOCKBENCH_TICKET 1
+#define LOCKBENCH_MCS    2
+
+static volatile u32 barrier_count;
+static volatile u32 barrier_gen;
+
+/* old amoswap test-and-set lock to compare with */
+static volatile u64 taslock;
+static spinlock_t ticketlock;
+static mcslock_t mcslock;
+
+static volatile u64 counter;
+static u64 elapsed[NCPU];
+
+static void lockbench_barrier(void)
+{
+	u32 gen = barrier_gen;
+	if (atomic_fetch_add32(&barrier_count, 1) == LOCKBENCH - 1) {
+		barrier_count = 0;
+		atomic_membar();
+		barrier_gen = gen + 1;
+	} else {
+		while (barrier_gen == gen);
+	}
+	atomic_membar();
+}
+
+static void lockbench_run(int type, const char *name)
+{
+	mcsnode_t node;
+	u64 start, min = -1, max = 0;
+
+	lockbench_barrier();
+
+	start = r_time();
+	for (size_t i = 0; i < LOCKBENCH_ITERS; i++) {
+		switch (type) {
+		case LOCKBENCH_TAS:
+			while (atomic_test_and_set(&taslock, 1));
+			atomic_acquire_membar();
+			counter++;
+			atomic_release_membar();
+			atomic_set(&taslock, 0);
+			break;
+		case LOCKBENCH_TICKET:
+			spinlock_acquire(&ticketlock);
+			counter++;
+			spinlock_release(&ticketlock);
+			break;
+		case LOCKBENCH_MCS:
+			mcslock_acquire(&mcslock, &node);
+			counter++;
+			mcslock_release(&mcslock, &node);
+			break;
+		}
+	}
+	elapsed[cpuid()] = r_time() - start;
+
+	lockbench_barrier();
+
+	if (!cpuid()) {
+		for (size_t i = 0; i < LOCKBENCH; i++) {
+			min = elapsed[i] < min ? elapsed[i] : min;
+			max = elapsed[i] > max ? elapsed[i] : max;
+		}
+
+		/* big spread between harts means unfair lock */
+		kprintf_s("lockbench %s: %u harts, %u ns per acquire, "
+				"fastest hart %u us, slowest hart %u us\n",
+				name, (u64) LOCKBENCH,
+				KTIMER_TICKS_TO_NS(max) / (LOCKBENCH * LOCKBENCH_ITERS),
+				KTIMER_TICKS_TO_NS(min) / 1000,
+				KTIMER_TICKS_TO_NS(max) / 1000);
+
+		if (counter != LOCKBENCH * LOCKBENCH_ITERS) {
+			panic("lockbench: counter mismatch");
+		}
+		counter = 0;
+	}
+
+	lockbench_barrier();
+}
+
+void lockbench(void)
+{
+	if (cpuid() >= LOCKBENCH) {
+		return;
+	}
+
+	if (!cpuid()) {
+		taslock = 0;
+		spinlock_init(&ticketlock);
+		mcslock_init(&mcslock);
+		counter = 0;
+	}
+
+	lockbench_run(LOCKBENCH_TAS, "test-and-set");
+	lockbench_run(LOCKBENCH_TICKET, "ticket");
+	lockbench_run(LOCKBENCH_MCS, "mcs");
+}
+
+#else
+
+void lockbench(void)
+{
+}
+
+#endif
+
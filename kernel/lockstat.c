@@ -0,0 +1,149 @@
+#include <kernel/lockstat.h>
+#include <kernel/riscv64.h>
+#include <kernel/klib.h>
+#include <kernel/percpu.h>
+
+#if LOCKSTAT
+
+typedef struct lockstat_counters lockstat_counters_t;
+
+/* hot counters of class, summed into lockstat_class_t on read */
+struct lockstat_counters {
+	u64 acquisitions;
+	u64 contended;
+	u64 wait_total;
+};
+
+/* Classes are only appended, so readers need no lock. Class lock
+ * can not be spinlock_t, it would be accounted itself.
+ */
+static lockstat_class_t lockstat_classes[LOCKSTAT_NCLASS];
+static volatile u64 lockstat_nclass = 0;
+static volatile u64 lockstat_classes_lock = 0;
+static DEFINE_PER_CPU(lockstat_counters_t [LOCKSTAT_NCLASS], lockstat_counters);
+
+lockstat_class_t *lockstat_class_get(const char *name, int type)
+{
+	lockstat_class_t *class = NULL;
+
+	while (atomic_test_and_set(&lockstat_classes_lock, 1));
+	atomic_acquire_membar();
+
+	for (size_t i = 0; i < lockstat_nclass; i++) {
+		if (lockstat_classes[i].type == type &&
+				!strncmp(lockstat_classes[i].name, name,
+					LOCKSTAT_NAME_MAX - 1)) {
+			class = &lockstat_classes[i];
+			break;
+		}
+	}
+
+	/* locks of classes which do not fit are not accounted */
+	if (!class && lockstat_nclass < LOCKSTAT_NCLASS) {
+		class = &lockstat_classes[lockstat_nclass];
+		strncpy(class->name, name, LOCKSTAT_NAME_MAX - 1);
+		class->type = type;
+		atomic_release_membar();
+		lockstat_nclass++;
+	}
+
+	atomic_release_membar();
+	atomic_set(&lockstat_classes_lock, 0);
+
+	return class;
+}
+
+static void lockstat_max(volatile u64 *max, u64 val,
+		volatile u64 *site, void *valsite)
+{
+	u64 old;
+	do {
+		old = *max;
+		if (val <= old) {
+			return;
+		}
+	} while (!atomic_compare_and_swap(max, old, val));
+	/* site may belong to slightly smaller max if we race */
+	*site = (u64) valsite;
+}
+
+void lockstat_acquired(lockstat_class_t *class, u64 start,
+		bool contended, void *site)
+{
+	u64 wait;
+	lockstat_counters_t *counters;
+	if (!class) {
+		return;
+	}
+	/* We hold lock, so we are not migrated. Interrupt handler
+	 * may take lock of the same class, so increments are atomic.
+	 */
+	counters = this_cpu_ptr(&lockstat_counters[class - lockstat_classes]);
+	atomic_fetch_add64(&counters->acquisitions, 1);
+	if (contended) {
+		wait = r_time() - start;
+		atomic_fetch_add64(&counters->contended, 1);
+		atomic_fetch_add64(&counters->wait_total, wait);
+		lockstat_max(&class->wait_max, wait, &class->wait_max_site, site);
+	}
+}
+
+void lockstat_released(lockstat_class_t *class, u64 acquired_at, void *site)
+{
+	if (!class) {
+		return;
+	}
+	lockstat_max(&class->hold_max, r_time() - acquired_at,
+			&class->hold_max_site, site);
+}
+
+void lockstat_reset(void)
+{
+	for (size_t cpu = 0; cpu < NCPU; cpu++) {
+		bzero(per_cpu_ptr(&lockstat_counters[0], cpu),
+				sizeof(lockstat_counters));
+	}
+	for (size_t i = 0; i < lockstat_nclass; i++) {
+		lockstat_classes[i].wait_max = 0;
+		lockstat_classes[i].hold_max = 0;
+		lockstat_classes[i].wait_max_site = 0;
+		lockstat_classes[i].hold_max_site = 0;
+	}
+}
+
+/* Copy classes with per-cpu counters summed to user buffer,
+ * counters may change while we copy.
+ */
+ssize_t lockstat_read(void *buf, size_t n, off_t offset)
+{
+	lockstat_class_t class;
+	lockstat_counters_t *counters;
+	size_t i, classoff, len, copied = 0;
+	size_t nclass = lockstat_nclass;
+	atomic_acquire_membar();
+
+	if (offset < 0) {
+		return 0;
+	}
+	i = offset / sizeof(class);
+	classoff = offset % sizeof(class);
+	for (; i < nclass && copied < n; i++, classoff = 0) {
+		class = lockstat_classes[i];
+		class.acquisitions = class.contended = class.wait_total = 0;
+		for (size_t cpu = 0; cpu < NCPU; cpu++) {
+			counters = per_cpu_ptr(&lockstat_counters[i], cpu);
+			class.acquisitions += counters->acquisitions;
+			class.contended += counters->contended;
+			class.wait_total += counters->wait_total;
+		}
+
+		len = min(sizeof(class) - classoff, n - copied);
+		if (copy_to_user(buf + copied, (void *) &class + classoff, len)) {
+			return -EFAULT;
+		}
+		copied += len;
+	}
+	return copied;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#include <kernel/mcslock.h>
+#include <kernel/riscv64.h>
+#include <kernel/preempt.h>
+
+void mcslock_init(mcslock_t *ml)
+{
+	ml->tail = NULL;
+}
+
+void mcslock_acquire(mcslock_t *ml, mcsnode_t *node)
+{
+	mcsnode_t *prev;
+
+	preempt_disable();
+
+	node->next = NULL;
+	node->locked = 1;
+	atomic_membar();
+
+	prev = (mcsnode_t *) atomic_test_and_set((volatile u64 *) &ml->tail, (u64) node);
+	if (prev) {
+		/* queue behind prev and spin on our own node */
+		prev->next = node;
+		while (node->locked);
+	}
+	atomic_acquire_membar();
+}
+
+void mcslock_release(mcslock_t *ml, mcsnode_t *node)
+{
+	atomic_release_membar();
+
+	if (!node->next) {
+		/* no waiters, just clear tail */
+		if (atomic_compare_and_swap((volatile u64 *) &ml->tail, (u64) node, 0)) {
+			preempt_enable();
+			return;
+		}
+
+		/* somebody swapped tail but has not linked to us yet */
+		while (!node->next);
+	}
+	node->next->locked = 0;
+
+	preempt_enable();
+}
+
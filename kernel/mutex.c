@@ -1,30 +1,107 @@
 #include <kernel/mutex.h>
 #include <kernel/sched.h>
+#include <kernel/riscv64.h>
 
+#if LOCKSTAT
+void __mutex_init(mutex_t *mutex, const char *name)
+#else
 void mutex_init(mutex_t *mutex)
+#endif
 {
-	spinlock_init(&mutex->sl);
 	mutex->lock = 0;
+	mutex->owner = NULL;
+#if LOCKSTAT
+	/* waitq lock is spinlock class of the same name */
+	__waitq_init(&mutex->waitq, name);
+	mutex->class = lockstat_class_get(name, LOCKSTAT_MUTEX);
+#else
+	waitq_init(&mutex->waitq);
+#endif
+}
+
+#if LOCKSTAT
+/* waitq lock should be held */
+static void mutex_acquired(mutex_t *mutex, u64 start, bool contended, void *site)
+{
+	lockstat_acquired(mutex->class, start, contended, site);
+	mutex->acquired_site = site;
+	mutex->acquired_at = r_time();
+}
+#endif
+
+/* Spin while mutex is held by the same owner and it is running
+ * on another hart. Owner state is read without its lock, it is
+ * just a hint. Mutex taken without process context is spun on.
+ */
+static void mutex_spin(mutex_t *mutex, proc_t *owner)
+{
+	volatile mutex_t *vmutex = mutex;
+	volatile proc_t *vowner = owner;
+	while (vmutex->lock && vmutex->owner == owner &&
+			(!owner || vowner->state == PROC_STATE_RUNNING));
 }
 
 void mutex_lock(mutex_t *mutex)
 {
 	int irqflags;
-	spinlock_acquire_irqsave(&mutex->sl, irqflags);
+	proc_t *owner, *proc = curproc();
+#if LOCKSTAT
+	u64 start = r_time();
+	bool contended;
+#endif
+
+	spinlock_acquire_irqsave(&mutex->waitq.lock, irqflags);
+#if LOCKSTAT
+	contended = mutex->lock;
+#endif
 	while (mutex->lock) {
-		spinlock_release_irqrestore(&mutex->sl, irqflags);
-		sched();
-		spinlock_acquire_irqsave(&mutex->sl, irqflags);
+		owner = mutex->owner;
+
+		/* owner will release mutex soon, so do not sleep */
+		if (!proc || !owner || owner->state == PROC_STATE_RUNNING) {
+			spinlock_release_irqrestore(&mutex->waitq.lock, irqflags);
+			mutex_spin(mutex, owner);
+			spinlock_acquire_irqsave(&mutex->waitq.lock, irqflags);
+			continue;
+		}
+
+		waitq_sleep(&mutex->waitq, mutex, &mutex->waitq.lock, WAITQ_FOREVER);
+
+		/* mutex_unlock handed mutex over to us */
+		if (mutex->owner == proc) {
+#if LOCKSTAT
+			mutex_acquired(mutex, start, contended,
+					__builtin_return_address(0));
+#endif
+			spinlock_release_irqrestore(&mutex->waitq.lock, irqflags);
+			return;
+		}
 	}
 	mutex->lock = 1;
-	spinlock_release_irqrestore(&mutex->sl, irqflags);
+	mutex->owner = proc;
+#if LOCKSTAT
+	mutex_acquired(mutex, start, contended, __builtin_return_address(0));
+#endif
+	spinlock_release_irqrestore(&mutex->waitq.lock, irqflags);
 }
 
 void mutex_unlock(mutex_t *mutex)
 {
 	int irqflags;
-	spinlock_acquire_irqsave(&mutex->sl, irqflags);
-	mutex->lock = 0;
-	spinlock_release_irqrestore(&mutex->sl, irqflags);
+	proc_t *next;
+
+	spinlock_acquire_irqsave(&mutex->waitq.lock, irqflags);
+#if LOCKSTAT
+	lockstat_released(mutex->class, mutex->acquired_at, mutex->acquired_site);
+#endif
+	next = __waitq_wake_one(&mutex->waitq, NULL);
+	if (next) {
+		/* direct handoff, lock stays taken by the first waiter */
+		mutex->owner = next;
+	} else {
+		mutex->lock = 0;
+		mutex->owner = NULL;
+	}
+	spinlock_release_irqrestore(&mutex->waitq.lock, irqflags);
 }
 
@@ -0,0 +1,14 @@
+#include <kernel/percpu.h>
+
+DEFINE_PER_CPU(u64, cpu_id);
+
+__attribute__((aligned(CACHE_LINE_SIZE))) u8 percpu_areas[NCPU][PERCPU_SIZE];
+
+/* Called from kstart in m-mode, returns value for tp.
+ * We can not access mhartid in s-mode, so save it in area.
+ */
+u64 percpu_hart_init(u64 hartid)
+{
+	*per_cpu_ptr(&cpu_id, hartid) = hartid;
+	return (u64) percpu_areas[hartid];
+}
@@ -6,11 +6,13 @@
 #include <kernel/elf.h>
 #include <kernel/trampoline.h>
 #include <kernel/cdev-tty.h>
+#include <kernel/sched.h>
+#include <kernel/wchan.h>
 
 static spinlock_t nextpid_lock;
 static volatile pid_t nextpid = 1;
 
-cpu_t cpus[NCPU];
+DEFINE_PER_CPU(cpu_t, cpus);
 proc_t proctable[NPROC];
 
 void proc_init(void)
@@ -18,6 +20,7 @@ void proc_init(void)
 	spinlock_init(&nextpid_lock);
 	for (size_t i = 0; i < NPROC; i++) {
 		spinlock_init(&proctable[i].lock);
+		seqlock_init(&proctable[i].idlock);
 		proctable[i].state = PROC_STATE_KILLED;
 		proctable[i].pid = 0;
 	}
@@ -27,6 +30,7 @@ void proc_hart_init(void)
 {
 	extern pte_t kpagetable[PTE_MAX];
 	curcpu()->proc = NULL;
+	curcpu()->prev = NULL;
 	curcpu()->context = kmalloc(sizeof(*curcpu()->context));
 	if (!curcpu()->context) {
 		panic("no memory");
@@ -83,6 +87,15 @@ static proc_t *proc_slot_alloc(void)
 	list_init(&proc->children);
 
 	proc->wchan = NULL;
+	proc->waitq = NULL;
+	list_init(&proc->waitq_list);
+	list_init(&proc->runq_list);
+
+	ktimer_setup(&proc->timer, NULL, NULL);
+	proc->timedout = false;
+
+	proc->kthread_func = NULL;
+	proc->kthread_arg = NULL;
 
 	for (size_t i = 0; i < FD_MAX; i++) {
 		proc->filetable[i].alloc = false;
@@ -233,6 +246,33 @@ void proc_destroy(proc_t *proc)
 	spinlock_release_irqrestore(&proc->lock, irqflags);
 }
 
+static void proc_destroy_work(work_t *work)
+{
+	int irqflags;
+	proc_t *proc = list_entry(work, proc_t, destroy_work);
+
+	/* Exiting kernel thread may still run on its stack, its lock
+	 * is held until it is switched away. sched_zombie wakes us.
+	 */
+	spinlock_acquire_irqsave(&proc->lock, irqflags);
+	while (proc->state != PROC_STATE_ZOMBIE &&
+			proc->state != PROC_STATE_REAPED) {
+		wchan_sleep(proc, &proc->lock);
+	}
+	spinlock_release_irqrestore(&proc->lock, irqflags);
+
+	proc_destroy(proc);
+}
+
+/* free process resources in worker, so caller does not pay
+ * for unmapping and freeing pages
+ */
+void proc_destroy_deferred(proc_t *proc)
+{
+	work_init(&proc->destroy_work, proc_destroy_work);
+	queue_work(&proc->destroy_work);
+}
+
 int proc_create(void *elf, size_t elfsz)
 {
 	int irqflags;
@@ -398,9 +438,81 @@ int proc_create(void *elf, size_t elfsz)
 	*proc->filetable[2].refcnt = 1;
 
 	spinlock_acquire_irqsave(&proc->lock, irqflags);
-	proc->state = PROC_STATE_RUNNABLE;
+	sched_wakeup(proc);
 	spinlock_release_irqrestore(&proc->lock, irqflags);
 
 	return 0;
 }
 
+
+/* to enter kernel thread first time we must jump into kthread_entry */
+static void kthread_entry(void)
+{
+	proc_t *proc = curproc();
+
+	proc->state = PROC_STATE_RUNNING;
+
+	/* release locks acquired by whoever switched to us */
+	sched_finish();
+	spinlock_release(&proc->lock);
+	irq_on();
+
+	proc->kthread_func(proc->kthread_arg);
+
+	kthread_exit();
+}
+
+/* Create kernel thread running func in s-mode with shared kernel
+ * page table. It is scheduled like usual process.
+ */
+proc_t *kthread_create(void (*func)(void *arg), void *arg)
+{
+	int irqflags;
+	extern pte_t kpagetable[PTE_MAX];
+	proc_t *proc;
+	pid_t pid;
+
+	proc = proc_slot_alloc();
+	if (!proc) {
+		return NULL;
+	}
+
+	pid = pid_alloc();
+	if (!pid) {
+		proc_destroy(proc);
+		return NULL;
+	}
+	proc->pid = pid;
+
+	proc->context = kmalloc(sizeof(context_t));
+	if (!proc->context) {
+		proc_destroy(proc);
+		return NULL;
+	}
+
+	proc->kstack = kpage_alloc(KSTACKNPAGES);
+	if (!proc->kstack) {
+		proc_destroy(proc);
+		return NULL;
+	}
+
+	proc->kthread_func = func;
+	proc->kthread_arg = arg;
+
+	proc->context->sp = (u64) proc->kstack + KSTACKNPAGES * PAGESZ;
+	proc->context->ra = (u64) kthread_entry;
+	proc->context->kpagetable = (u64) kpagetable;
+
+	spinlock_acquire_irqsave(&proc->lock, irqflags);
+	sched_wakeup(proc);
+	spinlock_release_irqrestore(&proc->lock, irqflags);
+
+	return proc;
+}
+
+/* nobody waits for kernel threads, so they are reaped by worker */
+void kthread_exit(void)
+{
+	proc_destroy_deferred(curproc());
+	sched_zombie();
+}
@@ -0,0 +1,51 @@
+#include <kernel/rcu.h>
+#include <kernel/sched.h>
+
+/* harts which report quiescent states, others are never waited for */
+static volatile u64 rcu_online_harts = 0;
+
+void rcu_hart_init(void)
+{
+	u64 old;
+	curcpu()->rcu_qs = 0;
+	do {
+		old = rcu_online_harts;
+	} while (!atomic_compare_and_swap(&rcu_online_harts, old,
+				old | (1ull << cpuid())));
+}
+
+/* Wait until every hart went through quiescent state, after that
+ * no reader can hold pointer unpublished before the call.
+ * Must not be called from rcu read side critical section.
+ */
+void synchronize_rcu(void)
+{
+	u64 snap[NCPU];
+	u64 online;
+
+	/* unpublish must be visible before we sample counters */
+	atomic_membar();
+
+	online = rcu_online_harts;
+	for (size_t i = 0; i < NCPU; i++) {
+		if (online & (1ull << i)) {
+			snap[i] = *(volatile u64 *) &per_cpu_ptr(&cpus, i)->rcu_qs;
+		}
+	}
+
+	for (size_t i = 0; i < NCPU; i++) {
+		if (!(online & (1ull << i))) {
+			continue;
+		}
+		/* hart running us is not in read side critical section */
+		while (*(volatile u64 *) &per_cpu_ptr(&cpus, i)->rcu_qs == snap[i] &&
+				i != cpuid()) {
+			if (curproc()) {
+				sched();
+			}
+		}
+	}
+
+	/* readers are done before we free anything */
+	atomic_membar();
+}
@@ -2,56 +2,203 @@
 #include <kernel/irq.h>
 #include <kernel/proc.h>
 #include <kernel/spinlock.h>
+#include <kernel/rcu.h>
+#include <kernel/ipi.h>
+#include <kernel/wchan.h>
 
-void scheduler(void)
+/* runnable processes in fifo order, linked by proc->runq_list,
+ * every hart takes runq_lock, so keep it on its own cache line
+ */
+static spinlock_t runq_lock __cacheline_aligned;
+static list_t runq;
+
+/* harts waiting in idle loop, kicked by wakeups */
+static volatile u64 sched_idle_harts = 0;
+
+void sched_init(void)
 {
-	extern proc_t proctable[NPROC];
-	irq_on();
-	while (1) {
-		for (size_t i = 0; i < NPROC; i++) {
-			spinlock_acquire_irq(&proctable[i].lock);
-			if (proctable[i].state == PROC_STATE_RUNNABLE) {
-				curcpu()->proc = &proctable[i];
+	spinlock_init(&runq_lock);
+	list_init(&runq);
+}
+
+static void sched_enqueue(proc_t *proc)
+{
+	int irqflags;
+	proc->state = PROC_STATE_RUNNABLE;
 
-				context_switch(curcpu()->context, curproc()->context);
+	spinlock_acquire_irqsave(&runq_lock, irqflags);
+	list_add_tail(&proc->runq_list, &runq);
+	spinlock_release_irqrestore(&runq_lock, irqflags);
+}
 
-				curcpu()->proc = NULL;
-			}
-			spinlock_release_irq(&proctable[i].lock);
-		}
+/* Kick one idle hart, so it picks up process we just queued.
+ * Returns false if there was no idle hart to kick.
+ */
+static bool sched_kick_idle(void)
+{
+	u64 idle;
+
+	/* pairs with barrier in sched_idle */
+	atomic_membar();
+	idle = sched_idle_harts & ~(1ull << cpuid());
+	if (!idle) {
+		return false;
+	}
+	ipi_resched(__builtin_ctzll(idle));
+	return true;
+}
+
+/* make process runnable and queue it, proc lock should be held */
+void sched_wakeup(proc_t *proc)
+{
+	sched_enqueue(proc);
+
+	/* idle hart runs woken process, otherwise we give it ours
+	 * on next irq return
+	 */
+	if (!sched_kick_idle()) {
+		curcpu()->need_resched = true;
+	}
+}
+
+static proc_t *sched_dequeue(void)
+{
+	int irqflags;
+	proc_t *proc = NULL;
+
+	spinlock_acquire_irqsave(&runq_lock, irqflags);
+	if (!list_empty(&runq)) {
+		proc = list_entry(runq.next, proc_t, runq_list);
+		list_del(&proc->runq_list);
+	}
+	spinlock_release_irqrestore(&runq_lock, irqflags);
+
+	return proc;
+}
+
+/* release lock of process we switched from, it was
+ * acquired before context_switch on maybe another hart
+ */
+void sched_finish(void)
+{
+	cpu_t *cpu = curcpu();
+	rcu_quiescent();
+	if (cpu->prev) {
+		spinlock_release(&cpu->prev->lock);
+		cpu->prev = NULL;
 	}
 }
 
-void context_switch_prepare(context_t *old, context_t *new)
+/* Switch from prev to next directly, idle context of this hart
+ * is used if next is NULL. prev lock should be held.
+ */
+static void sched_switch_to(proc_t *prev, proc_t *next)
+{
+	cpu_t *cpu = curcpu();
+	context_t *context = cpu->context;
+
+	if (next) {
+		/* released by next after switch */
+		spinlock_acquire(&next->lock);
+		context = next->context;
+	}
+
+	cpu->proc = next;
+	cpu->prev = prev;
+
+	context_switch(prev->context, context);
+
+	sched_finish();
+}
+
+/* Give hart to the next runnable process, current process lock
+ * should be held and its state changed from running.
+ */
+void sched_switch(void)
 {
-	/* we will enter s-mode and interrupts will be disabled */
-	w_sstatus((r_sstatus() & ~SSTATUS_SPIE) | SSTATUS_SPP);
+	sched_switch_to(curproc(), sched_dequeue());
+}
 
-	/* we will return after context_switch call */
-	w_sepc(new->ra);
+/* Wait for interrupt with interrupts disabled, wfi returns on
+ * pending one anyway and it is taken after irq_on. So ipi sent
+ * after we marked ourselves idle is never lost.
+ */
+static void sched_idle(void)
+{
+	u64 self = 1ull << cpuid();
 
-	/* set new kernel pagetable */
-	sfence_vma();
-	w_satp(PA_TO_PN(new->kpagetable) | SATP_MODE_SV39);
-	sfence_vma();
+	atomic_fetch_or64(&sched_idle_harts, self);
+	atomic_membar();
+	if (list_empty(&runq)) {
+		/* timer tick wakes us up at least every NCYCLE */
+		wfi();
+	}
+	atomic_fetch_and64(&sched_idle_harts, ~self);
+}
+
+void scheduler(void)
+{
+	proc_t *proc;
+	cpu_t *cpu = curcpu();
+	while (1) {
+		irq_off();
+		rcu_quiescent();
+		proc = sched_dequeue();
+		if (!proc) {
+			sched_idle();
+			irq_on();
+			continue;
+		}
+
+		spinlock_acquire(&proc->lock);
+		cpu->proc = proc;
+		cpu->prev = NULL;
+		cpu->need_resched = false;
+
+		context_switch(cpu->context, proc->context);
+
+		/* some process switched to idle */
+		sched_finish();
+		irq_on();
+	}
 }
 
 void sched(void)
 {
 	int irqflags;
+	proc_t *next;
 	spinlock_acquire_irqsave(&curproc()->lock, irqflags);
-	curproc()->state = PROC_STATE_RUNNABLE;
+	curcpu()->need_resched = false;
 
-	context_switch(curproc()->context, curcpu()->context);
+	/* dequeue before enqueue, so we never pick ourselves */
+	next = sched_dequeue();
+	if (next) {
+		sched_enqueue(curproc());
+		sched_switch_to(curproc(), next);
+		curproc()->state = PROC_STATE_RUNNING;
+	}
 
-	curproc()->state = PROC_STATE_RUNNING;	
 	spinlock_release_irqrestore(&curproc()->lock, irqflags);
 }
 
+/* Called on irq return with interrupts disabled. Interrupted
+ * code is preempted if it holds no spinlocks.
+ */
+void sched_preempt(void)
+{
+	if (curcpu()->need_resched && !curcpu()->preempt_count && curproc()) {
+		sched();
+	}
+}
+
+/* Whoever waits for us sleeps on proc. It takes proc lock to see
+ * zombie state, so it runs only after we switched away.
+ */
 void sched_zombie(void)
 {
 	spinlock_acquire_irq(&curproc()->lock);
 	curproc()->state = PROC_STATE_ZOMBIE;
-	context_switch(curproc()->context, curcpu()->context);
+	wchan_broadcast(curproc());
+	sched_switch();
 }
 
@@ -0,0 +1,78 @@
+#include <kernel/softirq.h>
+#include <kernel/irq.h>
+#include <kernel/preempt.h>
+#include <kernel/percpu.h>
+#include <kernel/timer.h>
+
+/* Bottom halves of device interrupts. Top half acks device and
+ * raises softirq, which runs on irq exit with interrupts enabled.
+ * Handlers must not sleep, they run in context of interrupted
+ * process with preemption disabled.
+ */
+static void (*softirq_handlers[SOFTIRQ_MAX])(void);
+
+static DEFINE_PER_CPU(u64, softirq_pending);
+static DEFINE_PER_CPU(bool, softirq_active);
+
+void softirq_register(u32 nr, void (*handler)(void))
+{
+	softirq_handlers[nr] = handler;
+}
+
+/* mark softirq pending on this hart, usually from top half */
+void softirq_raise(u32 nr)
+{
+	bool irqflags = irq_enabled();
+	irq_off();
+	*this_cpu_ptr(&softirq_pending) |= 1ull << nr;
+	if (irqflags) {
+		irq_on();
+	}
+}
+
+/* Called on irq exit with interrupts disabled. Interrupts nested
+ * into handlers only raise more softirqs, they are picked up by
+ * the loop here.
+ */
+void softirq_run(void)
+{
+	u64 pending, start, time;
+	irqstat_t *stat;
+
+	if (*this_cpu_ptr(&softirq_active) ||
+			!*this_cpu_ptr(&softirq_pending)) {
+		return;
+	}
+
+	/* we must stay on this hart until active is cleared */
+	preempt_disable();
+	*this_cpu_ptr(&softirq_active) = true;
+	start = ktimer_now();
+
+	for (size_t round = 0; round < SOFTIRQ_RESTART_MAX; round++) {
+		pending = *this_cpu_ptr(&softirq_pending);
+		if (!pending) {
+			break;
+		}
+		*this_cpu_ptr(&softirq_pending) = 0;
+
+		irq_on();
+		for (u32 nr = 0; nr < SOFTIRQ_MAX; nr++) {
+			if (pending & (1ull << nr)) {
+				softirq_handlers[nr]();
+			}
+		}
+		irq_off();
+	}
+
+	time = ktimer_now() - start;
+	stat = this_cpu_ptr(&irqstat);
+	stat->softirqs++;
+	stat->softirq_total += time;
+	if (time > stat->softirq_max) {
+		stat->softirq_max = time;
+	}
+
+	*this_cpu_ptr(&softirq_active) = false;
+	preempt_enable();
+}
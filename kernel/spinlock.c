@@ -1,21 +1,167 @@
 #include <kernel/spinlock.h>
 #include <kernel/riscv64.h>
 #include <kernel/irq.h>
+#include <kernel/preempt.h>
 
+#if LOCKSTAT
+void __spinlock_init(spinlock_t *sl, const char *name)
+#else
 void spinlock_init(spinlock_t *sl)
+#endif
 {
-	sl->lock = 0;
+	sl->next = 0;
+	sl->owner = 0;
+#if LOCKSTAT
+	sl->class = lockstat_class_get(name, LOCKSTAT_SPINLOCK);
+#endif
 }
 
 void spinlock_acquire(spinlock_t *sl)
 {
-	while (atomic_test_and_set(&sl->lock, 1));
+	u32 ticket;
+#if LOCKSTAT
+	u64 start = r_time();
+	bool contended;
+#endif
+	preempt_disable();
+	ticket = atomic_fetch_add32(&sl->next, 1);
+#if LOCKSTAT
+	contended = sl->owner != ticket;
+#endif
+
+	/* spin with loads only, so waiters do not bounce the cache line */
+	while (sl->owner != ticket);
 	atomic_acquire_membar();
+#if LOCKSTAT
+	lockstat_acquired(sl->class, start, contended,
+			__builtin_return_address(0));
+	sl->acquired_site = __builtin_return_address(0);
+	sl->acquired_at = r_time();
+#endif
 }
 
 void spinlock_release(spinlock_t *sl)
 {
+#if LOCKSTAT
+	lockstat_released(sl->class, sl->acquired_at, sl->acquired_site);
+#endif
 	atomic_release_membar();
-	atomic_set(&sl->lock, 0);
+	/* only holder writes owner */
+	sl->owner++;
+	preempt_enable();
+}
+
+
+/* inner lock is named after rwlock, not after its field */
+#if LOCKSTAT
+void __rwlock_init(rwlock_t *rw, const char *name)
+{
+	__spinlock_init(&rw->wlock, name);
+	rw->class = lockstat_class_get(name, LOCKSTAT_RWLOCK);
+	rw->cnt = 0;
+}
+#else
+void rwlock_init(rwlock_t *rw)
+{
+	spinlock_init(&rw->wlock);
+	rw->cnt = 0;
+}
+#endif
+
+void rwlock_acquire_read(rwlock_t *rw)
+{
+#if LOCKSTAT
+	u64 start = r_time();
+	bool contended = false;
+#endif
+	preempt_disable();
+	while (1) {
+		/* spin with loads only while writer holds or waits */
+#if LOCKSTAT
+		contended |= (rw->cnt & RWLOCK_WRITER) != 0;
+#endif
+		while (rw->cnt & RWLOCK_WRITER);
+		if (!(atomic_fetch_add32(&rw->cnt, 1) & RWLOCK_WRITER)) {
+			break;
+		}
+		/* writer came first */
+		atomic_fetch_add32(&rw->cnt, -1);
+#if LOCKSTAT
+		contended = true;
+#endif
+	}
+	atomic_acquire_membar();
+#if LOCKSTAT
+	/* readers share lock, so only their wait is accounted */
+	lockstat_acquired(rw->class, start, contended,
+			__builtin_return_address(0));
+#endif
 }
 
+void rwlock_release_read(rwlock_t *rw)
+{
+	atomic_release_membar();
+	atomic_fetch_add32(&rw->cnt, -1);
+	preempt_enable();
+}
+
+void rwlock_acquire_write(rwlock_t *rw)
+{
+	spinlock_acquire(&rw->wlock);
+	atomic_fetch_add32(&rw->cnt, RWLOCK_WRITER);
+
+	/* wait for readers to drain */
+	while (rw->cnt != RWLOCK_WRITER);
+	atomic_acquire_membar();
+}
+
+void rwlock_release_write(rwlock_t *rw)
+{
+	atomic_release_membar();
+	atomic_fetch_add32(&rw->cnt, -RWLOCK_WRITER);
+	spinlock_release(&rw->wlock);
+}
+
+#if LOCKSTAT
+void __seqlock_init(seqlock_t *sq, const char *name)
+{
+	__spinlock_init(&sq->lock, name);
+	sq->seq = 0;
+}
+#else
+void seqlock_init(seqlock_t *sq)
+{
+	spinlock_init(&sq->lock);
+	sq->seq = 0;
+}
+#endif
+
+void seqlock_write_begin(seqlock_t *sq)
+{
+	spinlock_acquire(&sq->lock);
+	/* odd seq tells readers that write is in progress */
+	sq->seq++;
+	atomic_membar();
+}
+
+void seqlock_write_end(seqlock_t *sq)
+{
+	atomic_membar();
+	sq->seq++;
+	spinlock_release(&sq->lock);
+}
+
+u32 seqlock_read_begin(seqlock_t *sq)
+{
+	u32 seq;
+	while ((seq = sq->seq) & 1);
+	atomic_acquire_membar();
+	return seq;
+}
+
+/* returns true if data read after seqlock_read_begin may be torn */
+bool seqlock_read_retry(seqlock_t *sq, u32 seq)
+{
+	atomic_membar();
+	return sq->seq != seq;
+}
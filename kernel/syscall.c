@@ -80,6 +80,18 @@ void syscall(void)
 		ret = sys_sleep((void *) tf->a0, (void *) tf->a1);
 		break;
 
+#ifdef SYS_clock_gettime
+	case SYS_clock_gettime:
+		ret = sys_clock_gettime(tf->a0, (void *) tf->a1);
+		break;
+#endif
+
+#ifdef SYS_clock_nanosleep
+	case SYS_clock_nanosleep:
+		ret = sys_clock_nanosleep(tf->a0, tf->a1, (void *) tf->a2, (void *) tf->a3);
+		break;
+#endif
+
 	case SYS_fork:
 		ret = sys_fork();
 		break;
@@ -195,6 +207,12 @@ void syscall(void)
 		ret = sys_fdatasync(tf->a0);
 		break;
 
+#ifdef SYS_ioctl
+	case SYS_ioctl:
+		ret = sys_ioctl(tf->a0, tf->a1, (void *) tf->a2);
+		break;
+#endif
+
 	default:
 		kprintf_s("unknown syscall %u\n", sysnum);
 	}
@@ -55,7 +55,7 @@ ssize_t sys_read(int fd, void *buf, size_t count)
 
 	case S_IFIFO:
 		if (curproc()->filetable[fd].ondisk) {
-			spinlock_acquire_irqsave(&fifodescs_lock, irqflags);
+			rwlock_acquire_write_irqsave(&fifodescs_lock, irqflags);
 			roffset = curproc()->filetable[fd].fifodesc->roffset;
 			woffset = curproc()->filetable[fd].fifodesc->woffset;
 			pipebuf = curproc()->filetable[fd].fifodesc->pipebuf;
@@ -76,7 +76,7 @@ ssize_t sys_read(int fd, void *buf, size_t count)
 			if (copy_to_user(buf, pipebuf + roffset,
 						upperbound - roffset)) {
 				if (curproc()->filetable[fd].ondisk) {
-					spinlock_release_irqrestore(&fifodescs_lock,
+					rwlock_release_write_irqrestore(&fifodescs_lock,
 							irqflags);
 				}
 				return -EFAULT;
@@ -84,7 +84,7 @@ ssize_t sys_read(int fd, void *buf, size_t count)
 			if (copy_to_user(buf + upperbound - roffset, pipebuf,
 						count - upperbound + roffset)) {
 				if (curproc()->filetable[fd].ondisk) {
-					spinlock_release_irqrestore(&fifodescs_lock,
+					rwlock_release_write_irqrestore(&fifodescs_lock,
 							irqflags);
 				}
 				return -EFAULT;
@@ -92,7 +92,7 @@ ssize_t sys_read(int fd, void *buf, size_t count)
 		} else {
 			if (copy_to_user(buf, pipebuf + roffset, count)) {
 				if (curproc()->filetable[fd].ondisk) {
-					spinlock_release_irqrestore(&fifodescs_lock,
+					rwlock_release_write_irqrestore(&fifodescs_lock,
 							irqflags);
 				}
 				return -EFAULT;
@@ -102,7 +102,7 @@ ssize_t sys_read(int fd, void *buf, size_t count)
 		if (curproc()->filetable[fd].ondisk) {
 			curproc()->filetable[fd].fifodesc->roffset =
 				(roffset + count) % upperbound;
-			spinlock_release_irqrestore(&fifodescs_lock, irqflags);
+			rwlock_release_write_irqrestore(&fifodescs_lock, irqflags);
 		} else {
 			*curproc()->filetable[fd].roffset =
 				(roffset + count) % upperbound;
@@ -164,7 +164,7 @@ ssize_t sys_write(int fd, const void *buf, size_t count)
 
 	case S_IFIFO:
 		if (curproc()->filetable[fd].ondisk) {
-			spinlock_acquire_irqsave(&fifodescs_lock, irqflags);
+			rwlock_acquire_write_irqsave(&fifodescs_lock, irqflags);
 			roffset = curproc()->filetable[fd].fifodesc->roffset;
 			woffset = curproc()->filetable[fd].fifodesc->woffset;
 			pipebuf = curproc()->filetable[fd].fifodesc->pipebuf;
@@ -185,7 +185,7 @@ ssize_t sys_write(int fd, const void *buf, size_t count)
 			if (copy_from_user(pipebuf + woffset, buf,
 						upperbound - woffset)) {
 				if (curproc()->filetable[fd].ondisk) {
-					spinlock_release_irqrestore(&fifodescs_lock,
+					rwlock_release_write_irqrestore(&fifodescs_lock,
 							irqflags);
 				}
 				return -EFAULT;
@@ -193,7 +193,7 @@ ssize_t sys_write(int fd, const void *buf, size_t count)
 			if (copy_from_user(pipebuf, buf + upperbound - woffset,
 						count - upperbound + woffset)) {
 				if (curproc()->filetable[fd].ondisk) {
-					spinlock_release_irqrestore(&fifodescs_lock,
+					rwlock_release_write_irqrestore(&fifodescs_lock,
 							irqflags);
 				}
 				return -EFAULT;
@@ -201,7 +201,7 @@ ssize_t sys_write(int fd, const void *buf, size_t count)
 		} else {
 			if (copy_from_user(pipebuf + woffset, buf, count)) {
 				if (curproc()->filetable[fd].ondisk) {
-					spinlock_release_irqrestore(&fifodescs_lock,
+					rwlock_release_write_irqrestore(&fifodescs_lock,
 							irqflags);
 				}
 				return -EFAULT;
@@ -211,7 +211,7 @@ ssize_t sys_write(int fd, const void *buf, size_t count)
 		if (curproc()->filetable[fd].ondisk) {
 			curproc()->filetable[fd].fifodesc->woffset =
 				(woffset + count) % upperbound;
-			spinlock_release_irqrestore(&fifodescs_lock, irqflags);
+			rwlock_release_write_irqrestore(&fifodescs_lock, irqflags);
 		} else {
 			*curproc()->filetable[fd].woffset =
 				(woffset + count) % upperbound;
@@ -310,7 +310,7 @@ int sys_close(int fd)
 			kfree(curproc()->filetable[fd].woffset);
 			kpage_free(curproc()->filetable[fd].pipebuf);
 		}
-		spinlock_acquire_irqsave(&opened_inodes_lock, irqflags);
+		rwlock_acquire_write_irqsave(&opened_inodes_lock, irqflags);
 		curproc()->filetable[fd].opened_inode->refcnt--;
 		if (!curproc()->filetable[fd].opened_inode->refcnt) {
 			deletemark = curproc()->filetable[fd].opened_inode->deletemark;
@@ -318,7 +318,7 @@ int sys_close(int fd)
 					opened_inodes_list);
 			kfree(curproc()->filetable[fd].opened_inode);
 		}
-		spinlock_release_irqrestore(&opened_inodes_lock, irqflags);
+		rwlock_release_write_irqrestore(&opened_inodes_lock, irqflags);
 	}
 	
 	if (deletemark) {
@@ -330,11 +330,11 @@ int sys_close(int fd)
 		}
 		if (curproc()->filetable[fd].ftype == S_IFIFO &&
 				curproc()->filetable[fd].ondisk) {
-			spinlock_acquire_irqsave(&fifodescs_lock, irqflags);
+			rwlock_acquire_write_irqsave(&fifodescs_lock, irqflags);
 			list_del(&curproc()->filetable[fd].fifodesc->fifodescs_list);
 			kpage_free(curproc()->filetable[fd].fifodesc->pipebuf);
 			kfree(curproc()->filetable[fd].fifodesc);
-			spinlock_release_irqrestore(&fifodescs_lock, irqflags);
+			rwlock_release_write_irqrestore(&fifodescs_lock, irqflags);
 		}
 	}
 
@@ -626,23 +626,22 @@ int sys_unlinkat(int dirfd, const char *path, int flags)
 		return err;
 	}
 
-	spinlock_acquire_irqsave(&opened_inodes_lock, irqflags);
+	rwlock_acquire_write_irqsave(&opened_inodes_lock, irqflags);
 	opened_inode.inum = inum;
 	opened_inode_ptr = sorted_list_search(&opened_inode, &opened_inodes,
 			opened_inodes_list, opened_inodes_cmp);
 	if (opened_inode_ptr) {
 		opened_inode_ptr->deletemark = true;
-		spinlock_release_irqrestore(&opened_inodes_lock, irqflags);
+		rwlock_release_write_irqrestore(&opened_inodes_lock, irqflags);
 		err = ext2_unlink_direntry_delete(rootblkdev, pathbuf, relinum);
 		if (err) {
-			spinlock_release_irqrestore(&opened_inodes_lock, irqflags);
 			mutex_unlock(&rootblkdev->lock);
 			return err;
 		}
 	} else {
-		spinlock_release_irqrestore(&opened_inodes_lock, irqflags);
+		rwlock_release_write_irqrestore(&opened_inodes_lock, irqflags);
 
-		spinlock_acquire_irqsave(&fifodescs_lock, irqflags);
+		rwlock_acquire_write_irqsave(&fifodescs_lock, irqflags);
 		fifodesc.inum = inum;
 		fifodesc_ptr = sorted_list_search(&fifodesc, &fifodescs,
 				fifodescs_list, fifodescs_cmp);
@@ -651,7 +650,7 @@ int sys_unlinkat(int dirfd, const char *path, int flags)
 			kpage_free(fifodesc_ptr->pipebuf);
 			kfree(fifodesc_ptr);	
 		}
-		spinlock_release_irqrestore(&fifodescs_lock, irqflags);
+		rwlock_release_write_irqrestore(&fifodescs_lock, irqflags);
 
 		ext2_unlink_direntry_delete(rootblkdev, pathbuf, relinum);
 		if (err) {
@@ -819,87 +818,111 @@ int sys_openat(int dirfd, const char *path, int flags, mode_t mode)
 		return -ENOMEM;
 	}
 
-	spinlock_acquire_irqsave(&opened_inodes_lock, irqflags);
+	/* inode is usually opened already, so search under read lock */
+	rwlock_acquire_read_irqsave(&opened_inodes_lock, irqflags);
 	opened_inode.inum = inum;
 	curproc()->filetable[fd].opened_inode = sorted_list_search(
 			&opened_inode, &opened_inodes,
 			opened_inodes_list, opened_inodes_cmp);
+	if (curproc()->filetable[fd].opened_inode) {
+		/* other readers may increment refcnt too */
+		atomic_fetch_add32((volatile u32 *)
+				&curproc()->filetable[fd].opened_inode->refcnt, 1);
+	}
+	rwlock_release_read_irqrestore(&opened_inodes_lock, irqflags);
+
 	if (!curproc()->filetable[fd].opened_inode) {
-		curproc()->filetable[fd].opened_inode = kmalloc(sizeof(opened_inode));
+		rwlock_acquire_write_irqsave(&opened_inodes_lock, irqflags);
+		opened_inode.inum = inum;
+		curproc()->filetable[fd].opened_inode = sorted_list_search(
+				&opened_inode, &opened_inodes,
+				opened_inodes_list, opened_inodes_cmp);
 		if (!curproc()->filetable[fd].opened_inode) {
-			spinlock_release_irqrestore(&opened_inodes_lock, irqflags);
-			mutex_unlock(&rootblkdev->lock);
-			kfree(curproc()->filetable[fd].refcnt);
-			kfree(curproc()->filetable[fd].status_flags);
-			kfree(curproc()->filetable[fd].roffset);
-			return -ENOMEM;
-		}
+			curproc()->filetable[fd].opened_inode = kmalloc(sizeof(opened_inode));
+			if (!curproc()->filetable[fd].opened_inode) {
+				rwlock_release_write_irqrestore(&opened_inodes_lock, irqflags);
+				mutex_unlock(&rootblkdev->lock);
+				kfree(curproc()->filetable[fd].refcnt);
+				kfree(curproc()->filetable[fd].status_flags);
+				kfree(curproc()->filetable[fd].roffset);
+				return -ENOMEM;
+			}
 
-		curproc()->filetable[fd].opened_inode->inum = inum;
-		curproc()->filetable[fd].opened_inode->deletemark = false;
-		curproc()->filetable[fd].opened_inode->refcnt = 1;
+			curproc()->filetable[fd].opened_inode->inum = inum;
+			curproc()->filetable[fd].opened_inode->deletemark = false;
+			curproc()->filetable[fd].opened_inode->refcnt = 1;
 
-		list_add(&curproc()->filetable[fd].opened_inode->opened_inodes_list,
-				&opened_inodes.opened_inodes_list);
-	} else {
-		curproc()->filetable[fd].opened_inode->refcnt++;
+			list_add(&curproc()->filetable[fd].opened_inode->opened_inodes_list,
+					&opened_inodes.opened_inodes_list);
+		} else {
+			curproc()->filetable[fd].opened_inode->refcnt++;
+		}
+		rwlock_release_write_irqrestore(&opened_inodes_lock, irqflags);
 	}
-	spinlock_release_irqrestore(&opened_inodes_lock, irqflags);
 
 	if ((st.st_mode & S_IFMT) == S_IFIFO) {
-		spinlock_acquire_irqsave(&fifodescs_lock, irqflags);
+		rwlock_acquire_read_irqsave(&fifodescs_lock, irqflags);
 		fifodesc.inum = inum;
 		curproc()->filetable[fd].fifodesc = sorted_list_search(
 				&fifodesc, &fifodescs,
 				fifodescs_list, fifodescs_cmp);
+		rwlock_release_read_irqrestore(&fifodescs_lock, irqflags);
+
 		if (!curproc()->filetable[fd].fifodesc) {
-			curproc()->filetable[fd].fifodesc = kmalloc(sizeof(fifodesc));
+			rwlock_acquire_write_irqsave(&fifodescs_lock, irqflags);
+			fifodesc.inum = inum;
+			curproc()->filetable[fd].fifodesc = sorted_list_search(
+					&fifodesc, &fifodescs,
+					fifodescs_list, fifodescs_cmp);
 			if (!curproc()->filetable[fd].fifodesc) {
-				spinlock_release_irqrestore(&fifodescs_lock, irqflags);
-				mutex_unlock(&rootblkdev->lock);
-				kfree(curproc()->filetable[fd].refcnt);
-				kfree(curproc()->filetable[fd].status_flags);
-				kfree(curproc()->filetable[fd].roffset);
-				spinlock_acquire_irqsave(&opened_inodes_lock, irqflags);
-				curproc()->filetable[fd].opened_inode->refcnt--;
-				if (!curproc()->filetable[fd].opened_inode->refcnt) {
-					list_del(&curproc()->filetable[fd].opened_inode->
-							opened_inodes_list);
-					kfree(curproc()->filetable[fd].opened_inode);
+				curproc()->filetable[fd].fifodesc = kmalloc(sizeof(fifodesc));
+				if (!curproc()->filetable[fd].fifodesc) {
+					rwlock_release_write_irqrestore(&fifodescs_lock, irqflags);
+					mutex_unlock(&rootblkdev->lock);
+					kfree(curproc()->filetable[fd].refcnt);
+					kfree(curproc()->filetable[fd].status_flags);
+					kfree(curproc()->filetable[fd].roffset);
+					rwlock_acquire_write_irqsave(&opened_inodes_lock, irqflags);
+					curproc()->filetable[fd].opened_inode->refcnt--;
+					if (!curproc()->filetable[fd].opened_inode->refcnt) {
+						list_del(&curproc()->filetable[fd].opened_inode->
+								opened_inodes_list);
+						kfree(curproc()->filetable[fd].opened_inode);
+					}
+					rwlock_release_write_irqrestore(&opened_inodes_lock,
+							irqflags);
+					return -ENOMEM;
 				}
-				spinlock_release_irqrestore(&opened_inodes_lock,
-						irqflags);
-				return -ENOMEM;
-			}
 
-			curproc()->filetable[fd].fifodesc->inum = inum;
-			curproc()->filetable[fd].fifodesc->roffset = 0;
-			curproc()->filetable[fd].fifodesc->woffset = 0;
-			curproc()->filetable[fd].fifodesc->pipebuf =
-				kpage_alloc(PIPEBUF_NPAGES);
-			if (!curproc()->filetable[fd].fifodesc->pipebuf) {
-				spinlock_release_irqrestore(&fifodescs_lock, irqflags);
-				mutex_unlock(&rootblkdev->lock);
-				kfree(curproc()->filetable[fd].refcnt);
-				kfree(curproc()->filetable[fd].status_flags);
-				kfree(curproc()->filetable[fd].roffset);
-				kfree(curproc()->filetable[fd].fifodesc);
-				spinlock_acquire_irqsave(&opened_inodes_lock, irqflags);
-				curproc()->filetable[fd].opened_inode->refcnt--;
-				if (!curproc()->filetable[fd].opened_inode->refcnt) {
-					list_del(&curproc()->filetable[fd].opened_inode->
-							opened_inodes_list);
-					kfree(curproc()->filetable[fd].opened_inode);
+				curproc()->filetable[fd].fifodesc->inum = inum;
+				curproc()->filetable[fd].fifodesc->roffset = 0;
+				curproc()->filetable[fd].fifodesc->woffset = 0;
+				curproc()->filetable[fd].fifodesc->pipebuf =
+					kpage_alloc(PIPEBUF_NPAGES);
+				if (!curproc()->filetable[fd].fifodesc->pipebuf) {
+					rwlock_release_write_irqrestore(&fifodescs_lock, irqflags);
+					mutex_unlock(&rootblkdev->lock);
+					kfree(curproc()->filetable[fd].refcnt);
+					kfree(curproc()->filetable[fd].status_flags);
+					kfree(curproc()->filetable[fd].roffset);
+					kfree(curproc()->filetable[fd].fifodesc);
+					rwlock_acquire_write_irqsave(&opened_inodes_lock, irqflags);
+					curproc()->filetable[fd].opened_inode->refcnt--;
+					if (!curproc()->filetable[fd].opened_inode->refcnt) {
+						list_del(&curproc()->filetable[fd].opened_inode->
+								opened_inodes_list);
+						kfree(curproc()->filetable[fd].opened_inode);
+					}
+					rwlock_release_write_irqrestore(&opened_inodes_lock,
+							irqflags);
+					return -ENOMEM;
 				}
-				spinlock_release_irqrestore(&opened_inodes_lock,
-						irqflags);
-				return -ENOMEM;
-			}
 
-			list_add(&curproc()->filetable[fd].fifodesc->fifodescs_list,
-					&fifodescs.fifodescs_list);
+				list_add(&curproc()->filetable[fd].fifodesc->fifodescs_list,
+						&fifodescs.fifodescs_list);
+			}
+			rwlock_release_write_irqrestore(&fifodescs_lock, irqflags);
 		}
-		spinlock_release_irqrestore(&fifodescs_lock, irqflags);
 	}
 
 	if (flags & O_TRUNC) {
@@ -908,14 +931,14 @@ int sys_openat(int dirfd, const char *path, int flags, mode_t mode)
 			kfree(curproc()->filetable[fd].refcnt);
 			kfree(curproc()->filetable[fd].status_flags);
 			kfree(curproc()->filetable[fd].roffset);
-			spinlock_acquire_irqsave(&opened_inodes_lock, irqflags);
+			rwlock_acquire_write_irqsave(&opened_inodes_lock, irqflags);
 			curproc()->filetable[fd].opened_inode->refcnt--;
 			if (!curproc()->filetable[fd].opened_inode->refcnt) {
 				list_del(&curproc()->filetable[fd].opened_inode->
 						opened_inodes_list);
 				kfree(curproc()->filetable[fd].opened_inode);
 			}
-			spinlock_release_irqrestore(&opened_inodes_lock, irqflags);
+			rwlock_release_write_irqrestore(&opened_inodes_lock, irqflags);
 			return -EBADFD;
 		}
 
@@ -925,14 +948,14 @@ int sys_openat(int dirfd, const char *path, int flags, mode_t mode)
 			kfree(curproc()->filetable[fd].refcnt);
 			kfree(curproc()->filetable[fd].status_flags);
 			kfree(curproc()->filetable[fd].roffset);
-			spinlock_acquire_irqsave(&opened_inodes_lock, irqflags);
+			rwlock_acquire_write_irqsave(&opened_inodes_lock, irqflags);
 			curproc()->filetable[fd].opened_inode->refcnt--;
 			if (!curproc()->filetable[fd].opened_inode->refcnt) {
 				list_del(&curproc()->filetable[fd].opened_inode->
 						opened_inodes_list);
 				kfree(curproc()->filetable[fd].opened_inode);
 			}
-			spinlock_release_irqrestore(&opened_inodes_lock, irqflags);
+			rwlock_release_write_irqrestore(&opened_inodes_lock, irqflags);
 			return err;
 		}
 	}
@@ -1469,6 +1492,13 @@ int sys_fsync(int fd)
 		return block_device_driver_fsync(&curproc()->filetable[fd]);
 	}
 
+	switch (curproc()->filetable[fd].ftype) {
+	case S_IFREG:
+	case S_IFDIR:
+		/* ext2_fsync waits for writes in progress */
+		return ext2_fsync(rootblkdev, curproc()->filetable[fd].inum, false);
+	}
+
 	return 0;
 }
 
@@ -1484,6 +1514,29 @@ int sys_fdatasync(int fd)
 		return block_device_driver_fdatasync(&curproc()->filetable[fd]);
 	}
 
+	switch (curproc()->filetable[fd].ftype) {
+	case S_IFREG:
+	case S_IFDIR:
+		/* ext2_fsync waits for writes in progress */
+		return ext2_fsync(rootblkdev, curproc()->filetable[fd].inum, true);
+	}
+
 	return 0;
 }
 
+int sys_ioctl(int fd, unsigned long request, void *arg)
+{
+	if (fd < 0 || fd >= FD_MAX || !curproc()->filetable[fd].alloc) {
+		return -EBADFD;
+	}
+
+	if (curproc()->filetable[fd].ftype == S_IFCHR) {
+		return character_device_driver_ioctl(&curproc()->filetable[fd],
+				request, arg);
+	} else if (curproc()->filetable[fd].ftype == S_IFBLK) {
+		return block_device_driver_ioctl(&curproc()->filetable[fd],
+				request, arg);
+	}
+
+	return -ENOTTY;
+}
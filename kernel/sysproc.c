@@ -2,6 +2,8 @@
 #include <kernel/sched.h>
 #include <kernel/klib.h>
 #include <kernel/errno.h>
+#include <kernel/timer.h>
+#include <kernel/wchan.h>
 
 void sys_exit(int status)
 {
@@ -11,11 +13,12 @@ void sys_exit(int status)
 
 pid_t sys_getpid(void)
 {
-	int irqflags;
 	pid_t pid;
-	spinlock_acquire_irqsave(&curproc()->lock, irqflags);
-	pid = curproc()->pid;
-	spinlock_release_irqrestore(&curproc()->lock, irqflags);
+	u32 seq;
+	do {
+		seq = seqlock_read_begin(&curproc()->idlock);
+		pid = curproc()->pid;
+	} while (seqlock_read_retry(&curproc()->idlock, seq));
 	return pid;
 }
 
@@ -25,12 +28,86 @@ pid_t sys_getppid(void)
 	return 0;
 }
 
+/* larger seconds do not fit into u64 nanoseconds */
+#define TIMESPEC_SEC_MAX (((u64) -1 - NSEC_PER_SEC) / NSEC_PER_SEC)
+
+static int timespec_from_user(const struct timespec *uts, u64 *ticks)
+{
+	struct timespec ts;
+	u64 sec;
+	if (copy_from_user(&ts, uts, sizeof(ts))) {
+		return -EFAULT;
+	}
+	if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= NSEC_PER_SEC) {
+		return -EINVAL;
+	}
+	/* clamped time is centuries away, sleep is as good as forever */
+	sec = min((u64) ts.tv_sec, TIMESPEC_SEC_MAX);
+	*ticks = KTIMER_NS_TO_TICKS(sec * NSEC_PER_SEC + ts.tv_nsec);
+	return 0;
+}
+
 int sys_sleep(const struct timespec *req, struct timespec *rem)
 {
-	/* not implemented */
+	int err;
+	u64 ticks;
+
+	err = timespec_from_user(req, &ticks);
+	if (err) {
+		return err;
+	}
+
+	/* zero timeout just gives cpu to another process */
+	if (!ticks) {
+		sched();
+		return 0;
+	}
+
+	/* signals are not implemented, so rem is never updated */
+	return ktimer_sleep_until(ktimer_expires_in(ticks));
+}
+
+int sys_clock_gettime(int clock_id, struct timespec *tp)
+{
+	struct timespec ts;
+	u64 ns;
+
+	/* there is no rtc driver, so realtime clock starts at boot */
+	if (clock_id != CLOCK_MONOTONIC && clock_id != CLOCK_REALTIME) {
+		return -EINVAL;
+	}
+
+	ns = KTIMER_TICKS_TO_NS(ktimer_now());
+	ts.tv_sec = ns / NSEC_PER_SEC;
+	ts.tv_nsec = ns % NSEC_PER_SEC;
+
+	if (copy_to_user(tp, &ts, sizeof(ts))) {
+		return -EFAULT;
+	}
 	return 0;
 }
 
+int sys_clock_nanosleep(int clock_id, int flags,
+		const struct timespec *req, struct timespec *rem)
+{
+	int err;
+	u64 ticks;
+
+	if (clock_id != CLOCK_MONOTONIC && clock_id != CLOCK_REALTIME) {
+		return -EINVAL;
+	}
+
+	err = timespec_from_user(req, &ticks);
+	if (err) {
+		return err;
+	}
+
+	if (flags & TIMER_ABSTIME) {
+		return ktimer_sleep_until(ticks);
+	}
+	return ktimer_sleep_until(ktimer_expires_in(ticks));
+}
+
 pid_t sys_fork(void)
 {
 	/* not implemented */
@@ -64,13 +141,9 @@ pid_t sys_wait4(pid_t pid, int *status, int options, struct rusage *rusage)
 
 	spinlock_acquire_irqsave(&child->lock, irqflags);	
 
-	/* wait for zombie child */
+	/* sleep until child exits, sched_zombie wakes us */
 	while (child->state != PROC_STATE_ZOMBIE) {
-		spinlock_release_irqrestore(&child->lock, irqflags);
-
-		sched();
-
-		spinlock_acquire_irqsave(&child->lock, irqflags);	
+		wchan_sleep(child, &child->lock);
 	}
 
 	/* copy exit status to user memory */
@@ -82,10 +155,12 @@ pid_t sys_wait4(pid_t pid, int *status, int options, struct rusage *rusage)
 	/* save child pid before proc_destroy */
 	ret = child->pid;
 
-	proc_destroy(child);
-
+	/* reaped, so nobody else waits for it */
+	child->state = PROC_STATE_REAPED;
 	spinlock_release_irqrestore(&child->lock, irqflags);
 
+	proc_destroy_deferred(child);
+
 	return ret;
 
 }
@@ -251,14 +326,13 @@ pid_t sys_getsid(pid_t pid)
 pid_t sys_setsid(void)
 {
 	int irqflags, ret;
-	pid_t sid;
-	spinlock_acquire_irqsave(&curproc()->lock, irqflags);
+	seqlock_write_begin_irqsave(&curproc()->idlock, irqflags);
 	if (curproc()->pid == curproc()->sid) {
 		ret = -1;
 	} else {
 		ret = curproc()->sid = curproc()->pid;
 	}
-	spinlock_release_irqrestore(&curproc()->lock, irqflags);
+	seqlock_write_end_irqrestore(&curproc()->idlock, irqflags);
 	return ret;
 }
 
@@ -0,0 +1,208 @@
+#include <kernel/timer.h>
+#include <kernel/clint-sifive.h>
+#include <kernel/wchan.h>
+#include <kernel/errno.h>
+#include <kernel/irq.h>
+#include <kernel/spinlock.h>
+#include <kernel/percpu.h>
+
+typedef struct ktimer_queue ktimer_queue_t;
+
+/* Armed timers are sleep timers of processes, one per process. If
+ * heap of one hart holds them all, ktimer_add of curproc()->timer
+ * never fails and sleep never returns -EAGAIN.
+ */
+#if KTIMER_QUEUE_SIZE < NPROC
+#error "KTIMER_QUEUE_SIZE must not be less than NPROC"
+#endif
+
+/* per-hart min-heap of armed timers ordered by expires */
+struct ktimer_queue {
+	spinlock_t lock;
+	ktimer_t *running;
+	size_t n;
+	ktimer_t *heap[KTIMER_QUEUE_SIZE];
+};
+
+static DEFINE_PER_CPU(ktimer_queue_t, ktimer_queues);
+
+void ktimer_init(void)
+{
+	ktimer_queue_t *queue;
+	for (size_t i = 0; i < NCPU; i++) {
+		queue = per_cpu_ptr(&ktimer_queues, i);
+		spinlock_init(&queue->lock);
+		queue->running = NULL;
+		queue->n = 0;
+	}
+}
+
+static void ktimer_heap_swap(ktimer_queue_t *queue, size_t i, size_t j)
+{
+	ktimer_t *tmp = queue->heap[i];
+	queue->heap[i] = queue->heap[j];
+	queue->heap[j] = tmp;
+	queue->heap[i]->heapidx = i;
+	queue->heap[j]->heapidx = j;
+}
+
+static void ktimer_heap_up(ktimer_queue_t *queue, size_t i)
+{
+	while (i && queue->heap[(i - 1) / 2]->expires > queue->heap[i]->expires) {
+		ktimer_heap_swap(queue, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void ktimer_heap_down(ktimer_queue_t *queue, size_t i)
+{
+	while (1) {
+		size_t left = 2 * i + 1, right = 2 * i + 2, smallest = i;
+		if (left < queue->n &&
+				queue->heap[left]->expires < queue->heap[smallest]->expires) {
+			smallest = left;
+		}
+		if (right < queue->n &&
+				queue->heap[right]->expires < queue->heap[smallest]->expires) {
+			smallest = right;
+		}
+		if (smallest == i) {
+			break;
+		}
+		ktimer_heap_swap(queue, i, smallest);
+		i = smallest;
+	}
+}
+
+static void ktimer_heap_remove(ktimer_queue_t *queue, ktimer_t *timer)
+{
+	size_t i = timer->heapidx;
+	queue->n--;
+	if (i != queue->n) {
+		queue->heap[i] = queue->heap[queue->n];
+		queue->heap[i]->heapidx = i;
+		ktimer_heap_down(queue, i);
+		ktimer_heap_up(queue, i);
+	}
+	timer->heapidx = KTIMER_IDLE;
+}
+
+void ktimer_setup(ktimer_t *timer, void (*func)(void *arg), void *arg)
+{
+	timer->expires = 0;
+	timer->func = func;
+	timer->arg = arg;
+	timer->cpu = 0;
+	timer->heapidx = KTIMER_IDLE;
+}
+
+/* Arm timer on current hart. Queue full is only possible for
+ * timers other than process ones, see KTIMER_QUEUE_SIZE check.
+ */
+int ktimer_add(ktimer_t *timer, u64 expires)
+{
+	int irqflags;
+	ktimer_queue_t *queue;
+
+	irqflags = irq_enabled();
+	irq_off();
+
+	queue = this_cpu_ptr(&ktimer_queues);
+	spinlock_acquire(&queue->lock);
+
+	if (timer->heapidx != KTIMER_IDLE) {
+		spinlock_release_irqrestore(&queue->lock, irqflags);
+		return -EBUSY;
+	}
+	if (queue->n == KTIMER_QUEUE_SIZE) {
+		spinlock_release_irqrestore(&queue->lock, irqflags);
+		return -EAGAIN;
+	}
+
+	timer->expires = expires;
+	timer->cpu = cpuid();
+	timer->heapidx = queue->n;
+	queue->heap[queue->n] = timer;
+	queue->n++;
+	ktimer_heap_up(queue, timer->heapidx);
+
+	/* new timer is the nearest one, so move hart deadline */
+	if (!timer->heapidx) {
+		clint_timer_program(expires);
+	}
+
+	spinlock_release_irqrestore(&queue->lock, irqflags);
+	return 0;
+}
+
+/* Returns true if timer was armed.
+ * If timer callback is running on another hart we will wait
+ * for it, so timer memory can be reused after return.
+ * Do not hold locks taken by timer callback.
+ */
+bool ktimer_cancel(ktimer_t *timer)
+{
+	int irqflags;
+	ktimer_queue_t *queue;
+
+	while (1) {
+		queue = per_cpu_ptr(&ktimer_queues, timer->cpu);
+		spinlock_acquire_irqsave(&queue->lock, irqflags);
+		if (timer->heapidx != KTIMER_IDLE) {
+			ktimer_heap_remove(queue, timer);
+			spinlock_release_irqrestore(&queue->lock, irqflags);
+			return true;
+		}
+		if (queue->running != timer) {
+			spinlock_release_irqrestore(&queue->lock, irqflags);
+			return false;
+		}
+		spinlock_release_irqrestore(&queue->lock, irqflags);
+	}
+}
+
+/* sleep without any wakeup source except timer */
+int ktimer_sleep_until(u64 expires)
+{
+	int irqflags, err;
+	spinlock_t sl;
+
+	spinlock_init(&sl);
+	spinlock_acquire_irqsave(&sl, irqflags);
+	err = wchan_sleep_timeout(&curproc()->timer, &sl, expires);
+	spinlock_release_irqrestore(&sl, irqflags);
+
+	if (err == -ETIMEDOUT) {
+		return 0;
+	}
+	return err;
+}
+
+/* Run expired timers of current hart and program next deadline.
+ * Timer callbacks are called with interrupts off and without queue lock.
+ */
+void ktimer_irq_handler(void)
+{
+	ktimer_queue_t *queue = this_cpu_ptr(&ktimer_queues);
+	ktimer_t *timer;
+	u64 deadline = -1;
+
+	spinlock_acquire(&queue->lock);
+	while (queue->n && queue->heap[0]->expires <= ktimer_now()) {
+		timer = queue->heap[0];
+		ktimer_heap_remove(queue, timer);
+		queue->running = timer;
+		spinlock_release(&queue->lock);
+
+		timer->func(timer->arg);
+
+		spinlock_acquire(&queue->lock);
+		queue->running = NULL;
+	}
+	if (queue->n) {
+		deadline = queue->heap[0]->expires;
+	}
+	spinlock_release(&queue->lock);
+
+	clint_timer_program(deadline);
+}
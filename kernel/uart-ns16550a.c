@@ -4,7 +4,8 @@
 #include <kernel/spinlock.h>
 #include <kernel/kprintf.h>
 #include <kernel/plic-sifive.h>
-#include <kernel/sched.h>
+#include <kernel/wchan.h>
+#include <kernel/softirq.h>
 
 /* uart tx ring buffer */
 static spinlock_t uart_tx_lock;
@@ -18,12 +19,15 @@ static volatile char uart_rx_ring[UART_RX_RING_SIZE];
 static volatile size_t uart_rx_r = 0;
 static volatile size_t uart_rx_w = 0;
 
+static void uart_softirq(void);
+
 void uart_init(void)
 {
 	uart_mmio_t *base = (uart_mmio_t *) VIRT_UART0;
 
 	spinlock_init(&uart_tx_lock);
 	spinlock_init(&uart_rx_lock);
+	softirq_register(SOFTIRQ_UART, uart_softirq);
 
 	/* set DLAB bit in LCR to set baudrate divisor */
 	base->lcr = UART_LCR_DLAB;
@@ -109,9 +113,8 @@ char uart_getch_async(void)
 	char ch;
 	spinlock_acquire_irqsave(&uart_rx_lock, irqflags);
 	while (uart_rx_r == uart_rx_w) {
-		spinlock_release_irqrestore(&uart_rx_lock, irqflags);
-		sched();
-		spinlock_acquire_irqsave(&uart_rx_lock, irqflags);
+		/* woken up by uart_irq_handler */
+		wchan_sleep((void *) uart_rx_ring, &uart_rx_lock);
 	}
 	ch = uart_rx_ring[uart_rx_r];
 	uart_rx_r = (uart_rx_r + 1) % UART_RX_RING_SIZE;
@@ -146,6 +149,15 @@ char uart_getch_sync(void)
 	return ch;
 }
 
+/* Readers check ring under uart_rx_lock before they sleep, so
+ * wakeup without the lock is not lost.
+ */
+static void uart_softirq(void)
+{
+	wchan_broadcast((void *) uart_rx_ring);
+}
+
+/* top half, drains rx fifo and refills tx fifo to ack device */
 void uart_irq_handler(void)
 {
 	int irqflags;
@@ -165,6 +177,9 @@ void uart_irq_handler(void)
 			uart_rx_w = (uart_rx_w + 1) % UART_RX_RING_SIZE;
 		}
 		spinlock_release_irqrestore(&uart_rx_lock, irqflags);
+
+		/* readers are woken up in bottom half */
+		softirq_raise(SOFTIRQ_UART);
 		break;
 
 	case UART_ISR_TBE_INTERRUPT:
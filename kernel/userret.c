@@ -1,6 +1,7 @@
 #include <kernel/riscv64.h>
 #include <kernel/trampoline.h>
 #include <kernel/proc.h>
+#include <kernel/sched.h>
 
 /* to enter process first time we must jump into userret */
 void userret(void)
@@ -8,11 +9,12 @@ void userret(void)
 	/* set proc state to running */
 	curproc()->state = PROC_STATE_RUNNING;
 
-	/* release lock acquired in scheduler */
+	/* release locks acquired by whoever switched to us */
+	sched_finish();
 	spinlock_release(&curproc()->lock);
 
-	/* save cpuid */
-	curproc()->trapframe->cpuid = cpuid();
+	/* trampoline restores tp on next trap */
+	curproc()->trapframe->percpu = r_tp();
 
 	/* we will enter u-mode and interrupts will be enabled */
 	w_sstatus((r_sstatus() & ~SSTATUS_SPP) | SSTATUS_SPIE);
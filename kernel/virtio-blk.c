@@ -6,21 +6,81 @@
 #include <kernel/plic-sifive.h>
 #include <kernel/sched.h>
 #include <kernel/wchan.h>
+#include <kernel/softirq.h>
+#include <kernel/irq.h>
+#include <kernel/percpu.h>
+#include <kernel/atomic.h>
+#include <kernel/timer.h>
+#include <kernel/preempt.h>
 
 virtio_blk_t virtio_blk_list[VIRTIO_MAX];
 
+/* written where device can not zero sectors itself */
+static const u8 virtio_blk_zeroes[VIRTIO_BLK_ZEROES_SIZE];
+
+/* devices with completions to be walked by bottom half */
+static DEFINE_PER_CPU(u64, virtio_blk_pending);
+
+static void virtio_blk_softirq(void);
+static void virtio_blk_complete_queue(virtio_blk_t *dev,
+		virtio_blk_queue_t *queue);
+
 void virtio_blk_init(void)
 {
 	for (size_t i = 0; i < VIRTIO_MAX; i++) {
 		virtio_blk_list[i].isvalid = false;
-		spinlock_init(&virtio_blk_list[i].lock);
 	}
+	softirq_register(SOFTIRQ_BLK, virtio_blk_softirq);
+}
+
+/* buffer id state and indirect tables of one queue */
+static int virtio_blk_queue_init(virtio_blk_t *dev, virtio_blk_queue_t *queue)
+{
+	virtq_t *virtq = &queue->virtq;
+	int err;
+
+	/* requests in flight and their headers by buffer id,
+	 * so submission does not allocate
+	 */
+	queue->inflight = kmalloc(sizeof(*queue->inflight) * virtq->virtqsz);
+	queue->reqs = kmalloc(sizeof(*queue->reqs) * virtq->virtqsz);
+	if (!queue->inflight || !queue->reqs) {
+		kfree(queue->inflight);
+		kfree(queue->reqs);
+		return -ENOMEM;
+	}
+	bzero(queue->inflight, sizeof(*queue->inflight) * virtq->virtqsz);
+	bzero(queue->reqs, sizeof(*queue->reqs) * virtq->virtqsz);
+
+	/* with indirect tables whole request takes one ring slot,
+	 * without them we stay with direct chains
+	 */
+	if (dev->features & (1ull << VIRTIO_F_RING_INDIRECT_DESC)) {
+		err = virtq_indirect_init(virtq,
+				min(virtq->virtqsz, VIRTIO_BLK_INDIRECT_MAX),
+				dev->seg_max + 2);
+		if (err) {
+			kprintf_s("virtio_blk_dev_init: no indirect tables (%d)\n",
+					err);
+		}
+	}
+
+	/* used_event starts zeroed, first completion interrupts */
+	queue->dev = dev;
+	queue->npolling = 0;
+	queue->ninflight = 0;
+	queue->notifies = 0;
+	queue->bytes = 0;
+	spinlock_init(&queue->lock);
+
+	return 0;
 }
 
 void virtio_blk_dev_init(size_t devnum)
 {
 	int err;
 	virtio_blk_t *dev = &virtio_blk_list[devnum];
+	u32 virtqsz = -1;
 
 	/* set mmio base */
 	dev->base = (virtio_blk_mmio_t *) VIRTIO_MMIO_BASE(devnum);
@@ -28,11 +88,18 @@ void virtio_blk_dev_init(size_t devnum)
 	/* set the driver status bit */
 	dev->base->virtio_mmio.status |= VIRTIO_STATUS_DRIVER;
 
-	/* read device features */
-	dev->features = dev->base->virtio_mmio.device_features;
-
-	/* select no features */
+	/* read device features, ring ones are above bit 31 */
+	dev->base->virtio_mmio.device_features_sel = 1;
+	dev->features = (u64) dev->base->virtio_mmio.device_features << 32;
 	dev->base->virtio_mmio.device_features_sel = 0;
+	dev->features |= dev->base->virtio_mmio.device_features;
+	dev->features &= VIRTIO_BLK_DRIVER_FEATURES;
+
+	/* select supported features */
+	dev->base->virtio_mmio.driver_features_sel = 0;
+	dev->base->virtio_mmio.driver_features = dev->features;
+	dev->base->virtio_mmio.driver_features_sel = 1;
+	dev->base->virtio_mmio.driver_features = dev->features >> 32;
 
 	/* set the features_ok status bit */
 	dev->base->virtio_mmio.status |= VIRTIO_STATUS_FEATURES_OK;
@@ -44,18 +111,93 @@ void virtio_blk_dev_init(size_t devnum)
 		return;
 	}
 
-	/* init requestq */
-	err = virtq_init(&dev->base->virtio_mmio, &dev->requestq,
-			VIRTIO_BLK_REQUESTQ);
-	if (err) {
+	/* one request queue per hart if device has enough of them */
+	dev->nqueues = 1;
+	if (dev->features & (1ull << VIRTIO_BLK_F_MQ)) {
+		dev->nqueues = max(min(dev->base->num_queues, NCPU), 1);
+	}
+	dev->queues = kmalloc(sizeof(*dev->queues) * dev->nqueues);
+	if (!dev->queues) {
 		dev->base->virtio_mmio.status |= VIRTIO_STATUS_FAILED;
-		kprintf_s("virtio_blk_dev_init: queue init failed (%d)\n", err);
+		kprintf_s("virtio_blk_dev_init: no memory\n");
 		return;
 	}
 
+	/* init request queues */
+	for (u32 i = 0; i < dev->nqueues; i++) {
+		dev->queues[i].queue_sel = VIRTIO_BLK_REQUESTQ + i;
+		err = virtq_init(&dev->base->virtio_mmio, &dev->queues[i].virtq,
+				dev->queues[i].queue_sel, dev->features);
+		if (err) {
+			dev->base->virtio_mmio.status |= VIRTIO_STATUS_FAILED;
+			kprintf_s("virtio_blk_dev_init: queue init failed (%d)\n",
+					err);
+			return;
+		}
+		virtqsz = min(virtqsz, dev->queues[i].virtq.virtqsz);
+	}
+
 	/* read number of blocks */
 	dev->capacity = dev->base->capacity;
 
+	/* limits of data descriptors in one request */
+	dev->seg_max = min(VIRTIO_BLK_SEG_MAX, virtqsz - 2);
+	if (dev->features & (1ull << VIRTIO_BLK_F_SEG_MAX) && dev->base->seg_max) {
+		dev->seg_max = min(dev->seg_max, dev->base->seg_max);
+	}
+	dev->size_max = VIRTIO_BLK_SIZE_MAX;
+	if (dev->features & (1ull << VIRTIO_BLK_F_SIZE_MAX)) {
+		dev->size_max = min(dev->size_max, dev->base->size_max);
+	}
+	dev->size_max = max(dev->size_max & ~(VIRTIO_BLK_SECTOR_SIZE - 1),
+			VIRTIO_BLK_SECTOR_SIZE);
+
+	/* Discarded ranges are shrunk to alignment, so pieces split
+	 * by max_discard_sectors have to stay aligned too.
+	 */
+	dev->max_discard_sectors = 0;
+	dev->max_discard_seg = 0;
+	dev->discard_alignment = 1;
+	if (dev->features & (1ull << VIRTIO_BLK_F_DISCARD)) {
+		dev->discard_alignment =
+			max(dev->base->discard_sector_alignment, 1);
+		dev->max_discard_sectors = dev->base->max_discard_sectors /
+			dev->discard_alignment * dev->discard_alignment;
+		dev->max_discard_seg = min(dev->base->max_discard_seg,
+				dev->size_max / sizeof(virtio_blk_range_t));
+	}
+	dev->max_write_zeroes_sectors = 0;
+	if (dev->features & (1ull << VIRTIO_BLK_F_WRITE_ZEROES)) {
+		dev->max_write_zeroes_sectors =
+			dev->base->max_write_zeroes_sectors;
+	}
+
+	for (u32 i = 0; i < dev->nqueues; i++) {
+		err = virtio_blk_queue_init(dev, &dev->queues[i]);
+		if (err) {
+			dev->base->virtio_mmio.status |= VIRTIO_STATUS_FAILED;
+			kprintf_s("virtio_blk_dev_init: no memory\n");
+			return;
+		}
+	}
+
+	dev->coalesce = max(VIRTIO_BLK_COALESCE, 1);
+	dev->poll = VIRTIO_BLK_POLL;
+
+	/* Without flush feature device does not cache writes. With
+	 * config_wce it tells whether cache is write back right now.
+	 */
+	dev->writeback = dev->features & (1ull << VIRTIO_BLK_F_FLUSH);
+	if (dev->features & (1ull << VIRTIO_BLK_F_CONFIG_WCE)) {
+		dev->writeback = dev->writeback && dev->base->writeback;
+	}
+	spinlock_init(&dev->flush_lock);
+	dev->flush_started = 0;
+	dev->flush_done = 0;
+	dev->flushing = false;
+	dev->flush_err = 0;
+	dev->interrupts = 0;
+
 	/* set the driver_ok status bit */
 	dev->base->virtio_mmio.status |= VIRTIO_STATUS_DRIVER_OK;
 
@@ -63,361 +205,725 @@ void virtio_blk_dev_init(size_t devnum)
 	dev->isvalid = true;
 }
 
-int virtio_blk_read(size_t devnum, u64 sector, void *data)
+/* descriptors taken by segment with size_max split */
+static size_t virtio_blk_seg_ndescs(virtio_blk_t *dev, const virtio_blk_seg_t *seg)
 {
-	int irqflags;
-	u8 status;
-	virtio_blk_t *dev = &virtio_blk_list[devnum];
-	virtio_blk_req_t *req;
-	u16 desc0, desc1, desc2;
+	return (seg->len + dev->size_max - 1) / dev->size_max;
+}
 
-	spinlock_acquire_irqsave(&dev->lock, irqflags);
+void virtio_blk_bio_init(virtio_blk_bio_t *bio, u32 type, u64 sector,
+		const virtio_blk_seg_t *segs, size_t nsegs)
+{
+	bio->type = type;
+	bio->sector = sector;
+	bio->segs = segs;
+	bio->nsegs = nsegs;
+	bio->end_io = NULL;
+	bio->private = NULL;
+	bio->poll = false;
+	bio->status = 0;
+	bio->done = false;
+	bio->queue = NULL;
+}
 
-	if (sector >= dev->capacity) {
-		spinlock_release_irqrestore(&dev->lock, irqflags);
+/* Put bio into ring as one descriptor chain, header and status
+ * take two descriptors around data ones. Ring format and indirect
+ * tables are handled by virtq, header comes from per-queue array.
+ * Queue of current hart is used, if we migrate before taking its
+ * lock we just share queue of another hart.
+ */
+static int __virtio_blk_submit(virtio_blk_t *dev, virtio_blk_bio_t *bio,
+		bool nosleep)
+{
+	int irqflags;
+	virtio_blk_queue_t *queue = &dev->queues[cpuid() % dev->nqueues];
+	virtq_t *virtq = &queue->virtq;
+	virtq_chain_t chain;
+	virtio_blk_req_t *req;
+	size_t ndescs = 0, nbytes = 0;
+	u16 flags;
+	u8 *addr;
+	u32 left, len;
+	/* ranges are checked by caller, they are not sector data */
+	bool ranges = bio->type == VIRTIO_BLK_T_DISCARD ||
+		bio->type == VIRTIO_BLK_T_WRITE_ZEROES;
+
+	for (size_t i = 0; i < bio->nsegs; i++) {
+		if (!ranges && bio->segs[i].len % VIRTIO_BLK_SECTOR_SIZE) {
+			return -EINVAL;
+		}
+		ndescs += virtio_blk_seg_ndescs(dev, &bio->segs[i]);
+		nbytes += bio->segs[i].len;
+	}
+	if (ndescs > dev->seg_max) {
+		return -EINVAL;
+	}
+	if (!ranges &&
+			bio->sector + nbytes / VIRTIO_BLK_SECTOR_SIZE > dev->capacity) {
 		return -EIO;
 	}
 
-	req = kmalloc(sizeof(*req));
-	if (!req) {
-		spinlock_release_irqrestore(&dev->lock, irqflags);
-		return -ENOMEM;
-	}
+	bio->queue = queue;
+	bio->done = false;
+	bio->status = 0;
 
-	req->type = VIRTIO_BLK_T_IN;
-	req->sector = sector;
+	spinlock_acquire_irqsave(&queue->lock, irqflags);
 
-	/* header descriptor */
-	desc0 = virtq_desc_alloc_nofail(&dev->requestq, &dev->lock);
-	dev->requestq.desc[desc0].addr = (u64) req;
-	dev->requestq.desc[desc0].len = VIRTIO_BLK_REQ_HEAD_SIZE;
-	dev->requestq.desc[desc0].flags = VIRTQ_DESC_F_NEXT;
+	/* take whole chain at once, partial chains could exhaust ring */
+	while (virtq_chain_begin(virtq, &chain, ndescs + 2)) {
+		if (nosleep) {
+			spinlock_release_irqrestore(&queue->lock, irqflags);
+			return -EBUSY;
+		}
+		wchan_sleep(virtq, &queue->lock);
+	}
 
-	/* data descriptor */
-	desc1 = virtq_desc_alloc_nofail(&dev->requestq, &dev->lock);
-	dev->requestq.desc[desc1].addr = (u64) data;
-	dev->requestq.desc[desc1].len = VIRTIO_BLK_REQ_DATA_SIZE;
-	dev->requestq.desc[desc1].flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE;
+	/* header descriptor */
+	req = &queue->reqs[chain.id];
+	req->type = bio->type;
+	req->sector = bio->sector;
+	req->status = VIRTIO_BLK_S_IOERR;
+	virtq_chain_add(virtq, &chain, req, VIRTIO_BLK_REQ_HEAD_SIZE, 0);
+
+	/* data descriptors, device writes into them on read */
+	flags = bio->type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0;
+	for (size_t i = 0; i < bio->nsegs; i++) {
+		addr = bio->segs[i].addr;
+		left = bio->segs[i].len;
+		while (left) {
+			len = min(left, dev->size_max);
+			virtq_chain_add(virtq, &chain, addr, len, flags);
+			addr += len;
+			left -= len;
+		}
+	}
 
 	/* tail descriptor */
-	desc2 = virtq_desc_alloc_nofail(&dev->requestq, &dev->lock);
-	dev->requestq.desc[desc2].addr = (u64) &req->status;
-	dev->requestq.desc[desc2].len = VIRTIO_BLK_REQ_TAIL_SIZE;
-	dev->requestq.desc[desc2].flags = VIRTQ_DESC_F_WRITE;
+	virtq_chain_add(virtq, &chain, &req->status, VIRTIO_BLK_REQ_TAIL_SIZE,
+			VIRTQ_DESC_F_WRITE);
 
-	/* link all descriptors */
-	dev->requestq.desc[desc0].next = desc1;
-	dev->requestq.desc[desc1].next = desc2;
-	dev->requestq.desc[desc2].next = 0;
+	/* completion finds bio by buffer id */
+	queue->inflight[chain.id] = bio;
+	queue->ninflight++;
+	queue->bytes += nbytes;
 
-	/* add request to avail ring and increment idx */
-	dev->requestq.avail->ring[
-		dev->requestq.avail->idx % dev->requestq.virtqsz] = desc0;
-	dev->requestq.avail->idx++;
+	virtq_chain_end(virtq, &chain);
 
-	/* notify device */
-	dev->base->virtio_mmio.queue_notify = VIRTIO_BLK_REQUESTQ;
+	/* kick only if device asked for it */
+	if (virtq_need_kick(virtq)) {
+		dev->base->virtio_mmio.queue_notify = queue->queue_sel;
+		queue->notifies++;
+	}
 
-	/* wait for block op */
-	wchan_sleep(req, &dev->lock);
+	spinlock_release_irqrestore(&queue->lock, irqflags);
 
-	/* save request status */
-	status = req->status;
+	return 0;
+}
+
+/* Submit bio without waiting for it. It may sleep until ring has
+ * room for its descriptors. On completion end_io is called from
+ * softirq if set, otherwise virtio_blk_wait returns.
+ */
+int virtio_blk_submit(size_t devnum, virtio_blk_bio_t *bio)
+{
+	return __virtio_blk_submit(&virtio_blk_list[devnum], bio, false);
+}
 
-	virtq_desc_free_nofail(&dev->requestq, desc0);
-	virtq_desc_free_nofail(&dev->requestq, desc1);
-	virtq_desc_free_nofail(&dev->requestq, desc2);
+/* Spin on used ring of bio queue for at most poll time with queue
+ * interrupts off, it saves interrupt, wakeup and reschedule for
+ * requests which complete fast. Other bios of queue are completed
+ * by us meanwhile.
+ */
+static void virtio_blk_poll(virtio_blk_bio_t *bio)
+{
+	int irqflags;
+	virtio_blk_queue_t *queue = bio->queue;
+	virtio_blk_t *dev = queue->dev;
+	u64 deadline = ktimer_now() + KTIMER_NS_TO_TICKS(VIRTIO_BLK_POLL_NS);
 
-	kfree(req);
+	spinlock_acquire_irqsave(&queue->lock, irqflags);
+	if (!queue->npolling++) {
+		virtq_interrupt_disable(&queue->virtq);
+	}
+	spinlock_release_irqrestore(&queue->lock, irqflags);
 
-	spinlock_release_irqrestore(&dev->lock, irqflags);
+	do {
+		virtio_blk_complete_queue(dev, queue);
+	} while (!*(volatile bool *) &bio->done && ktimer_now() < deadline);
 
-	if (status != VIRTIO_BLK_S_OK) {
-		return -EIO;
+	spinlock_acquire_irqsave(&queue->lock, irqflags);
+	if (!--queue->npolling) {
+		virtq_interrupt_enable(&queue->virtq);
 	}
+	spinlock_release_irqrestore(&queue->lock, irqflags);
 
-	return 0;
+	/* buffers used while interrupts were off did not interrupt */
+	virtio_blk_complete_queue(dev, queue);
 }
 
-int virtio_blk_write(size_t devnum, u64 sector, void *data)
+static int __virtio_blk_wait(virtio_blk_bio_t *bio, bool nosleep)
 {
 	int irqflags;
-	u8 status;
-	virtio_blk_t *dev = &virtio_blk_list[devnum];
-	virtio_blk_req_t *req;
-	u16 desc0, desc1, desc2;
-
-	spinlock_acquire_irqsave(&dev->lock, irqflags);
+	virtio_blk_queue_t *queue = bio->queue;
 
-	if (sector >= dev->capacity) {
-		spinlock_release_irqrestore(&dev->lock, irqflags);
-		return -EIO;
+	if (bio->poll || queue->dev->poll) {
+		virtio_blk_poll(bio);
 	}
 
-	req = kmalloc(sizeof(*req));
-	if (!req) {
-		spinlock_release_irqrestore(&dev->lock, irqflags);
-		return -ENOMEM;
+	spinlock_acquire_irqsave(&queue->lock, irqflags);
+	while (!bio->done) {
+		if (nosleep) {
+			/* wfi returns on interrupt, bottom half completes bio */
+			spinlock_release_irq(&queue->lock);
+
+			wfi();
+
+			spinlock_acquire_irq(&queue->lock);
+		} else {
+			/* woken up by virtio_blk_complete */
+			wchan_sleep(bio, &queue->lock);
+		}
 	}
+	spinlock_release_irqrestore(&queue->lock, irqflags);
 
-	req->type = VIRTIO_BLK_T_OUT;
-	req->sector = sector;
+	return bio->status;
+}
 
-	/* header descriptor */
-	desc0 = virtq_desc_alloc_nofail(&dev->requestq, &dev->lock);
-	dev->requestq.desc[desc0].addr = (u64) req;
-	dev->requestq.desc[desc0].len = VIRTIO_BLK_REQ_HEAD_SIZE;
-	dev->requestq.desc[desc0].flags = VIRTQ_DESC_F_NEXT;
+/* Sleep until bio without end_io completes, returns its status.
+ * Bio with poll set, or any bio of polling device, is polled for
+ * first.
+ */
+int virtio_blk_wait(virtio_blk_bio_t *bio)
+{
+	return __virtio_blk_wait(bio, false);
+}
+
+/* Transfer segments with as few bios as seg_max allows. All bios
+ * are submitted before we wait, so they are in flight together.
+ */
+static int virtio_blk_rw(size_t devnum, u32 type, u64 sector,
+		const virtio_blk_seg_t *segs, size_t nsegs, bool nosleep)
+{
+	int err = 0, ret;
+	virtio_blk_t *dev = &virtio_blk_list[devnum];
+	virtio_blk_bio_t onebio, *bios = &onebio;
+	virtio_blk_seg_t *pieces;
+	size_t npieces = 0, nbios, nsubmitted = 0, n, j = 0;
+	u32 len;
 
-	/* data descriptor */
-	desc1 = virtq_desc_alloc_nofail(&dev->requestq, &dev->lock);
-	dev->requestq.desc[desc1].addr = (u64) data;
-	dev->requestq.desc[desc1].len = VIRTIO_BLK_REQ_DATA_SIZE;
-	dev->requestq.desc[desc1].flags = VIRTQ_DESC_F_NEXT;
+	for (size_t i = 0; i < nsegs; i++) {
+		npieces += virtio_blk_seg_ndescs(dev, &segs[i]);
+	}
+	nbios = (npieces + dev->seg_max - 1) / dev->seg_max;
+
+	if (nbios <= 1) {
+		virtio_blk_bio_init(&onebio, type, sector, segs, nsegs);
+		err = __virtio_blk_submit(dev, &onebio, nosleep);
+		if (err) {
+			return err;
+		}
+		return __virtio_blk_wait(&onebio, nosleep);
+	}
 
-	/* tail descriptor */
-	desc2 = virtq_desc_alloc_nofail(&dev->requestq, &dev->lock);
-	dev->requestq.desc[desc2].addr = (u64) &req->status;
-	dev->requestq.desc[desc2].len = VIRTIO_BLK_REQ_TAIL_SIZE;
-	dev->requestq.desc[desc2].flags = VIRTQ_DESC_F_WRITE;
+	/* split segments into descriptor sized pieces */
+	bios = kmalloc(sizeof(*bios) * nbios + sizeof(*pieces) * npieces);
+	if (!bios) {
+		return -ENOMEM;
+	}
+	pieces = (virtio_blk_seg_t *) (bios + nbios);
+	for (size_t i = 0; i < nsegs; i++) {
+		for (u32 off = 0; off < segs[i].len; off += len) {
+			len = min(segs[i].len - off, dev->size_max);
+			pieces[j].addr = (u8 *) segs[i].addr + off;
+			pieces[j++].len = len;
+		}
+	}
 
-	/* link all descriptors */
-	dev->requestq.desc[desc0].next = desc1;
-	dev->requestq.desc[desc1].next = desc2;
-	dev->requestq.desc[desc2].next = 0;
+	for (size_t i = 0; i < nbios; i++) {
+		n = min(dev->seg_max, npieces - i * dev->seg_max);
+		virtio_blk_bio_init(&bios[i], type, sector,
+				pieces + i * dev->seg_max, n);
+		for (j = 0; j < n; j++) {
+			sector += bios[i].segs[j].len / VIRTIO_BLK_SECTOR_SIZE;
+		}
+
+		err = __virtio_blk_submit(dev, &bios[i], nosleep);
+		if (err) {
+			break;
+		}
+		nsubmitted++;
+
+		/* we can not sleep for room in ring, so go one by one */
+		if (nosleep) {
+			__virtio_blk_wait(&bios[i], nosleep);
+		}
+	}
 
-	/* add request to avail ring and increment idx */
-	dev->requestq.avail->ring[
-		dev->requestq.avail->idx % dev->requestq.virtqsz] = desc0;
-	dev->requestq.avail->idx++;
+	/* memory is freed only when every submitted bio is done */
+	for (size_t i = 0; i < nsubmitted; i++) {
+		ret = __virtio_blk_wait(&bios[i], nosleep);
+		if (ret && !err) {
+			err = ret;
+		}
+	}
 
-	/* notify device */
-	dev->base->virtio_mmio.queue_notify = VIRTIO_BLK_REQUESTQ;
+	kfree(bios);
 
-	/* wait for block op */
-	wchan_sleep(req, &dev->lock);
+	return err;
+}
 
-	/* save request status */
-	status = req->status;
+int virtio_blk_read(size_t devnum, u64 sector, void *data, size_t nsectors)
+{
+	virtio_blk_seg_t seg = {data, nsectors * VIRTIO_BLK_SECTOR_SIZE};
+	return virtio_blk_rw(devnum, VIRTIO_BLK_T_IN, sector, &seg, 1, false);
+}
 
-	/* free all descriptors */
-	virtq_desc_free_nofail(&dev->requestq, desc0);
-	virtq_desc_free_nofail(&dev->requestq, desc1);
-	virtq_desc_free_nofail(&dev->requestq, desc2);
+int virtio_blk_write(size_t devnum, u64 sector, void *data, size_t nsectors)
+{
+	virtio_blk_seg_t seg = {data, nsectors * VIRTIO_BLK_SECTOR_SIZE};
+	return virtio_blk_rw(devnum, VIRTIO_BLK_T_OUT, sector, &seg, 1, false);
+}
 
-	/* free request memory */
-	kfree(req);
+int virtio_blk_readv(size_t devnum, u64 sector, const virtio_blk_seg_t *segs,
+		size_t nsegs)
+{
+	return virtio_blk_rw(devnum, VIRTIO_BLK_T_IN, sector, segs, nsegs, false);
+}
 
-	spinlock_release_irqrestore(&dev->lock, irqflags);
+int virtio_blk_writev(size_t devnum, u64 sector, const virtio_blk_seg_t *segs,
+		size_t nsegs)
+{
+	return virtio_blk_rw(devnum, VIRTIO_BLK_T_OUT, sector, segs, nsegs, false);
+}
 
-	if (status != VIRTIO_BLK_S_OK) {
-		return -EIO;
+/* Completions device gathers before interrupt, 1 interrupts on
+ * each of them. Has no effect without event index feature.
+ */
+int virtio_blk_set_coalesce(size_t devnum, u32 coalesce)
+{
+	virtio_blk_t *dev = &virtio_blk_list[devnum];
+
+	if (!dev->isvalid) {
+		return -ENODEV;
+	}
+	if (!coalesce) {
+		return -EINVAL;
 	}
 
+	/* used_event is updated on next completion of each queue */
+	dev->coalesce = coalesce;
+
 	return 0;
 }
 
-void virtio_blk_irq_handler(size_t devnum)
+/* poll on wait for all requests of device, not just ones asking */
+int virtio_blk_set_poll(size_t devnum, bool poll)
 {
-	int irqflags;
-	u16 i;
 	virtio_blk_t *dev = &virtio_blk_list[devnum];
-	virtq_used_elem_t *used;
-	virtq_desc_t *desc;
-	virtio_blk_req_t *req;
-
-	spinlock_acquire_irqsave(&dev->lock, irqflags);
 
-	/* if block op is completed we will wakeup blocked procs */
-	for (i = dev->requestq.lastusedidx % dev->requestq.virtqsz;
-			i != dev->requestq.used->idx % dev->requestq.virtqsz;
-			i = (i + 1) % dev->requestq.virtqsz) {
-		used = &dev->requestq.used->ring[i];
-		desc = &dev->requestq.desc[used->id];
-		req = (void *) desc->addr;
-		wchan_signal(req);
+	if (!dev->isvalid) {
+		return -ENODEV;
 	}
-	dev->requestq.lastusedidx = dev->requestq.used->idx;
+	dev->poll = poll;
 
-	/* for virtio_blk_read_nosleep and virtio_blk_write_nosleep */
-	dev->waitop = false;
-
-	spinlock_release_irqrestore(&dev->lock, irqflags);
+	return 0;
 }
 
-/* For fs layer init only.
- * Concurrency is not allowed.
- */
-int virtio_blk_read_nosleep(size_t devnum, u64 sector, void *data)
+/* counters summed over queues */
+void virtio_blk_stat(size_t devnum, virtio_blk_stat_t *stat)
 {
 	int irqflags;
-	u8 status;
 	virtio_blk_t *dev = &virtio_blk_list[devnum];
-	virtio_blk_req_t *req;
-	u16 desc0, desc1, desc2;
-
-	spinlock_acquire_irqsave(&dev->lock, irqflags);
-
-	if (sector >= dev->capacity) {
-		spinlock_release_irqrestore(&dev->lock, irqflags);
-		return -EIO;
+	virtio_blk_queue_t *queue;
+
+	bzero(stat, sizeof(*stat));
+	stat->interrupts = dev->interrupts;
+	for (u32 i = 0; i < dev->nqueues; i++) {
+		queue = &dev->queues[i];
+		spinlock_acquire_irqsave(&queue->lock, irqflags);
+		stat->notifies += queue->notifies;
+		stat->bytes += queue->bytes;
+		spinlock_release_irqrestore(&queue->lock, irqflags);
 	}
+}
 
-	req = kmalloc(sizeof(*req));
-	if (!req) {
-		spinlock_release_irqrestore(&dev->lock, irqflags);
-		return -ENOMEM;
+void virtio_blk_stat_reset(size_t devnum)
+{
+	int irqflags;
+	virtio_blk_t *dev = &virtio_blk_list[devnum];
+	virtio_blk_queue_t *queue;
+
+	dev->interrupts = 0;
+	for (u32 i = 0; i < dev->nqueues; i++) {
+		queue = &dev->queues[i];
+		spinlock_acquire_irqsave(&queue->lock, irqflags);
+		queue->notifies = 0;
+		queue->bytes = 0;
+		spinlock_release_irqrestore(&queue->lock, irqflags);
 	}
+}
 
-	req->type = VIRTIO_BLK_T_IN;
-	req->sector = sector;
+/* Make writes completed before call durable. Flush started after
+ * we came is needed, so callers that come while one is in flight
+ * wait and share next one. Returns status of flush we waited for.
+ */
+int virtio_blk_flush(size_t devnum)
+{
+	int irqflags, err;
+	virtio_blk_t *dev = &virtio_blk_list[devnum];
+	virtio_blk_bio_t bio;
+	u64 target, gen;
 
-	/* header descriptor */
-	desc0 = virtq_desc_alloc(&dev->requestq);
-	dev->requestq.desc[desc0].addr = (u64) req;
-	dev->requestq.desc[desc0].len = VIRTIO_BLK_REQ_HEAD_SIZE;
-	dev->requestq.desc[desc0].flags = VIRTQ_DESC_F_NEXT;
+	if (!dev->isvalid) {
+		return -ENODEV;
+	}
+	if (!dev->writeback) {
+		return 0;
+	}
 
-	/* data descriptor */
-	desc1 = virtq_desc_alloc(&dev->requestq);
-	dev->requestq.desc[desc1].addr = (u64) data;
-	dev->requestq.desc[desc1].len = VIRTIO_BLK_REQ_DATA_SIZE;
-	dev->requestq.desc[desc1].flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE;
+	spinlock_acquire_irqsave(&dev->flush_lock, irqflags);
+	target = dev->flush_started + 1;
+	while (dev->flush_done < target) {
+		if (dev->flushing) {
+			wchan_sleep(&dev->flush_done, &dev->flush_lock);
+			continue;
+		}
+
+		dev->flushing = true;
+		gen = ++dev->flush_started;
+		spinlock_release_irqrestore(&dev->flush_lock, irqflags);
+
+		/* flush request has only header and status */
+		virtio_blk_bio_init(&bio, VIRTIO_BLK_T_FLUSH, 0, NULL, 0);
+		err = virtio_blk_submit(devnum, &bio);
+		if (!err) {
+			err = virtio_blk_wait(&bio);
+		}
+
+		spinlock_acquire_irqsave(&dev->flush_lock, irqflags);
+		dev->flush_done = gen;
+		dev->flush_err = err;
+		dev->flushing = false;
+		wchan_broadcast(&dev->flush_done);
+	}
+	err = dev->flush_err;
+	spinlock_release_irqrestore(&dev->flush_lock, irqflags);
 
-	/* tail descriptor */
-	desc2 = virtq_desc_alloc(&dev->requestq);
-	dev->requestq.desc[desc2].addr = (u64) &req->status;
-	dev->requestq.desc[desc2].len = VIRTIO_BLK_REQ_TAIL_SIZE;
-	dev->requestq.desc[desc2].flags = VIRTQ_DESC_F_WRITE;
+	return err;
+}
 
-	/* link all descriptors */
-	dev->requestq.desc[desc0].next = desc1;
-	dev->requestq.desc[desc1].next = desc2;
-	dev->requestq.desc[desc2].next = 0;
+/* Send ranges with at most per of them in one request. Like
+ * virtio_blk_rw all requests are in flight before we wait.
+ */
+static int virtio_blk_ranges(size_t devnum, u32 type,
+		virtio_blk_range_t *ranges, size_t nranges, size_t per)
+{
+	int err = 0, ret;
+	virtio_blk_bio_t *bios;
+	virtio_blk_seg_t *segs;
+	size_t nbios = (nranges + per - 1) / per, nsubmitted = 0, n;
 
-	/* add request to avail ring and increment idx */
-	dev->requestq.avail->ring[
-		dev->requestq.avail->idx % dev->requestq.virtqsz] = desc0;
-	dev->requestq.avail->idx++;
+	bios = kmalloc(sizeof(*bios) * nbios + sizeof(*segs) * nbios);
+	if (!bios) {
+		return -ENOMEM;
+	}
+	segs = (virtio_blk_seg_t *) (bios + nbios);
+
+	for (size_t i = 0; i < nbios; i++) {
+		n = min(per, nranges - i * per);
+		segs[i].addr = ranges + i * per;
+		segs[i].len = n * sizeof(*ranges);
+		virtio_blk_bio_init(&bios[i], type, 0, &segs[i], 1);
+
+		err = virtio_blk_submit(devnum, &bios[i]);
+		if (err) {
+			break;
+		}
+		nsubmitted++;
+	}
 
-	/* notify device */
-	dev->base->virtio_mmio.queue_notify = VIRTIO_BLK_REQUESTQ;
+	for (size_t i = 0; i < nsubmitted; i++) {
+		ret = virtio_blk_wait(&bios[i]);
+		if (ret && !err) {
+			err = ret;
+		}
+	}
 
-	/* set waitop flag */
-	dev->waitop = true;
+	kfree(bios);
 
-	/* wait for block op */
-	while (dev->waitop) {
-		spinlock_release_irq(&dev->lock);
+	return err;
+}
 
-		wfi();
+/* Tell device sectors of ranges hold no data, so thin images
+ * can deallocate them. Ranges are shrunk to discard alignment and
+ * split by device limits. It is only a hint, device without
+ * discard feature ignores it and so do we.
+ */
+int virtio_blk_discard(size_t devnum, const virtio_blk_range_t *ranges,
+		size_t nranges)
+{
+	int err;
+	virtio_blk_t *dev = &virtio_blk_list[devnum];
+	virtio_blk_range_t *pieces;
+	size_t npieces = 0, j = 0;
+	u64 start, end, len;
+	u32 align = dev->discard_alignment;
 
-		spinlock_acquire_irq(&dev->lock);
+	if (!dev->isvalid) {
+		return -ENODEV;
+	}
+	for (size_t i = 0; i < nranges; i++) {
+		if (ranges[i].sector + ranges[i].num_sectors > dev->capacity) {
+			return -EIO;
+		}
+	}
+	if (!dev->max_discard_sectors || !dev->max_discard_seg) {
+		return 0;
 	}
 
-	/* save request status */
-	status = req->status;
-
-	virtq_desc_free(&dev->requestq, desc0);
-	virtq_desc_free(&dev->requestq, desc1);
-	virtq_desc_free(&dev->requestq, desc2);
+	for (size_t i = 0; i < nranges; i++) {
+		start = (ranges[i].sector + align - 1) / align * align;
+		end = (ranges[i].sector + ranges[i].num_sectors) / align * align;
+		if (end > start) {
+			npieces += (end - start + dev->max_discard_sectors - 1) /
+				dev->max_discard_sectors;
+		}
+	}
+	if (!npieces) {
+		return 0;
+	}
 
-	kfree(req);
+	pieces = kmalloc(sizeof(*pieces) * npieces);
+	if (!pieces) {
+		return -ENOMEM;
+	}
+	for (size_t i = 0; i < nranges; i++) {
+		start = (ranges[i].sector + align - 1) / align * align;
+		end = (ranges[i].sector + ranges[i].num_sectors) / align * align;
+		for (; start < end; start += len) {
+			len = min(end - start, dev->max_discard_sectors);
+			pieces[j].sector = start;
+			pieces[j].num_sectors = len;
+			pieces[j++].flags = 0;
+		}
+	}
 
-	spinlock_release_irqrestore(&dev->lock, irqflags);
+	err = virtio_blk_ranges(devnum, VIRTIO_BLK_T_DISCARD, pieces, npieces,
+			dev->max_discard_seg);
 
-	if (status != VIRTIO_BLK_S_OK) {
-		return -EIO;
-	}
+	kfree(pieces);
 
-	return 0;
+	return err;
 }
 
-/* For fs layer init only.
- * Concurrency is not allowed.
+/* Make sectors read back as zeroes. Device with write zeroes
+ * feature does it without data transfer and keeps them allocated,
+ * otherwise zeroed buffer is written over range.
  */
-int virtio_blk_write_nosleep(size_t devnum, u64 sector, void *data)
+int virtio_blk_write_zeroes(size_t devnum, u64 sector, u64 nsectors)
 {
-	int irqflags;
-	u8 status;
+	int err;
 	virtio_blk_t *dev = &virtio_blk_list[devnum];
-	virtio_blk_req_t *req;
-	u16 desc0, desc1, desc2;
+	virtio_blk_range_t onerange, *pieces = &onerange;
+	virtio_blk_seg_t segs[VIRTIO_BLK_SEG_MAX];
+	size_t npieces, nsegs, j = 0;
+	u64 len;
 
-	spinlock_acquire_irqsave(&dev->lock, irqflags);
-
-	if (sector >= dev->capacity) {
-		spinlock_release_irqrestore(&dev->lock, irqflags);
+	if (!dev->isvalid) {
+		return -ENODEV;
+	}
+	if (sector + nsectors > dev->capacity) {
 		return -EIO;
 	}
 
-	req = kmalloc(sizeof(*req));
-	if (!req) {
-		spinlock_release_irqrestore(&dev->lock, irqflags);
-		return -ENOMEM;
+	/* Every segment points at the same zeroes, device only reads
+	 * them. Batch of segments goes out as bios in flight together.
+	 */
+	if (!dev->max_write_zeroes_sectors) {
+		while (nsectors) {
+			for (nsegs = 0; nsectors && nsegs < VIRTIO_BLK_SEG_MAX;
+					nsegs++) {
+				len = min(nsectors, VIRTIO_BLK_ZEROES_SIZE /
+						VIRTIO_BLK_SECTOR_SIZE);
+				segs[nsegs].addr = (void *) virtio_blk_zeroes;
+				segs[nsegs].len = len * VIRTIO_BLK_SECTOR_SIZE;
+				nsectors -= len;
+			}
+			err = virtio_blk_writev(devnum, sector, segs, nsegs);
+			if (err) {
+				return err;
+			}
+			for (size_t i = 0; i < nsegs; i++) {
+				sector += segs[i].len / VIRTIO_BLK_SECTOR_SIZE;
+			}
+		}
+		return 0;
+	}
+	if (!nsectors) {
+		return 0;
 	}
 
-	req->type = VIRTIO_BLK_T_OUT;
-	req->sector = sector;
-
-	/* header descriptor */
-	desc0 = virtq_desc_alloc(&dev->requestq);
-	dev->requestq.desc[desc0].addr = (u64) req;
-	dev->requestq.desc[desc0].len = VIRTIO_BLK_REQ_HEAD_SIZE;
-	dev->requestq.desc[desc0].flags = VIRTQ_DESC_F_NEXT;
+	npieces = (nsectors + dev->max_write_zeroes_sectors - 1) /
+		dev->max_write_zeroes_sectors;
+	if (npieces > 1) {
+		pieces = kmalloc(sizeof(*pieces) * npieces);
+		if (!pieces) {
+			return -ENOMEM;
+		}
+	}
+	for (; nsectors; nsectors -= len, sector += len) {
+		len = min(nsectors, dev->max_write_zeroes_sectors);
+		pieces[j].sector = sector;
+		pieces[j].num_sectors = len;
+		pieces[j++].flags = 0;
+	}
 
-	/* data descriptor */
-	desc1 = virtq_desc_alloc(&dev->requestq);
-	dev->requestq.desc[desc1].addr = (u64) data;
-	dev->requestq.desc[desc1].len = VIRTIO_BLK_REQ_DATA_SIZE;
-	dev->requestq.desc[desc1].flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE;
+	/* one range per request, device may not take more */
+	err = virtio_blk_ranges(devnum, VIRTIO_BLK_T_WRITE_ZEROES, pieces,
+			npieces, 1);
 
-	/* tail descriptor */
-	desc2 = virtq_desc_alloc(&dev->requestq);
-	dev->requestq.desc[desc2].addr = (u64) &req->status;
-	dev->requestq.desc[desc2].len = VIRTIO_BLK_REQ_TAIL_SIZE;
-	dev->requestq.desc[desc2].flags = VIRTQ_DESC_F_WRITE;
+	if (pieces != &onerange) {
+		kfree(pieces);
+	}
 
-	/* link all descriptors */
-	dev->requestq.desc[desc0].next = desc1;
-	dev->requestq.desc[desc1].next = desc2;
-	dev->requestq.desc[desc2].next = 0;
+	return err;
+}
 
-	/* add request to avail ring and increment idx */
-	dev->requestq.avail->ring[
-		dev->requestq.avail->idx % dev->requestq.virtqsz] = desc0;
-	dev->requestq.avail->idx++;
+/* top half, runs with interrupts disabled */
+void virtio_blk_irq_handler(size_t devnum)
+{
+	virtio_blk_t *dev = &virtio_blk_list[devnum];
 
-	/* notify device */
-	dev->base->virtio_mmio.queue_notify = VIRTIO_BLK_REQUESTQ;
+	/* deassert interrupt before plic completion */
+	dev->base->virtio_mmio.interrupt_ack =
+		dev->base->virtio_mmio.interrupt_status;
+	atomic_fetch_add64(&dev->interrupts, 1);
 
-	/* set waitop flag */
-	dev->waitop = true;
+	*this_cpu_ptr(&virtio_blk_pending) |= 1ull << devnum;
+	softirq_raise(SOFTIRQ_BLK);
+}
 
-	/* wait for block op */
-	while (dev->waitop) {
-		spinlock_release_irq(&dev->lock);
+/* Walk used ring of queue and complete bios found by buffer id.
+ * Completions of all interrupts raised since last run are handled
+ * in one pass, callbacks are called after queue lock is released.
+ * With event index next interrupt is asked after coalesce more
+ * completions, but never after more than there are in flight.
+ */
+static void virtio_blk_complete_queue(virtio_blk_t *dev,
+		virtio_blk_queue_t *queue)
+{
+	int irqflags;
+	virtq_t *virtq = &queue->virtq;
+	virtio_blk_bio_t *bio;
+	list_t callbacks;
+	u16 id;
+	u32 batch;
+	bool freed = false;
+
+	list_init(&callbacks);
+
+	spinlock_acquire_irqsave(&queue->lock, irqflags);
+
+	for (;;) {
+		while ((id = virtq_used_pop(virtq)) != VIRTQ_ERROR) {
+			bio = queue->inflight[id];
+			queue->inflight[id] = NULL;
+			queue->ninflight--;
+			freed = true;
+
+			/* header slot is reused with id, read it under lock */
+			bio->status = queue->reqs[id].status == VIRTIO_BLK_S_OK ?
+				0 : -EIO;
+
+			if (bio->end_io) {
+				list_add_tail(&bio->completed, &callbacks);
+			} else {
+				/* waiter may free bio once lock is released */
+				bio->done = true;
+				wchan_broadcast(bio);
+			}
+		}
+
+		/* pollers keep interrupts off */
+		if (!(dev->features & (1ull << VIRTIO_F_RING_EVENT_IDX)) ||
+				queue->npolling) {
+			break;
+		}
+
+		/* buffers used before device saw new event would not
+		 * interrupt, so they are popped in next round
+		 */
+		batch = max(min(dev->coalesce, queue->ninflight), 1);
+		if (!virtq_interrupt_after(virtq, batch)) {
+			break;
+		}
+	}
 
-		wfi();
+	/* submitters waiting for room in ring */
+	if (freed) {
+		wchan_broadcast(virtq);
+	}
 
-		spinlock_acquire_irq(&dev->lock);
+	spinlock_release_irqrestore(&queue->lock, irqflags);
+
+	/* poller runs in process context, callbacks must not be
+	 * preempted there either
+	 */
+	preempt_disable();
+	while (!list_empty(&callbacks)) {
+		bio = list_entry(callbacks.next, virtio_blk_bio_t, completed);
+		list_del(&bio->completed);
+		bio->done = true;
+		bio->end_io(bio);
 	}
+	preempt_enable();
+}
 
-	/* save request status */
-	status = req->status;
+/* Device has one interrupt line for all its queues, so whichever
+ * hart takes it walks all of them. Each queue has its own lock,
+ * submitters on other harts are not held up.
+ */
+static void virtio_blk_complete(size_t devnum)
+{
+	virtio_blk_t *dev = &virtio_blk_list[devnum];
 
-	virtq_desc_free(&dev->requestq, desc0);
-	virtq_desc_free(&dev->requestq, desc1);
-	virtq_desc_free(&dev->requestq, desc2);
+	for (u32 i = 0; i < dev->nqueues; i++) {
+		virtio_blk_complete_queue(dev, &dev->queues[i]);
+	}
+}
 
-	kfree(req);
+static void virtio_blk_softirq(void)
+{
+	u64 pending;
 
-	spinlock_release_irqrestore(&dev->lock, irqflags);
+	irq_off();
+	pending = *this_cpu_ptr(&virtio_blk_pending);
+	*this_cpu_ptr(&virtio_blk_pending) = 0;
+	irq_on();
 
-	if (status != VIRTIO_BLK_S_OK) {
-		return -EIO;
+	for (size_t devnum = 0; devnum < VIRTIO_MAX; devnum++) {
+		if (pending & (1ull << devnum)) {
+			virtio_blk_complete(devnum);
+		}
 	}
+}
 
-	return 0;
+/* For fs layer init only.
+ * Concurrency is not allowed.
+ */
+int virtio_blk_read_nosleep(size_t devnum, u64 sector, void *data,
+		size_t nsectors)
+{
+	virtio_blk_seg_t seg = {data, nsectors * VIRTIO_BLK_SECTOR_SIZE};
+	return virtio_blk_rw(devnum, VIRTIO_BLK_T_IN, sector, &seg, 1, true);
 }
 
+/* For fs layer init only.
+ * Concurrency is not allowed.
+ */
+int virtio_blk_write_nosleep(size_t devnum, u64 sector, void *data,
+		size_t nsectors)
+{
+	virtio_blk_seg_t seg = {data, nsectors * VIRTIO_BLK_SECTOR_SIZE};
+	return virtio_blk_rw(devnum, VIRTIO_BLK_T_OUT, sector, &seg, 1, true);
+}
@@ -4,7 +4,7 @@
 #include <kernel/alloc.h>
 #include <kernel/klib.h>
 #include <kernel/errno.h>
-#include <kernel/wchan.h>
+#include <kernel/memlayout.h>
 
 void virtio_init(void)
 {
@@ -53,8 +53,36 @@ void virtio_irq_handler(size_t devnum)
 	}
 }
 
-int virtq_init(virtio_mmio_t *base, virtq_t *virtq, u32 queue_sel)
+/* Event index fields sit right after split rings, so they can not
+ * be reached through struct members whose ring size is unknown.
+ */
+#define virtq_used_event(virtq) \
+	(*(volatile u16 *) &(virtq)->avail->ring[(virtq)->virtqsz])
+#define virtq_avail_event(virtq) \
+	(*(volatile u16 *) &(virtq)->used->ring[(virtq)->virtqsz])
+
+/* true if moving idx from old to new passed event_idx */
+static inline bool virtq_need_event(u16 event_idx, u16 new, u16 old)
+{
+	return (u16) (new - event_idx - 1) < (u16) (new - old);
+}
+
+/* move packed ring position, wrap counter flips when it wraps */
+static inline void virtq_packed_advance(virtq_t *virtq, u16 *idx, bool *wrap,
+		u32 n)
+{
+	*idx += n;
+	if (*idx >= virtq->virtqsz) {
+		*idx -= virtq->virtqsz;
+		*wrap = !*wrap;
+	}
+}
+
+int virtq_init(virtio_mmio_t *base, virtq_t *virtq, u32 queue_sel,
+		u64 features)
 {
+	size_t availsz, usedsz, availalign, usedalign;
+
 	/* select queue */
 	base->queue_sel = queue_sel;
 
@@ -69,47 +97,86 @@ int virtq_init(virtio_mmio_t *base, virtq_t *virtq, u32 queue_sel)
 		return -ENODEV;
 	}
 
+	/* ring format was chosen by negotiated features */
+	virtq->packed = features & (1ull << VIRTIO_F_RING_PACKED);
+	virtq->event_idx = features & (1ull << VIRTIO_F_RING_EVENT_IDX);
+	virtq->added = 0;
+
 	/* set lastusedidx to 0 */
 	virtq->lastusedidx = 0;
 
-	/* descriptor alloc table */
-	virtq->descmap = kmalloc(sizeof(*virtq->descmap) * virtq->virtqsz);
-	if (!virtq->descmap) {
+	/* both wrap counters start at 1 */
+	virtq->nextavail = 0;
+	virtq->lastused = 0;
+	virtq->availwrap = true;
+	virtq->usedwrap = true;
+
+	/* no indirect tables until virtq_indirect_init */
+	virtq->indirect_slab = NULL;
+	virtq->indirect_free = NULL;
+	virtq->indirectsz = 0;
+
+	/* buffer ids, packed ring takes free ones from list */
+	virtq->bufs = kmalloc(sizeof(*virtq->bufs) * virtq->virtqsz);
+	if (!virtq->bufs) {
 		return -ENOMEM;
 	}
-	bzero(virtq->descmap, sizeof(*virtq->descmap) * virtq->virtqsz);
+	for (u32 id = 0; id < virtq->virtqsz; id++) {
+		virtq->bufs[id].table = NULL;
+		virtq->bufs[id].nslots = 0;
+		virtq->bufs[id].next = id + 1 < virtq->virtqsz ? id + 1 : VIRTQ_ERROR;
+	}
+	virtq->freeid = 0;
 
-	/* allocate and zero the queue memory */
+	/* allocate and zero the queue memory, descriptor area has
+	 * same size for both formats
+	 */
 	virtq->desc_unaligned = kmalloc(ALIGNED_ALLOC_SZ(
 				16 * virtq->virtqsz,
 				VIRTIO_QUEUE_DESC_AREA_ALIGN));
 	if (!virtq->desc_unaligned) {
+		kfree(virtq->bufs);
 		return -ENOMEM;
 	}
 	virtq->desc = ALIGNED_ALLOC_PTR(virtq->desc_unaligned,
 			VIRTIO_QUEUE_DESC_AREA_ALIGN);
 	bzero(virtq->desc, 16 * virtq->virtqsz);
 
-	virtq->avail_unaligned = kmalloc(ALIGNED_ALLOC_SZ(6 + 2 * virtq->virtqsz,
-				VIRTIO_QUEUE_DRIVER_AREA_ALIGN));
+	/* chain all split ring descriptors into free list */
+	for (u32 desc = 0; !virtq->packed && desc < virtq->virtqsz; desc++) {
+		virtq->desc[desc].next = desc + 1;
+	}
+	virtq->freehead = 0;
+	virtq->nfree = virtq->virtqsz;
+
+	if (virtq->packed) {
+		availsz = usedsz = sizeof(pvirtq_event_t);
+		availalign = usedalign = VIRTIO_QUEUE_EVENT_AREA_ALIGN;
+	} else {
+		availsz = 6 + 2 * virtq->virtqsz;
+		usedsz = 6 + 8 * virtq->virtqsz;
+		availalign = VIRTIO_QUEUE_DRIVER_AREA_ALIGN;
+		usedalign = VIRTIO_QUEUE_DEVICE_AREA_ALIGN;
+	}
+
+	virtq->avail_unaligned = kmalloc(ALIGNED_ALLOC_SZ(availsz, availalign));
 	if (!virtq->avail_unaligned) {
 		kfree(virtq->desc_unaligned);
+		kfree(virtq->bufs);
 		return -ENOMEM;
 	}
-	virtq->avail = ALIGNED_ALLOC_PTR(virtq->avail_unaligned,
-			VIRTIO_QUEUE_DRIVER_AREA_ALIGN);
-	bzero(virtq->avail, 6 + 2 * virtq->virtqsz);
+	virtq->avail = ALIGNED_ALLOC_PTR(virtq->avail_unaligned, availalign);
+	bzero(virtq->avail, availsz);
 
-	virtq->used_unaligned = kmalloc(ALIGNED_ALLOC_SZ(6 + 8 * virtq->virtqsz,
-				VIRTIO_QUEUE_DEVICE_AREA_ALIGN));
+	virtq->used_unaligned = kmalloc(ALIGNED_ALLOC_SZ(usedsz, usedalign));
 	if (!virtq->used_unaligned) {
 		kfree(virtq->desc_unaligned);
 		kfree(virtq->avail_unaligned);
+		kfree(virtq->bufs);
 		return -ENOMEM;
 	}
-	virtq->used = ALIGNED_ALLOC_PTR(virtq->used_unaligned,
-			VIRTIO_QUEUE_DEVICE_AREA_ALIGN);
-	bzero(virtq->used, 6 + 8 * virtq->virtqsz);
+	virtq->used = ALIGNED_ALLOC_PTR(virtq->used_unaligned, usedalign);
+	bzero(virtq->used, usedsz);
 
 	/* notify the device about the queue size */
 	base->queue_num = virtq->virtqsz;
@@ -124,6 +191,23 @@ int virtq_init(virtio_mmio_t *base, virtq_t *virtq, u32 queue_sel)
 	base->queue_device_low = (u64) virtq->used;
 	base->queue_device_high = (u64) virtq->used >> 32;
 
+	/* packed ring reuses the same areas */
+	virtq->pdesc = NULL;
+	virtq->driver_event = virtq->device_event = NULL;
+	if (virtq->packed) {
+		virtq->pdesc = (pvirtq_desc_t *) virtq->desc;
+		virtq->driver_event = (pvirtq_event_t *) virtq->avail;
+		virtq->device_event = (pvirtq_event_t *) virtq->used;
+		virtq->desc = NULL;
+		virtq->avail = NULL;
+		virtq->used = NULL;
+
+		/* with event index first used buffer interrupts */
+		virtq->driver_event->off_wrap = VIRTQ_EVENT_WRAP;
+		virtq->driver_event->flags = virtq->event_idx ?
+			VIRTQ_EVENT_F_DESC : VIRTQ_EVENT_F_ENABLE;
+	}
+
 	/* write 0x1 to queueready */
 	base->queue_ready = 0x1;
 
@@ -135,36 +219,371 @@ void virtq_destroy(virtq_t *virtq)
 	kfree(virtq->desc_unaligned);
 	kfree(virtq->avail_unaligned);
 	kfree(virtq->used_unaligned);
+	kfree(virtq->bufs);
+	if (virtq->indirect_slab) {
+		kpage_free(virtq->indirect_slab);
+	}
 }
 
-u16 virtq_desc_alloc(virtq_t *virtq)
+/* Take n split ring descriptors linked through next field. Free
+ * list is already chained, so links are left as they are.
+ */
+static u16 virtq_desc_chain_alloc(virtq_t *virtq, size_t n)
 {
-	for (size_t desc = 0; desc < virtq->virtqsz; desc++) {
-		if (!virtq->descmap[desc]) {
-			virtq->descmap[desc] = 1;
-			return desc;
+	u16 head, desc;
+
+	if (!n || virtq->nfree < n) {
+		return VIRTQ_ERROR;
+	}
+	head = desc = virtq->freehead;
+	for (size_t i = 1; i < n; i++) {
+		desc = virtq->desc[desc].next;
+	}
+	virtq->freehead = virtq->desc[desc].next;
+	virtq->nfree -= n;
+	return head;
+}
+
+/* give chain starting at head back, it is spliced before free list */
+static void virtq_desc_chain_free(virtq_t *virtq, u16 head)
+{
+	u16 desc = head;
+	size_t n = 1;
+
+	while (virtq->desc[desc].flags & VIRTQ_DESC_F_NEXT) {
+		desc = virtq->desc[desc].next;
+		n++;
+	}
+	virtq->desc[desc].next = virtq->freehead;
+	virtq->freehead = head;
+	virtq->nfree += n;
+}
+
+/* Carve ntables indirect tables of tablesz descriptors out of one
+ * page allocation. Tables are in format of ring they are used with.
+ */
+int virtq_indirect_init(virtq_t *virtq, size_t ntables, size_t tablesz)
+{
+	size_t npages = (ntables * tablesz * sizeof(virtq_desc_t) + PAGESZ - 1)
+		/ PAGESZ;
+	virtq_desc_t *table;
+
+	if (!ntables || !tablesz || tablesz > virtq->virtqsz) {
+		return -EINVAL;
+	}
+
+	virtq->indirect_slab = kpage_alloc(npages);
+	if (!virtq->indirect_slab) {
+		return -ENOMEM;
+	}
+	virtq->indirectsz = tablesz;
+	virtq->indirect_free = NULL;
+
+	for (size_t i = 0; i < ntables; i++) {
+		table = (virtq_desc_t *) virtq->indirect_slab + i * tablesz;
+		table->addr = (u64) virtq->indirect_free;
+		virtq->indirect_free = table;
+	}
+
+	return 0;
+}
+
+/* NULL if there are no tables left or queue has none at all */
+static virtq_desc_t *virtq_indirect_alloc(virtq_t *virtq)
+{
+	virtq_desc_t *table = virtq->indirect_free;
+
+	if (table) {
+		virtq->indirect_free = (virtq_desc_t *) table->addr;
+	}
+	return table;
+}
+
+static void virtq_indirect_free(virtq_t *virtq, virtq_desc_t *table)
+{
+	table->addr = (u64) virtq->indirect_free;
+	virtq->indirect_free = table;
+}
+
+/* write descriptor into ring at chain->desc and move past it */
+static void virtq_ring_desc_write(virtq_t *virtq, virtq_chain_t *chain,
+		u64 addr, u32 len, u16 flags)
+{
+	pvirtq_desc_t *pdesc;
+
+	if (!virtq->packed) {
+		virtq->desc[chain->desc].addr = addr;
+		virtq->desc[chain->desc].len = len;
+		virtq->desc[chain->desc].flags = flags;
+		/* next link is kept from free list */
+		chain->desc = virtq->desc[chain->desc].next;
+		return;
+	}
+
+	pdesc = &virtq->pdesc[chain->desc];
+	pdesc->addr = addr;
+	pdesc->len = len;
+	pdesc->id = chain->id;
+	flags |= chain->wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED;
+
+	/* device may take chain as soon as head flags are written */
+	if (chain->desc == chain->head) {
+		chain->headflags = flags;
+	} else {
+		pdesc->flags = flags;
+	}
+	virtq_packed_advance(virtq, &chain->desc, &chain->wrap, 1);
+}
+
+/* Reserve room for buffer of ndescs descriptors. Whole buffer takes
+ * one ring slot if there is free indirect table for it. Returns
+ * -EBUSY if ring is full, nothing is reserved then.
+ */
+int virtq_chain_begin(virtq_t *virtq, virtq_chain_t *chain, size_t ndescs)
+{
+	virtq_desc_t *table = NULL;
+	size_t nslots;
+	u16 id;
+
+	if (!ndescs || ndescs > virtq->virtqsz) {
+		return -EINVAL;
+	}
+	if (ndescs <= virtq->indirectsz) {
+		table = virtq_indirect_alloc(virtq);
+	}
+	nslots = table ? 1 : ndescs;
+
+	if (virtq->packed) {
+		if (virtq->nfree < nslots || virtq->freeid == VIRTQ_ERROR) {
+			goto busy;
+		}
+		id = virtq->freeid;
+		virtq->freeid = virtq->bufs[id].next;
+		virtq->bufs[id].nslots = nslots;
+		virtq->nfree -= nslots;
+
+		/* slots are ours until chain end publishes head */
+		chain->head = chain->desc = virtq->nextavail;
+		chain->wrap = virtq->availwrap;
+		virtq_packed_advance(virtq, &virtq->nextavail, &virtq->availwrap,
+				nslots);
+	} else {
+		id = virtq_desc_chain_alloc(virtq, nslots);
+		if (id == VIRTQ_ERROR) {
+			goto busy;
+		}
+		chain->head = chain->desc = id;
+	}
+
+	virtq->bufs[id].table = table;
+	chain->id = id;
+	chain->ndescs = ndescs;
+	chain->nadded = 0;
+	chain->table = table;
+
+	/* ring slot points to table, chain is built inside it */
+	if (table) {
+		virtq_ring_desc_write(virtq, chain, (u64) table,
+				sizeof(*table) * ndescs, VIRTQ_DESC_F_INDIRECT);
+		chain->desc = 0;
+	}
+
+	return 0;
+
+busy:
+	if (table) {
+		virtq_indirect_free(virtq, table);
+	}
+	return -EBUSY;
+}
+
+/* add next descriptor of chain, flags may only have WRITE set */
+void virtq_chain_add(virtq_t *virtq, virtq_chain_t *chain, void *addr,
+		u32 len, u16 flags)
+{
+	virtq_desc_t *table = chain->table;
+	pvirtq_desc_t *ptable = chain->table;
+	bool last = ++chain->nadded == chain->ndescs;
+
+	if (!table) {
+		virtq_ring_desc_write(virtq, chain, (u64) addr, len,
+				last ? flags : flags | VIRTQ_DESC_F_NEXT);
+	} else if (virtq->packed) {
+		/* packed table is read in order up to its length */
+		ptable[chain->desc].addr = (u64) addr;
+		ptable[chain->desc].len = len;
+		ptable[chain->desc].id = 0;
+		ptable[chain->desc].flags = flags;
+		chain->desc++;
+	} else {
+		table[chain->desc].addr = (u64) addr;
+		table[chain->desc].len = len;
+		table[chain->desc].flags = last ? flags : flags | VIRTQ_DESC_F_NEXT;
+		table[chain->desc].next = chain->desc + 1;
+		chain->desc++;
+	}
+}
+
+/* make chain with all its descriptors added available to device */
+void virtq_chain_end(virtq_t *virtq, virtq_chain_t *chain)
+{
+	u16 idx;
+
+	if (virtq->packed) {
+		/* descriptors must be seen before head makes them available */
+		atomic_membar();
+		virtq->pdesc[chain->head].flags = chain->headflags;
+		atomic_membar();
+		virtq->added += virtq->bufs[chain->id].nslots;
+		return;
+	}
+
+	/* add to avail ring, device must see entry before idx */
+	idx = virtq->avail->idx;
+	virtq->avail->ring[idx % virtq->virtqsz] = chain->id;
+	atomic_membar();
+	virtq->avail->idx = idx + 1;
+	atomic_membar();
+	virtq->added++;
+}
+
+/* True if device asked to be notified about chains made available
+ * since last call. Every notify is vm exit, so it is skipped when
+ * device is busy anyway.
+ */
+bool virtq_need_kick(virtq_t *virtq)
+{
+	u16 new, old, event, flags;
+
+	new = virtq->packed ? virtq->nextavail : virtq->avail->idx;
+	old = new - virtq->added;
+	virtq->added = 0;
+
+	if (virtq->packed) {
+		flags = *(volatile u16 *) &virtq->device_event->flags;
+		if (flags != VIRTQ_EVENT_F_DESC) {
+			return flags != VIRTQ_EVENT_F_DISABLE;
 		}
+		/* event from previous pass over ring lies below zero */
+		event = *(volatile u16 *) &virtq->device_event->off_wrap;
+		if (!(event & VIRTQ_EVENT_WRAP) != !virtq->availwrap) {
+			event = (event & ~VIRTQ_EVENT_WRAP) - virtq->virtqsz;
+		} else {
+			event &= ~VIRTQ_EVENT_WRAP;
+		}
+		return virtq_need_event(event, new, old);
+	}
+
+	if (virtq->event_idx) {
+		return virtq_need_event(virtq_avail_event(virtq), new, old);
+	}
+	return !(*(volatile u16 *) &virtq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+}
+
+/* true if device used buffer which was not popped yet */
+static bool virtq_used_pending(virtq_t *virtq)
+{
+	u16 flags;
+
+	if (virtq->packed) {
+		flags = *(volatile u16 *) &virtq->pdesc[virtq->lastused].flags;
+		return !(flags & VIRTQ_DESC_F_AVAIL) == !virtq->usedwrap &&
+			!(flags & VIRTQ_DESC_F_USED) == !virtq->usedwrap;
 	}
-	return VIRTQ_ERROR;
+	return *(volatile u16 *) &virtq->used->idx != virtq->lastusedidx;
 }
 
-void virtq_desc_free(virtq_t *virtq, u16 desc)
+/* Returns id of next used buffer and frees its descriptors, or
+ * VIRTQ_ERROR. Id is reused by next chain begin.
+ */
+u16 virtq_used_pop(virtq_t *virtq)
 {
-	virtq->descmap[desc] = 0;
+	virtq_buf_t *buf;
+	u16 id;
+
+	if (!virtq_used_pending(virtq)) {
+		return VIRTQ_ERROR;
+	}
+	atomic_acquire_membar();
+
+	if (virtq->packed) {
+		/* device wrote id in place and skipped rest of chain */
+		id = virtq->pdesc[virtq->lastused].id;
+		buf = &virtq->bufs[id];
+		virtq_packed_advance(virtq, &virtq->lastused, &virtq->usedwrap,
+				buf->nslots);
+		virtq->nfree += buf->nslots;
+		buf->next = virtq->freeid;
+		virtq->freeid = id;
+	} else {
+		id = virtq->used->ring[virtq->lastusedidx % virtq->virtqsz].id;
+		virtq->lastusedidx++;
+		buf = &virtq->bufs[id];
+		virtq_desc_chain_free(virtq, id);
+	}
+
+	if (buf->table) {
+		virtq_indirect_free(virtq, buf->table);
+		buf->table = NULL;
+	}
+
+	return id;
 }
 
-u16 virtq_desc_alloc_nofail(virtq_t *virtq, spinlock_t *lock)
+/* Ask for interrupt after at most n more used buffers, needs event
+ * index. Returns true if device used buffers meanwhile, they may
+ * not interrupt and have to be popped by caller.
+ */
+bool virtq_interrupt_after(virtq_t *virtq, u32 n)
 {
-	u16 desc;
-	while ((desc = virtq_desc_alloc(virtq)) == VIRTQ_ERROR) {
-		wchan_sleep(virtq->desc, lock);
+	u16 off;
+	bool wrap;
+
+	if (virtq->packed) {
+		/* buffer takes at least one slot, so n slots are enough */
+		off = virtq->lastused;
+		wrap = virtq->usedwrap;
+		virtq_packed_advance(virtq, &off, &wrap, n - 1);
+		virtq->driver_event->off_wrap = off | (wrap ? VIRTQ_EVENT_WRAP : 0);
+	} else {
+		virtq_used_event(virtq) = virtq->lastusedidx + n - 1;
 	}
-	return desc;
+	atomic_membar();
+
+	return virtq_used_pending(virtq);
 }
 
-void virtq_desc_free_nofail(virtq_t *virtq, u16 desc)
+/* Device stops interrupting on used buffers, for callers which
+ * pop them by polling.
+ */
+void virtq_interrupt_disable(virtq_t *virtq)
 {
-	virtq_desc_free(virtq, desc);
-	wchan_signal(virtq->desc);
+	if (virtq->packed) {
+		virtq->driver_event->flags = VIRTQ_EVENT_F_DISABLE;
+	} else if (virtq->event_idx) {
+		/* device is never behind lastusedidx, so it never passes it */
+		virtq_used_event(virtq) = virtq->lastusedidx - 1;
+	} else {
+		virtq->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+	}
+	atomic_membar();
 }
 
+/* Next used buffer interrupts again. Buffers used while interrupts
+ * were disabled did not interrupt and have to be popped by caller.
+ */
+void virtq_interrupt_enable(virtq_t *virtq)
+{
+	if (virtq->packed) {
+		virtq->driver_event->off_wrap = virtq->lastused |
+			(virtq->usedwrap ? VIRTQ_EVENT_WRAP : 0);
+		atomic_membar();
+		virtq->driver_event->flags = virtq->event_idx ?
+			VIRTQ_EVENT_F_DESC : VIRTQ_EVENT_F_ENABLE;
+	} else if (virtq->event_idx) {
+		virtq_used_event(virtq) = virtq->lastusedidx;
+	} else {
+		virtq->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+	}
+	atomic_membar();
+}
@@ -0,0 +1,179 @@
+#include <kernel/waitq.h>
+#include <kernel/sched.h>
+#include <kernel/irq.h>
+#include <kernel/timer.h>
+#include <kernel/errno.h>
+
+#if LOCKSTAT
+void __waitq_init(waitq_t *waitq, const char *name)
+{
+	__spinlock_init(&waitq->lock, name);
+	list_init(&waitq->waiters);
+}
+#else
+void waitq_init(waitq_t *waitq)
+{
+	spinlock_init(&waitq->lock);
+	list_init(&waitq->waiters);
+}
+#endif
+
+/* waitq lock should be held */
+static void waitq_wake(waitq_t *waitq, proc_t *proc)
+{
+	list_del(&proc->waitq_list);
+	proc->waitq = NULL;
+	sched_wakeup(proc);
+}
+
+static void waitq_timeout(void *arg)
+{
+	int irqflags;
+	proc_t *proc = arg;
+	waitq_t *waitq = proc->waitq;
+
+	/* already woken up */
+	if (!waitq) {
+		return;
+	}
+
+	spinlock_acquire_irqsave(&waitq->lock, irqflags);
+	spinlock_acquire(&proc->lock);
+	if (proc->state == PROC_STATE_STOPPED && proc->waitq == waitq) {
+		proc->timedout = true;
+		waitq_wake(waitq, proc);
+	}
+	spinlock_release(&proc->lock);
+	spinlock_release_irqrestore(&waitq->lock, irqflags);
+}
+
+/* Put current process to sleep on waitq until somebody wakes wchan
+ * or mtime reaches expires. sl is released while sleeping and may be
+ * waitq lock itself. Lock order is waitq lock, then proc lock.
+ */
+int waitq_sleep(waitq_t *waitq, void *wchan, spinlock_t *sl, u64 expires)
+{
+	int irqflags, err;
+	bool timedout;
+	proc_t *proc = curproc();
+
+	if (expires <= ktimer_now()) {
+		return -ETIMEDOUT;
+	}
+
+	irqflags = irq_enabled();
+	irq_off();
+	if (sl != &waitq->lock) {
+		spinlock_acquire(&waitq->lock);
+	}
+	spinlock_acquire(&proc->lock);
+
+	if (expires != WAITQ_FOREVER) {
+		/* fires on this hart, so not before we switch */
+		ktimer_setup(&proc->timer, waitq_timeout, proc);
+		err = ktimer_add(&proc->timer, expires);
+		if (err) {
+			spinlock_release(&proc->lock);
+			if (sl != &waitq->lock) {
+				spinlock_release(&waitq->lock);
+			}
+			if (irqflags) {
+				irq_on();
+			}
+			return err;
+		}
+	}
+
+	list_add_tail(&proc->waitq_list, &waitq->waiters);
+	proc->waitq = waitq;
+	proc->wchan = wchan;
+	proc->timedout = false;
+	proc->state = PROC_STATE_STOPPED;
+
+	/* wakers will spin on proc lock until we switch */
+	spinlock_release(&waitq->lock);
+	if (sl && sl != &waitq->lock) {
+		spinlock_release(sl);
+	}
+
+	sched_switch();
+
+	proc->state = PROC_STATE_RUNNING;
+	proc->wchan = NULL;
+	timedout = proc->timedout;
+
+	spinlock_release_irqrestore(&proc->lock, irqflags);
+
+	/* callback takes proc lock, so cancel it after release */
+	if (expires != WAITQ_FOREVER) {
+		ktimer_cancel(&proc->timer);
+	}
+
+	if (sl) {
+		spinlock_acquire(sl);
+	}
+
+	if (timedout) {
+		return -ETIMEDOUT;
+	}
+	return 0;
+}
+
+/* Returns woken process or NULL. waitq lock should be held,
+ * NULL wchan matches any sleeper.
+ */
+proc_t *__waitq_wake_one(waitq_t *waitq, void *wchan)
+{
+	proc_t *proc;
+	for (list_t *entry = waitq->waiters.next; entry != &waitq->waiters; entry = entry->next) {
+		proc = list_entry(entry, proc_t, waitq_list);
+		if (!wchan || proc->wchan == wchan) {
+			spinlock_acquire(&proc->lock);
+			waitq_wake(waitq, proc);
+			spinlock_release(&proc->lock);
+			return proc;
+		}
+	}
+	return NULL;
+}
+
+/* waitq lock should be held, NULL wchan matches any sleeper */
+size_t __waitq_wake_all(waitq_t *waitq, void *wchan)
+{
+	proc_t *proc;
+	list_t *entry, *next;
+	size_t n = 0;
+
+	for (entry = waitq->waiters.next; entry != &waitq->waiters; entry = next) {
+		next = entry->next;
+		proc = list_entry(entry, proc_t, waitq_list);
+		if (!wchan || proc->wchan == wchan) {
+			spinlock_acquire(&proc->lock);
+			waitq_wake(waitq, proc);
+			spinlock_release(&proc->lock);
+			n++;
+		}
+	}
+	return n;
+}
+
+bool waitq_wake_one(waitq_t *waitq, void *wchan)
+{
+	int irqflags;
+	bool woken;
+	spinlock_acquire_irqsave(&waitq->lock, irqflags);
+	woken = __waitq_wake_one(waitq, wchan) != NULL;
+	spinlock_release_irqrestore(&waitq->lock, irqflags);
+	return woken;
+}
+
+size_t waitq_wake_all(waitq_t *waitq, void *wchan)
+{
+	int irqflags;
+	size_t n;
+	spinlock_acquire_irqsave(&waitq->lock, irqflags);
+	n = __waitq_wake_all(waitq, wchan);
+	spinlock_release_irqrestore(&waitq->lock, irqflags);
+	return n;
+}
+
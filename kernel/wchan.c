@@ -1,52 +1,47 @@
 #include <kernel/wchan.h>
-#include <kernel/sched.h>
-#include <kernel/irq.h>
+#include <kernel/waitq.h>
 
-void wchan_sleep(void *wchan, spinlock_t *sl)
-{
-	int irqflags;
-	spinlock_acquire_irqsave(&curproc()->lock, irqflags);
-	spinlock_release(sl);
+/* channels are hashed into a fixed table of wait queues, sleepers
+ * with different channels may share a bucket
+ */
+#define WCHAN_HASH_BITS 6
+#define WCHAN_HASH_SIZE (1 << WCHAN_HASH_BITS)
 
-	curproc()->state = PROC_STATE_STOPPED;
-	curproc()->wchan = wchan;
+static waitq_t wchan_table[WCHAN_HASH_SIZE];
 
-	context_switch(curproc()->context, curcpu()->context);
+static waitq_t *wchan_waitq(void *wchan)
+{
+	u64 hash = ((u64) wchan >> 3) * 0x9e3779b97f4a7c15ull;
+	return &wchan_table[hash >> (64 - WCHAN_HASH_BITS)];
+}
+
+void wchan_init(void)
+{
+	for (size_t i = 0; i < WCHAN_HASH_SIZE; i++) {
+		waitq_init(&wchan_table[i]);
+	}
+}
 
-	curproc()->state = PROC_STATE_RUNNING;
-	curproc()->wchan = NULL;
+void wchan_sleep(void *wchan, spinlock_t *sl)
+{
+	waitq_sleep(wchan_waitq(wchan), wchan, sl, WAITQ_FOREVER);
+}
 
-	spinlock_release_irqrestore(&curproc()->lock, irqflags);
-	spinlock_acquire(sl);
+/* Same as wchan_sleep but returns -ETIMEDOUT if
+ * nobody signals wchan before mtime reaches expires.
+ */
+int wchan_sleep_timeout(void *wchan, spinlock_t *sl, u64 expires)
+{
+	return waitq_sleep(wchan_waitq(wchan), wchan, sl, expires);
 }
 
 void wchan_signal(void *wchan)
 {
-	extern proc_t proctable[NPROC];
-	int irqflags;
-	for (size_t i = 0; i < NPROC; i++) {
-		spinlock_acquire_irqsave(&proctable[i].lock, irqflags);
-		if (proctable[i].state == PROC_STATE_STOPPED &&
-				proctable[i].wchan == wchan) {
-			proctable[i].state = PROC_STATE_RUNNABLE;
-			spinlock_release_irqrestore(&proctable[i].lock, irqflags);
-			return;
-		}
-		spinlock_release_irqrestore(&proctable[i].lock, irqflags);
-	}
+	waitq_wake_one(wchan_waitq(wchan), wchan);
 }
 
 void wchan_broadcast(void *wchan)
 {
-	extern proc_t proctable[NPROC];
-	int irqflags;
-	for (size_t i = 0; i < NPROC; i++) {
-		spinlock_acquire_irqsave(&proctable[i].lock, irqflags);
-		if (proctable[i].state == PROC_STATE_STOPPED &&
-				proctable[i].wchan == wchan) {
-			proctable[i].state = PROC_STATE_RUNNABLE;
-		}
-		spinlock_release_irqrestore(&proctable[i].lock, irqflags);
-	}
+	waitq_wake_all(wchan_waitq(wchan), wchan);
 }
 
@@ -0,0 +1,152 @@
+#include <kernel/workqueue.h>
+#include <kernel/waitq.h>
+#include <kernel/wchan.h>
+#include <kernel/percpu.h>
+#include <kernel/irq.h>
+#include <kernel/proc.h>
+#include <kernel/kprintf.h>
+
+typedef struct worker_pool worker_pool_t;
+typedef struct worker      worker_t;
+
+struct worker {
+	worker_pool_t *pool;
+	/* work being run, flush_work waits for it */
+	work_t *running;
+};
+
+/* Works queued on a hart go to its pool, so queueing never
+ * contends with other harts. Workers are ordinary kernel
+ * threads and may run on any hart.
+ */
+struct worker_pool {
+	/* idle workers, waitq lock protects all fields */
+	waitq_t waitq;
+	list_t works;
+	worker_t workers[WORKQUEUE_NWORKERS];
+};
+
+static DEFINE_PER_CPU(worker_pool_t, worker_pools);
+
+static void worker_thread(void *arg)
+{
+	int irqflags;
+	worker_t *worker = arg;
+	worker_pool_t *pool = worker->pool;
+	work_t *work;
+
+	spinlock_acquire_irqsave(&pool->waitq.lock, irqflags);
+	while (1) {
+		while (list_empty(&pool->works)) {
+			waitq_sleep(&pool->waitq, pool, &pool->waitq.lock,
+					WAITQ_FOREVER);
+		}
+		work = list_entry(pool->works.next, work_t, works);
+		list_del(&work->works);
+
+		/* work may be queued again while it runs */
+		work->pending = false;
+		worker->running = work;
+		spinlock_release_irqrestore(&pool->waitq.lock, irqflags);
+
+		work->func(work);
+
+		spinlock_acquire_irqsave(&pool->waitq.lock, irqflags);
+		worker->running = NULL;
+		wchan_broadcast(work);
+	}
+}
+
+void workqueue_init(void)
+{
+	worker_pool_t *pool;
+	for (size_t i = 0; i < NCPU; i++) {
+		pool = per_cpu_ptr(&worker_pools, i);
+		waitq_init(&pool->waitq);
+		list_init(&pool->works);
+		for (size_t j = 0; j < WORKQUEUE_NWORKERS; j++) {
+			pool->workers[j].pool = pool;
+			pool->workers[j].running = NULL;
+			if (!kthread_create(worker_thread, &pool->workers[j])) {
+				panic("can not create worker");
+			}
+		}
+	}
+}
+
+void work_init(work_t *work, void (*func)(work_t *work))
+{
+	work->func = func;
+	work->pending = false;
+	work->pool = NULL;
+	list_init(&work->works);
+}
+
+/* Queue work to pool of cpu, safe in interrupt context.
+ * Returns false if work is already pending.
+ */
+bool queue_work_on(u64 cpu, work_t *work)
+{
+	int irqflags;
+	worker_pool_t *pool = per_cpu_ptr(&worker_pools, cpu);
+
+	spinlock_acquire_irqsave(&pool->waitq.lock, irqflags);
+	if (work->pending) {
+		spinlock_release_irqrestore(&pool->waitq.lock, irqflags);
+		return false;
+	}
+	work->pending = true;
+	work->pool = pool;
+	list_add_tail(&work->works, &pool->works);
+	__waitq_wake_one(&pool->waitq, NULL);
+	spinlock_release_irqrestore(&pool->waitq.lock, irqflags);
+
+	return true;
+}
+
+bool queue_work(work_t *work)
+{
+	int irqflags;
+	bool ret;
+
+	/* do not migrate between cpuid and queueing */
+	irqflags = irq_enabled();
+	irq_off();
+	ret = queue_work_on(cpuid(), work);
+	if (irqflags) {
+		irq_on();
+	}
+
+	return ret;
+}
+
+/* sleep until work is neither pending nor running */
+void flush_work(work_t *work)
+{
+	int irqflags;
+	worker_pool_t *pool;
+	bool busy = true;
+
+	while (busy) {
+		pool = work->pool;
+		if (!pool) {
+			return;
+		}
+
+		spinlock_acquire_irqsave(&pool->waitq.lock, irqflags);
+		if (work->pool != pool) {
+			/* queued to another hart meanwhile */
+			spinlock_release_irqrestore(&pool->waitq.lock, irqflags);
+			continue;
+		}
+		busy = work->pending;
+		for (size_t i = 0; i < WORKQUEUE_NWORKERS; i++) {
+			busy |= pool->workers[i].running == work;
+		}
+		if (busy) {
+			/* woken up by worker after it ran some work */
+			wchan_sleep(work, &pool->waitq.lock);
+		}
+		spinlock_release_irqrestore(&pool->waitq.lock, irqflags);
+	}
+}
@@ -1,14 +1,155 @@
-#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+/* mtime frequency of qemu virt machine */
+#define TIMEBASE_FREQ 10000000ull
+#define TICKS_TO_US(ticks) ((ticks) * 1000000ull / TIMEBASE_FREQ)
+
+#define NSLEEP 100
+#define NYIELD 10000
+
+#define LOAD_SECONDS 2
+#define LOAD_FILESZ (256 * 1024)
+
+void tprintf(const char *fmt, ...)
+{
+	char buf[256];
+	va_list args;
+	va_start(args, fmt);
+	vsprintf(buf, fmt, args);
+	va_end(args);
+	write(1, buf, strlen(buf));
+	fsync(1);
+}
+
+static inline unsigned long long rdtime(void)
+{
+	unsigned long long time;
+	__asm__ __volatile__("rdtime %0" : "=r" (time));
+	return time;
+}
+
+/* Wakeup jitter is the time between requested and real wakeup.
+ * Waking up before requested time is a bug, such sleeps are counted
+ * as early and left out of jitter.
+ */
+void sleep_jitter_bench(long nsec)
+{
+	struct timespec ts = { .tv_sec = nsec / 1000000000, .tv_nsec = nsec % 1000000000 };
+	unsigned long long ns_per_tick = 1000000000ull / TIMEBASE_FREQ;
+	unsigned long long requested = (nsec + ns_per_tick - 1) / ns_per_tick;
+	unsigned long long start, elapsed, jitter;
+	unsigned long long min = -1, max = 0, sum = 0;
+	int early = 0;
+
+	for (int i = 0; i < NSLEEP; i++) {
+		start = rdtime();
+		nanosleep(&ts, NULL);
+		elapsed = rdtime() - start;
+
+		if (elapsed < requested) {
+			early++;
+			continue;
+		}
+		jitter = elapsed - requested;
+		sum += jitter;
+		if (jitter < min) {
+			min = jitter;
+		}
+		if (jitter > max) {
+			max = jitter;
+		}
+	}
+
+	if (early == NSLEEP) {
+		tprintf("sleep %ld us: all %d woke up early\n", nsec / 1000, early);
+		return;
+	}
+	tprintf("sleep %ld us: jitter min %llu us, avg %llu us, max %llu us, "
+			"early %d\n",
+			nsec / 1000,
+			TICKS_TO_US(min),
+			TICKS_TO_US(sum / (NSLEEP - early)),
+			TICKS_TO_US(max),
+			early);
+}
+
+/* Zero nanosleep yields the hart. Start two instances of test2
+ * on one hart and they will ping-pong, so every yield is a switch
+ * from one process straight to the other.
+ */
+void yield_pingpong_bench(void)
+{
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 0 };
+	unsigned long long start, elapsed;
+
+	start = rdtime();
+	for (int i = 0; i < NYIELD; i++) {
+		nanosleep(&ts, NULL);
+	}
+	elapsed = rdtime() - start;
+
+	/* both processes yielded NYIELD times in this interval */
+	tprintf("yield ping-pong: %llu ns per switch\n",
+			elapsed * (1000000000ull / TIMEBASE_FREQ) / (2 * NYIELD));
+}
+
+/* keep ext2 and virtio busy for LOAD_SECONDS */
+void fs_load(void)
+{
+	static char buf[4096];
+	unsigned long long deadline = rdtime() + LOAD_SECONDS * TIMEBASE_FREQ;
+	int fd;
+
+	memset(buf, 'x', sizeof(buf));
+
+	fd = open("/loadfile", O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0) {
+		tprintf("fs load: open() error %d\n", fd);
+		return;
+	}
+
+	while (rdtime() < deadline) {
+		for (int off = 0; off < LOAD_FILESZ; off += sizeof(buf)) {
+			write(fd, buf, sizeof(buf));
+		}
+		lseek(fd, 0, SEEK_SET);
+	}
+
+	close(fd);
+	unlink("/loadfile");
+}
+
+/* Start two instances of test2: one generates fs load and another
+ * measures how late it wakes up from sleep in the meantime.
+ */
+void fs_latency_bench(void)
+{
+	if (getpid() % 2) {
+		fs_load();
+	} else {
+		tprintf("wakeup latency under fs load:\n");
+		sleep_jitter_bench(1000000);
+	}
+}
 
 int main(void)
 {
-/*	debug_printint(getpid());
+	tprintf("Starting benchmarks\n");
+
+	yield_pingpong_bench();
+	fs_latency_bench();
 
-	for (size_t i = 0; i < 10000000; i++)
-		asm volatile("nop;");
+	sleep_jitter_bench(100000);
+	sleep_jitter_bench(1000000);
+	sleep_jitter_bench(10000000);
+
+	tprintf("Done\n");
 
-	debug_printint(getpid());
-*/
 	return 0;
 }
-